@@ -0,0 +1,65 @@
+#ifndef ALAYAVIM_BINARY_H
+#define ALAYAVIM_BINARY_H
+
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+
+// A file shown as bytes, in hex and ASCII (-b, or a file with a NUL in its
+// first 8000 bytes, which is how git and diff tell). The file is mapped,
+// not read: only the rows drawn are touched, however large it is. Edits
+// overwrite bytes in place and are kept as a sparse patch over the map;
+// save() writes each run of patched bytes with pwrite() and nothing else.
+// The map is shared with the file, so reading it past an end another
+// process truncated raises SIGBUS: fit() is asked before it is read.
+class Binary {
+  struct change {
+    long long at;
+    unsigned char before, after;
+    std::chrono::steady_clock::time_point when; // changes close in time are undone together
+  };
+
+  int fd = -1; // kept open, to see the size of the file as it is now
+  const unsigned char *map = nullptr;
+  long long length = 0;
+  std::map<long long, unsigned char> patch; // offset -> byte, where it differs from the file
+  std::vector<change> changes;
+  int where = 0; // changes[where] is the next one to redo
+
+  static bool forced;
+
+  static bool together(const change &a, const change &b);
+  void put(long long at, unsigned char byte);
+
+public:
+  static void force(bool on); // -b: every file is opened as bytes
+  static bool detect(const std::string &file);
+
+  Binary() = default;
+  Binary(const Binary &) = delete;
+  Binary &operator=(const Binary &) = delete;
+  ~Binary();
+
+  bool open(const std::string &file);
+  void close();
+  bool fit(); // maps the file again if it shrank; true if it did
+  long long size() const;
+  unsigned char at(long long offset) const;
+  size_t pending() const; // bytes patched and not saved
+  void set(long long offset, unsigned char byte);
+  // The offset of the last change undone or redone, -1 if there was none
+  long long undo(int times);
+  long long redo(int times);
+  bool save(const std::string &file);
+  size_t bytes() const;
+
+  // A row of per bytes: offset, hex and ASCII. The byte at mirror is
+  // reversed in the column the cursor is not in.
+  int digits() const;
+  int perRow(int cols) const;
+  int column(int per, int i, bool ascii) const;
+  std::string row(long long first, int per, long long mirror, bool ascii) const;
+};
+
+#endif //ALAYAVIM_BINARY_H
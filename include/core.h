@@ -1,15 +1,95 @@
 #ifndef ALAYAVIM_CORE_H
 #define ALAYAVIM_CORE_H
 
+#include <map>
+
 #include "utility.h"
 #include "filemanager.h"
+#include "watcher.h"
+#include "register.h"
+#include "grep.h"
+#include "layout.h"
+#include "diff.h"
 
 class Core {
 
   programState state = programState::Normal;
   std::vector<FileManager> buffer;
   char lastChar = 0;
+  int count = 0;            // count typed before a command
+  char pendingOperator = 0; // d or y waiting for a motion
+  int operatorCount = 0;    // count typed before the operator
+  char pendingRegister = 0; // register selected by "x
+  std::map<char, Register> registers; // '"' is the unnamed register
   int currentFile = 0;
+  Layout layout;            // windows; the current one shows currentFile
+
+  char recordingInto = 0;   // register of the macro being recorded
+  std::string recorded;     // keys pressed since q{reg}
+  int replaying = 0;        // depth of @{reg} being run
+  char lastMacro = 0;       // for @@
+  bool aborted = false;     // a motion of the macro being run failed
+
+  Watcher watcher;
+  Grep grep;
+  std::vector<Grep::match> quickfix;
+  int quickfixIndex = -1;   // the match shown last
+  std::string grepPattern;
+  std::chrono::steady_clock::time_point lastGrepPrompt;
+
+  std::vector<int> conflicts;  // buffers changed on disk while modified
+  programState conflictReturn = programState::Normal;
+
+  Diff diff;                // of the two buffers in diffed
+  int diffed[2] = {-1, -1}; // compared by :diffthis, the second one starts it
+
+  bool served = false;      // running as a server: every frame is composed
+  bool framePending = false;
+  std::chrono::steady_clock::time_point lastFrame;
+
+  static fileFormat load(const std::string &file, std::vector<Line> &content);
+  int open(const std::string &file);
+  void ensureLoaded(int file);
+  void switchTo(int file);
+  bool shown(int file) const;
+  bool composed() const;
+  void hookWindows();
+  void splitWindow(bool vertical);
+  void closeWindow();
+  void onlyWindow();
+  void windowCommand(char ch);
+  void startGrep(std::string pattern);
+  void goQuickfix(int k, bool force);
+  bool reread(FileManager &file);
+  void redraw();
+  void tick();
+  void resetPending();
+  void releaseRegisters(const std::vector<Line> *source);
+  void keep(char name, Register yanked);
+  std::string registerInfo() const;
+  std::string memoryInfo(const std::string &dump) const;
+  void runMotion(const std::string &key);
+  void handleNormal(char ch);
+  void handleVisual(char op);
+  void handleBinary(char ch);
+  bool jumpOffset(const std::string &command);
+  void stopRecording();
+  void replay(char name, int times);
+  bool parseAddress(const std::string &command, size_t &i, int &line) const;
+  bool parseRange(const std::string &command, size_t &i, int &from, int &to, bool &given) const;
+  bool runEx(const std::string &command);
+  void global(const std::string &command, int from, int to);
+  void sort(const std::string &options, int from, int to);
+  void filterLines(const std::string &cmd, int from, int to);
+  void diffThis();
+  void diffOff();
+  void startDiff();
+  int diffSide() const;
+  void refreshDiff();
+  void syncDiff();
+  void jumpHunk(int step, int times);
+  void nextConflict();
+  void resolveConflict(bool reload);
 
 public:
   bool end = false;
@@ -18,6 +98,7 @@ public:
   Core(const std::vector<std::string> &files);
   void save();
   int saveAll();
+  void press(const std::string &key);
   void handleESC();
   void exit(int code);
   void handleTAB();
@@ -25,12 +106,26 @@ public:
 
   std::string command;
   void clearPrompt();
-  bool validReplace(std::string command, std::pair<int, int> &info);
+  bool validReplace(std::string command, int from, int to, std::pair<int, int> &info,
+                    const std::vector<int> *rows = nullptr);
   void handleREDO();
-  void handleUNDO();
+  void handleUNDO(int times = 1);
   void handleENTER();
   void handle(direction ch);
   void handle(char ch);
+
+  void follow(int file);
+  void followAll();
+  void serve();
+  void diffSplit();
+  void attach(const std::string &cwd, const std::vector<std::string> &files);
+  int watchDescriptor() const;
+  int highlightDescriptor() const;
+  int grepDescriptor() const;
+  void handleGrep();
+  void handleHighlight();
+  int pollTimeout() const;
+  void handleFileChange();
 };
 
 #endif //ALAYAVIM_CORE_H
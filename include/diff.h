@@ -0,0 +1,42 @@
+#ifndef ALAYAVIM_DIFF_H
+#define ALAYAVIM_DIFF_H
+
+#include <vector>
+
+#include "line.h"
+
+// Two buffers compared line by line (:diffthis, -d). The differences are
+// kept as hunks: lines of one side that stand for lines of the other.
+// Between hunks both sides are equal. An edit of either side only widens
+// the hunk it touches, or makes a new one, and marks it stale; refresh()
+// compares again just the stale hunks, never the whole buffers.
+class Diff {
+public:
+  struct hunk {
+    int start[2], count[2]; // lines of each side
+    bool stale;
+  };
+
+private:
+  std::vector<hunk> hunks;
+  bool pending = false; // some hunk is stale
+
+  int find(int side, int line) const;
+  static void compare(const std::vector<Line> &a, int a0, int a1,
+                      const std::vector<Line> &b, int b0, int b1, std::vector<hunk> &out);
+
+public:
+  void reset(int lines0, int lines1);
+  void edit(int side, int pos, int removed, int inserted);
+  bool stale() const;
+  bool refresh(const std::vector<Line> &a, const std::vector<Line> &b);
+  size_t size() const;
+  // 'a' for a line only this side has, 'c' for one changed, 0 if equal
+  char kindOf(int side, int line) const;
+  // The line of the other side facing a line of this one
+  int facing(int side, int line) const;
+  // First line of the next hunk after line (step 1) or before it (-1), -1 if none
+  int next(int side, int line, int step) const;
+};
+
+#endif //ALAYAVIM_DIFF_H
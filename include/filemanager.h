@@ -4,60 +4,200 @@
 #include <vector>
 #include <string>
 #include <memory>
+#include <functional>
+#include <climits>
 
 #include "log.h"
+#include "register.h"
+#include "highlight.h"
+#include "utf8.h"
+#include "format.h"
+#include "memory.h"
+#include "structure.h"
+#include "binary.h"
+#include "rope.h"
+
+// Where a window is in a buffer: the cursor, the scroll and the selection
+struct view {
+  int posX = 0, posY = 0;
+  int windowStartX = 0, windowStartRow = 0;
+  char visualKind = 0;
+  int visualX = 0, visualY = 0;
+  long long offset = 0, topOffset = 0; // of a binary buffer: the cursor and the first byte shown
+  int windowStartCol = 0;
+};
 
 class FileManager {
 private:
   const std::string filename;
-  std::shared_ptr<std::vector<std::string>> content;
+  std::shared_ptr<std::vector<Line>> content;
   std::vector<std::unique_ptr<Log>> log;
 
   std::string prompt;
-  std::string board;
 
+  bool loaded = true;    // false until the file is first shown
   bool ephemeral = false;
   bool saved = true;
+  bool deleted = false;  // the file went from disk; its lines are kept
   bool numbered = false;
+  bool wrapping = true;
 
   int posX = 0;
   int posY = 0;
   int terminalHeight = 0;
   int terminalWidth = 0;
   int windowStartX = 0;
+  int windowStartRow = 0; // first shown row of line windowStartX
+  int windowStartCol = 0; // first shown column, when lines are not wrapped
+  int shownRows = 0;      // rows drawn by the last display()
+  int shownEnd = 0;       // one past the last line drawn completely
   int lineWidth = 0;
   int width = 0;
   int where = 0; // log[where]
+  unsigned long revision = 0; // bumped whenever the lines or their colors change
+  fileStamp stamp;
+  fileFormat format;
 
-  void getTerminalSize();
+  int followFd = -1;
+  long long followOffset = 0;
+  bool followPartial = false; // the last line has no newline yet
+  int appendedFrom = -1;      // first line pulled but not drawn yet
+
+  char visualKind = 0;        // 'v', 'V' or CTRL_V while selecting
+  int visualX = 0, visualY = 0;
+  int markStartX = 0, markEndX = 0; // '< and '>, the lines of the last selection
+
+  mutable ColumnCache columns;
+  mutable Structure structure; // brackets and blank lines, for %, { and }
+  std::string typing;         // bytes of a character being typed
+  Rope rope;                  // the long line being typed into
+  int ropeLine = -1;          // its line, stale in content until settle()
+  bool ropeEdited = false;    // typed into since it was opened or settled
+  Line ropeSource;            // the line the rope holds, once settled
+
+  std::unique_ptr<Binary> binary; // set when the file is shown as bytes
+  long long offset = 0;       // the byte under the cursor
+  long long topOffset = 0;    // the first byte of the window
+  int perRow = 16;            // bytes a row, for the width of the window
+  bool asciiSide = false;     // the cursor is in the ASCII column, not the hex one
+  bool lowNibble = false;     // the second hex digit of the byte is typed next
 
-  void splitLine(const std::string &line, std::vector<std::string> &output, int lineid) const;
+  int lengthOf(int line) const;
+  std::string textOf(int line, int from, int n) const;
+  int ropeStride() const;
+  int ropeFrom(int byte) const;
+  int ropeWidth(int from, int to) const;
+  const Columns *columnsOf(int line) const;
+  int widthOf(int line) const;
+  int columnOf(int line, int byte) const;
+  int byteAt(int line, int column) const;
+  int nextChar(int line, int byte) const;
+  int prevChar(int line, int byte) const;
+  int lineEnd(int line) const;
+  int classOf(int line, int byte, bool big) const;
+  motion wordMotion(char key, int count, bool operating) const;
+  std::pair<int, int> placeOf(int line, int byte) const;
+  std::pair<int, int> blockColumns() const;
+  std::pair<int, int> bytesOf(int line, int c1, int c2) const;
+  int rowsOf(int line, int limit = INT_MAX) const;
+  void scrollToCursor(int height);
+  std::vector<std::string> frame(int height, int &cursorRow);
+  std::vector<std::string> binaryFrame(int height, int &cursorRow) const;
+  void shrunk();
+  int binaryColumn() const;
+
+  std::shared_ptr<Highlighter> highlighter;
+
+  static bool suspended; // while a macro runs: nothing is drawn
+
+  std::string paint(std::string_view line, int from, int to, const std::vector<span> *spans,
+                    int selFrom, int selTo, bool invalid) const;
+  bool splitLine(int line, std::vector<std::string> &output,
+                 int selFrom = -1, int selTo = -1, const std::vector<span> *spans = nullptr,
+                 char differs = 0, int first = 0, int count = INT_MAX) const;
+  std::pair<int, int> selectionOf(int line) const;
+  void changed(int pos, int removed, int inserted);
+  void splice(int pos, int at, int removed, std::string_view inserted);
+  void commitSplice(int pos, int at, int removed, std::string inserted);
+  void replaceLines(int pos, int count, const std::vector<Line> &lines);
+  void removeRows(const std::vector<int> &rows, std::vector<Line> *removed);
+  void restoreRows(const std::vector<int> &rows, const std::vector<Line> &removed);
+  void detach();
+  void replaceRange(int from, int to, std::vector<Line> lines);
 
 public:
-  FileManager(const std::vector<std::string> &fileContent,
+  // Called before content is written while other owners (registers) share it
+  std::function<void(const std::vector<Line> *)> onShared;
+  // Set while the screen is split: draws every window instead of this one
+  std::function<void()> onDisplay;
+  // Set while the buffer is compared with another: told of every change
+  // of its lines, and asked how each drawn line differs ('a' or 'c')
+  std::function<void(int, int, int)> onChange;
+  std::function<char(int)> diffOf;
+
+  FileManager(const std::vector<Line> &fileContent,
               std::string name);
+  explicit FileManager(std::string name);
   FileManager(FileManager &&other) noexcept;
+  ~FileManager();
 
+  static void suspend(bool on);
+  static bool isSuspended();
   static void clearTerminal() {
     printf("%s%s", ANSI::clearScreen().c_str(), ANSI::clearBuffer().c_str());
     printf("%s", ANSI::cursorPosition(1, 1).c_str());
     fflush(stdout);
   }
 
+  const std::string &name() const;
+  bool isLoaded() const;
+  void load(const std::vector<Line> &fileContent, const fileFormat &f = fileFormat());
+  bool loadBinary();
+  bool isBinary() const;
+  void reopen();
+  std::shared_ptr<const std::vector<Line>> snapshot();
+  void settle();
+  void endTyping();
   bool isSaved() const;
+  bool unchanged() const;
+  bool changedOnDisk() const;
+  bool readable() const;
+  void markDeleted();
+  void syncStamp();
+  void reload(const std::vector<Line> &fresh, const fileFormat &f);
+  bool following() const;
+  bool follow();
+  void unfollow();
+  bool pull();
+  void drawAppended();
   void setNumber();
   void setNoNumber();
-  void commitModify(int pos, const std::string &newContent);
-  void commitInsert(int pos, const std::string &newContent);
+  void setWrap(bool on);
+  void intern();
+  void commitModify(int pos, Line newContent);
+  void commitInsert(int pos, Line newContent);
   void commitDelete(int pos);
+  std::shared_ptr<const std::vector<Line>> commitRange(int pos, int count,
+                                                    std::vector<Line> newContent);
+  std::shared_ptr<const std::vector<Line>> commitFilter(std::vector<int> rows);
   void undo(const std::unique_ptr<Log> &log_);
   void redo(const std::unique_ptr<Log> &log_);
-  bool undo();
-  bool redo();
+  bool undo(int times = 1);
+  bool redo(int times = 1);
+  int history() const;
+  void join(int since);
 
   void setPrompt(const std::string &p, bool e = false);
   void updateCommandDisplay() const;
+  void getTerminalSize();
   void display();
+  view current() const;
+  void show(const view &v);
+  void fit(int height, int cols);
+  void render(int top, int left, int height, int cols, std::vector<std::string> &shown);
+  std::pair<int, int> cursorCell() const;
+  std::string signature() const;
+  const std::string &promptText() const;
   void moveCursor(direction d);
   void toLastChar();
   void toNextLine(bool logFlag = false);
@@ -68,17 +208,41 @@ public:
   bool jumpTo(int line);
   void enter();
   void backspace();
-  void deleteLine();
-  void copyLine();
-  void pasteLine();
+  motion findMotion(const std::string &key, int count, bool counted, bool operating = false) const;
+  void moveTo(const motion &m);
+  void operate(char op, const motion &m, Register &yanked);
+  void operateLines(char op, int from, int to, Register &yanked);
+  std::vector<int> matching(const std::string &pattern, bool invert, int from, int to) const;
+  void deleteRows(std::vector<int> rows, Register &yanked);
+  void shiftLines(int from, int to, int levels, bool right);
+  int sortLines(int from, int to, bool numeric, bool unique, bool reverse);
+  int filterLines(int from, int to, const std::string &cmd, int &status);
+  char visual() const;
+  void startVisual(char kind);
+  void stopVisual();
+  void swapVisual();
+  void operateVisual(char op, int count, Register &yanked);
+  int cursorLine() const;
+  int lineCount() const;
+  std::pair<int, int> marks() const;
+  void paste(const Register &reg, int count);
+  long long cursorOffset() const;
+  int rowBytes() const;
+  void moveOffset(long long to);
+  void switchColumn();
+  bool overwrite(char c);
   void insertChar(char c);
   std::string replace_str(const std::string &s, const std::string &pattern, const std::string &replacement, int &occurs, int row);
-  std::pair<int, int> replace(const std::string &pattern, const std::string &replacement, bool inFile);
+  std::pair<int, int> replace(const std::string &pattern, const std::string &replacement, int from, int to,
+                              const std::vector<int> *rows = nullptr);
   std::string fileInfo();
+  memoryUsage memory(MemoryCount &count) const;
   void save(bool print = false);
   void clearPrompt();
   void openPrompt();
   void filePrompt();
+  bool collectHighlight();
+  void recolor();
 };
 
 #endif //ALAYAVIM_FILEMANAGER_H
\ No newline at end of file
@@ -0,0 +1,21 @@
+#ifndef ALAYAVIM_FILTER_H
+#define ALAYAVIM_FILTER_H
+
+#include <string>
+#include <vector>
+
+#include "line.h"
+
+// :sort and :{range}!cmd. Both turn the lines of a range into the lines
+// that replace it, which the buffer commits as one change.
+namespace filter {
+  // By text, or by the first number of each line (numeric), dropping all
+  // but the first of equal lines (unique): identical ones, or with numeric
+  // the ones with the same number. Equal lines keep their order.
+  void sort(std::vector<Line> &lines, bool numeric, bool unique, bool reverse);
+  // Runs cmd with the shell, writing the lines to its input while reading
+  // its output and errors into out. The exit status, -1 if it did not run.
+  int run(const std::string &cmd, const Line *begin, const Line *end, std::vector<Line> &out);
+}
+
+#endif //ALAYAVIM_FILTER_H
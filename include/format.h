@@ -0,0 +1,25 @@
+#ifndef ALAYAVIM_FORMAT_H
+#define ALAYAVIM_FORMAT_H
+
+#include <string>
+#include <vector>
+
+#include "line.h"
+
+// How a file is laid out besides its lines, so that saving an unchanged
+// buffer writes back the same bytes.
+struct fileFormat {
+  bool crlf = false;         // every line ends in \r\n
+  bool bom = false;          // starts with a UTF-8 byte order mark
+  bool finalNewline = true;  // the last line ends with a newline too
+};
+
+namespace format {
+  // Splits a file into lines. A missing file gives no lines and the default format.
+  fileFormat read(const std::string &file, std::vector<Line> &content);
+  bool write(const std::string &file, const std::vector<Line> &content, const fileFormat &f);
+  long long size(const std::vector<Line> &content, const fileFormat &f); // bytes on disk
+  std::string describe(const fileFormat &f);  // like " [dos] [noeol]", empty for plain files
+}
+
+#endif //ALAYAVIM_FORMAT_H
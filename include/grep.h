@@ -0,0 +1,68 @@
+#ifndef ALAYAVIM_GREP_H
+#define ALAYAVIM_GREP_H
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "line.h"
+
+// Searches many files at once on a pool of threads, one file per job. A
+// loaded buffer is searched in a snapshot of its lines, any other file is
+// read from disk. The matches of each file are handed over as soon as it
+// is done, and a byte on a pipe wakes the main loop to collect them.
+class Grep {
+public:
+  static constexpr size_t MAX_MATCHES = 100000;
+  static constexpr size_t MAX_TEXT = 200;  // bytes of a matching line kept
+
+  struct match {
+    int file, line, column;
+    std::string text;
+  };
+  struct target {
+    int file;
+    std::string name;
+    std::shared_ptr<const std::vector<Line>> lines;  // null: read the file
+  };
+
+private:
+  struct job {
+    unsigned long generation;
+    std::shared_ptr<const std::string> pattern;
+    target what;
+  };
+
+  std::vector<std::thread> pool;
+  std::mutex lock;
+  std::condition_variable ready;
+  std::deque<job> jobs;
+  std::vector<match> found;     // written by the workers
+  unsigned long generation = 0;
+  size_t matches = 0;
+  int left = 0;                 // files of this search not done yet
+  int total = 0;
+  bool stop = false;
+  int fds[2] = {-1, -1};
+
+  void run();
+  static void search(const std::string &pattern, const target &what, std::vector<match> &out);
+
+public:
+  Grep();
+  ~Grep();
+  Grep(const Grep &) = delete;
+  Grep &operator=(const Grep &) = delete;
+
+  void start(const std::string &pattern, std::vector<target> targets);
+  int descriptor() const;
+  std::vector<match> collect();
+  bool running();
+  int files();
+};
+
+#endif //ALAYAVIM_GREP_H
@@ -0,0 +1,100 @@
+#ifndef ALAYAVIM_HIGHLIGHT_H
+#define ALAYAVIM_HIGHLIGHT_H
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+
+#include "line.h"
+
+enum class token : unsigned char {
+  Keyword = 0,
+  Type = 1,
+  String = 2,
+  Number = 3,
+  Comment = 4,
+  Preprocessor = 5,
+  Key = 6,
+  Constant = 7,
+  Error = 8,
+  Warning = 9,
+  Info = 10,
+  Debug = 11,
+  Time = 12,
+};
+
+struct span {
+  int from, to;
+  token kind;
+};
+
+// A row of the language table: the generic lexer is driven by these
+// fields only, so adding a language is adding a row.
+struct language {
+  std::string name;
+  std::vector<std::string> extensions;
+  std::string lineComment, blockOpen, blockClose;
+  std::string quotes;
+  bool preprocessor = false; // '#' starts a directive
+  bool keys = false;         // a string followed by ':' is a key
+  bool timestamps = false;   // numbers with ':' or '-' are times
+  bool ignoreCase = false;   // words are matched in upper case
+  std::unordered_map<std::string, token> words;
+};
+
+// Per-buffer highlighting. The end state of every line is cached (one
+// byte per line), spans only for lines around the window. Lines are
+// lexed on a worker thread from the first stale line near the window,
+// and lexing stops once a line ends in the state it had before.
+class Highlighter: public std::enable_shared_from_this<Highlighter> {
+public:
+  static constexpr unsigned char STALE = 0x80;
+  static constexpr int SYNC_LINES = 500;   // how far back to look for a known state
+  static constexpr int SPAN_LINES = 4096;  // lines with cached spans
+  static constexpr size_t MAX_WINDOWS = 4; // windows whose spans are kept
+  static constexpr size_t LEX_BYTES = 1 << 16; // a longer line is colored this far, like vim's synmaxcol
+
+  struct result {
+    unsigned long generation;
+    int first;
+    std::vector<unsigned char> states;
+    std::vector<std::vector<span>> spans;
+  };
+
+private:
+  const language *lang;
+  unsigned long generation = 0;
+  std::vector<unsigned char> states;
+  std::map<int, std::vector<span>> cached;
+  std::vector<int> windows;  // first lines of the windows asked for lately
+  bool pending = false;
+  unsigned long pendingGeneration = 0;
+
+  std::mutex lock;
+  std::vector<result> done;  // written by the worker
+
+  bool dirty(int line) const;
+
+public:
+  Highlighter(const language *lang, size_t lines);
+
+  static const language *detect(const std::string &filename);
+  static unsigned char lex(const language &lang, std::string_view line,
+                           unsigned char state, std::vector<span> &spans);
+  static int colorOf(token kind);
+  static int descriptor();
+  static void drain();
+
+  void edit(int pos, int removed, int inserted);
+  const std::vector<span> *spans(int line) const;
+  void request(const std::vector<Line> &content, int first, int last, int margin);
+  void finish(result &&r);
+  bool collect();
+  size_t bytes() const;
+};
+
+#endif //ALAYAVIM_HIGHLIGHT_H
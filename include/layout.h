@@ -0,0 +1,73 @@
+#ifndef ALAYAVIM_LAYOUT_H
+#define ALAYAVIM_LAYOUT_H
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "filemanager.h"
+#include "utility.h"
+
+// A window shows one buffer through a view of its own. The view of the
+// current window lives in its buffer; the others are kept here.
+struct window {
+  int file = 0;
+  view at;
+  int top = 0, left = 0, height = 0, width = 0; // text area, the status row is below
+  std::string drawn; // what was drawn last time; redrawn when it differs
+  std::vector<std::string> rows; // and row by row, only the rows that differ
+};
+
+// Windows tiled by horizontal and vertical splits of the screen, above
+// the prompt row. compose() is the one place that draws them: a window
+// is drawn again only when its buffer, its scroll or its place changed,
+// and then only its rows that differ from what they showed, then the
+// prompt and the cursor of the current window are put back.
+class Layout {
+  static constexpr int MIN_HEIGHT = 1; // text rows of a window
+  static constexpr int MIN_WIDTH = 12;
+
+  struct node {
+    int id = -1; // a window, or a split into first and second
+    bool vertical = false;
+    std::unique_ptr<node> first, second;
+    node *parent = nullptr;
+  };
+
+  std::unique_ptr<node> root;
+  std::map<int, window> windows;
+  int focused = 0, nextId = 1;
+  int rows = 0, cols = 0;
+  bool fresh = true; // the whole screen has to be drawn
+  struct separator {
+    int column, top, height;
+  };
+  std::vector<separator> separators;
+
+  node *find(node *n, int id) const;
+  void leaves(const node *n, std::vector<int> &ids) const;
+  void arrange();
+  void arrange(node *n, int top, int left, int height, int width);
+  void focus(int id, std::vector<FileManager> &buffer);
+  void drawStatus(const window &w, const FileManager &file, bool current) const;
+
+public:
+  Layout();
+
+  void resize();
+  int count() const;
+  int file() const;
+  int showing(int file) const;
+  std::vector<int> files() const;
+  void show(int file);
+  bool split(bool vertical, std::vector<FileManager> &buffer);
+  void close(std::vector<FileManager> &buffer);
+  void only();
+  void cycle(int step, std::vector<FileManager> &buffer);
+  bool go(direction d, std::vector<FileManager> &buffer);
+  void align(int file, int line, int top);
+  void compose(std::vector<FileManager> &buffer);
+};
+
+#endif //ALAYAVIM_LAYOUT_H
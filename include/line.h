@@ -0,0 +1,156 @@
+#ifndef ALAYAVIM_LINE_H
+#define ALAYAVIM_LINE_H
+
+#include <atomic>
+#include <cstring>
+#include <ostream>
+#include <string>
+#include <string_view>
+
+// A line of text: an immutable, reference-counted string in one heap
+// block (the empty line needs none). Copying a line copies a pointer, so
+// snapshots, undo records and registers share the bytes of their lines
+// instead of holding copies. With interning on (-i or :set intern), a
+// line made from text is looked up in a hashed pool first and shares the
+// block of an equal line, which makes a repetitive file several times
+// smaller. Lines may be released on other threads (grep, highlighting),
+// so the count is atomic and the pool has a lock.
+class Line {
+  struct block {
+    std::atomic<unsigned> refs;
+    unsigned size;
+    bool pooled;
+    char data[1]; // size bytes and a '\0'
+  };
+  block *b = nullptr;
+
+  static block *allocate(std::string_view s, bool pooled);
+  static block *make(std::string_view s);
+  static void release(block *b);
+
+public:
+  static constexpr size_t npos = std::string::npos;
+
+  Line() = default;
+  Line(std::string_view s) : b(make(s)) {}
+  Line(const std::string &s) : b(make(s)) {}
+  Line(const char *s) : b(make(s)) {}
+  Line(const char *s, size_t n) : b(make(std::string_view(s, n))) {}
+  Line(const Line &other) : b(other.b) {
+    if (b) b->refs.fetch_add(1, std::memory_order_relaxed);
+  }
+  Line(Line &&other) noexcept : b(other.b) {
+    other.b = nullptr;
+  }
+  Line &operator=(Line other) noexcept {
+    std::swap(b, other.b);
+    return *this;
+  }
+  ~Line() {
+    if (b) release(b);
+  }
+
+  static void intern(bool on);
+  static bool interning();
+  static size_t pooled();      // distinct lines in the pool
+  static size_t poolBytes();   // the pool's own table
+
+  operator std::string_view() const {
+    return b ? std::string_view(b->data, b->size) : std::string_view();
+  }
+  std::string_view view() const {
+    return *this;
+  }
+  std::string str() const {
+    return std::string(view());
+  }
+  size_t size() const {
+    return b ? b->size : 0;
+  }
+  bool empty() const {
+    return !b;
+  }
+  const char *data() const {
+    return b ? b->data : "";
+  }
+  const char *begin() const {
+    return data();
+  }
+  const char *end() const {
+    return data() + size();
+  }
+  char operator[](size_t i) const {
+    return b->data[i];
+  }
+  char front() const {
+    return b->data[0];
+  }
+  char back() const {
+    return b->data[b->size - 1];
+  }
+  std::string substr(size_t pos, size_t n = npos) const {
+    return std::string(view().substr(pos, n));
+  }
+  size_t find(std::string_view s, size_t pos = 0) const {
+    return view().find(s, pos);
+  }
+  size_t find(char c, size_t pos = 0) const {
+    return view().find(c, pos);
+  }
+  size_t rfind(char c, size_t pos = npos) const {
+    return view().rfind(c, pos);
+  }
+  size_t find_first_not_of(std::string_view s, size_t pos = 0) const {
+    return view().find_first_not_of(s, pos);
+  }
+  size_t find_first_not_of(char c, size_t pos = 0) const {
+    return view().find_first_not_of(c, pos);
+  }
+  size_t find_last_not_of(std::string_view s, size_t pos = npos) const {
+    return view().find_last_not_of(s, pos);
+  }
+  int compare(size_t pos, size_t n, std::string_view s) const {
+    return view().compare(pos, n, s);
+  }
+  // Heap bytes of this line's share of its block
+  size_t bytes() const;
+  bool shares(const Line &other) const {
+    return b == other.b;
+  }
+
+  friend bool operator==(const Line &a, const Line &b) {
+    return a.b == b.b || a.view() == b.view();
+  }
+  friend bool operator!=(const Line &a, const Line &b) {
+    return !(a == b);
+  }
+  friend bool operator==(const Line &a, std::string_view b) {
+    return a.view() == b;
+  }
+  friend bool operator!=(const Line &a, std::string_view b) {
+    return a.view() != b;
+  }
+  friend bool operator==(const Line &a, const std::string &b) {
+    return a.view() == b;
+  }
+  friend bool operator!=(const Line &a, const std::string &b) {
+    return a.view() != b;
+  }
+  friend bool operator==(const Line &a, const char *b) {
+    return a.view() == b;
+  }
+  friend bool operator!=(const Line &a, const char *b) {
+    return a.view() != b;
+  }
+  friend std::string operator+(const Line &a, std::string_view b) {
+    return a.str().append(b);
+  }
+  friend std::string operator+(std::string a, const Line &b) {
+    return a.append(b.view());
+  }
+  friend std::ostream &operator<<(std::ostream &out, const Line &l) {
+    return out << l.view();
+  }
+};
+
+#endif //ALAYAVIM_LINE_H
@@ -3,18 +3,27 @@
 
 #include <chrono>
 #include <string>
+#include <vector>
+#include <memory>
 
 #include "utility.h"
+#include "line.h"
+#include "memory.h"
 class Log {
 protected:
   std::chrono::time_point<std::chrono::high_resolution_clock> timestamp;
 public:
+  bool joined = false; // undone and redone together with the record before
+
   Log() {
     timestamp = std::chrono::high_resolution_clock::now();
   }
   friend size_t duration(const Log &a, const Log &b) {
     return std::chrono::duration_cast<std::chrono::milliseconds>(b.timestamp - a.timestamp).count();
   }
+  virtual size_t bytes(MemoryCount &) const {
+    return sizeof(Log);
+  }
   virtual ~Log() = default;
 };
 
@@ -22,10 +31,55 @@ class LogContent: public Log {
 public:
   atomType type;
   int posX;
-  std::string oldContent, newContent;
+  Line oldContent, newContent; // shared with the buffer, not copied
 
-  LogContent(const atomType &type, const int &posX, const std::string &oldContent, const std::string &newContent):
-          type(type), posX(posX), oldContent(oldContent), newContent(newContent) {}
+  LogContent(const atomType &type, const int &posX, Line oldContent, Line newContent):
+          type(type), posX(posX), oldContent(std::move(oldContent)), newContent(std::move(newContent)) {}
+  size_t bytes(MemoryCount &) const override {
+    return sizeof(*this) + oldContent.bytes() + newContent.bytes();
+  }
+};
+// Replaces the lines [posX, posX + oldContent.size()) with newContent in
+// one record, so a command over many lines is a single undo step. The
+// lines are immutable, so registers can share them.
+class LogRange: public Log {
+public:
+  int posX;
+  std::shared_ptr<const std::vector<Line>> oldContent, newContent;
+
+  LogRange(int posX, std::shared_ptr<const std::vector<Line>> oldContent,
+           std::shared_ptr<const std::vector<Line>> newContent):
+          posX(posX), oldContent(std::move(oldContent)), newContent(std::move(newContent)) {}
+  size_t bytes(MemoryCount &count) const override {
+    return sizeof(*this) + count.shared(oldContent.get()) + count.shared(newContent.get());
+  }
+};
+// Removes the lines at rows (ascending, numbered as before the removal)
+// in one pass, as :g/pattern/d does. Only the removed lines are kept.
+class LogFilter: public Log {
+public:
+  std::vector<int> rows;
+  std::shared_ptr<const std::vector<Line>> removed;
+
+  LogFilter(std::vector<int> rows, std::shared_ptr<const std::vector<Line>> removed):
+          rows(std::move(rows)), removed(std::move(removed)) {}
+  size_t bytes(MemoryCount &count) const override {
+    return sizeof(*this) + rows.capacity() * sizeof(int) + count.shared(removed.get());
+  }
+};
+// Replaces removed with inserted at byte at of line posX, as typing does.
+// Only the bytes typed or deleted are kept, not the line, so typing into
+// a line of many megabytes does not keep a copy of it per key.
+class LogSplice: public Log {
+public:
+  int posX, at;
+  std::string removed, inserted;
+
+  LogSplice(int posX, int at, std::string removed, std::string inserted):
+          posX(posX), at(at), removed(std::move(removed)), inserted(std::move(inserted)) {}
+  size_t bytes(MemoryCount &) const override {
+    return sizeof(*this) + MemoryCount::heap(removed) + MemoryCount::heap(inserted);
+  }
 };
 class LogCursor: public Log {
 public:
@@ -33,6 +87,9 @@ public:
   int newX, newY;
   LogCursor(int oldX, int oldY, int newX, int newY):
           oldX(oldX), oldY(oldY), newX(newX), newY(newY) {}
+  size_t bytes(MemoryCount &) const override {
+    return sizeof(*this);
+  }
 };
 
 #endif //ALAYAVIM_LOG_H
@@ -0,0 +1,35 @@
+#ifndef ALAYAVIM_MEMORY_H
+#define ALAYAVIM_MEMORY_H
+
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "line.h"
+
+// Counts the heap bytes held by the parts of the editor by walking them
+// when asked (:mem), so keeping the counts costs nothing while editing.
+// Sizes are capacities; allocator overhead is not included. Line storage
+// shared by several owners (a buffer, undo records, registers) is counted
+// once, by the first owner walked.
+class MemoryCount {
+  std::unordered_set<const void *> seen;
+
+public:
+  static size_t heap(const std::string &s);  // 0 for short strings kept inline
+  static size_t of(const std::vector<Line> &lines);
+  size_t shared(const std::vector<Line> *lines);  // 0 if counted already
+
+  static std::string human(size_t bytes);    // like 12.3MB
+  static std::string json(const std::string &s);
+};
+
+// The bytes of one buffer
+struct memoryUsage {
+  size_t text = 0;     // the lines
+  size_t history = 0;  // the undo log
+  size_t records = 0;
+  size_t caches = 0;   // columns, highlighting, brackets, prompt
+};
+
+#endif //ALAYAVIM_MEMORY_H
@@ -0,0 +1,36 @@
+#ifndef ALAYAVIM_REGISTER_H
+#define ALAYAVIM_REGISTER_H
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "line.h"
+#include "memory.h"
+
+// Yanked text as an immutable slice of shared line storage: a snapshot of
+// a buffer or the lines removed by an edit. Yanking costs O(1); a slice of
+// a buffer is copied out (materialize) only before that buffer changes.
+class Register {
+  std::shared_ptr<const std::vector<Line>> source;
+  int begin = 0, end = 0;           // lines [begin, end) of source
+  size_t head = 0;                  // the text starts at this column of the first line
+  size_t tail = std::string::npos;  // and ends before this column of the last line
+
+public:
+  bool linewise = true;
+  bool blockwise = false;
+
+  Register() = default;
+  Register(std::shared_ptr<const std::vector<Line>> source, int begin, int end,
+           bool linewise, size_t head = 0, size_t tail = std::string::npos);
+
+  bool empty() const;
+  int size() const;
+  Line line(int i) const;
+  const std::vector<Line> *shares() const;
+  void materialize();
+  size_t bytes(MemoryCount &count) const;
+};
+
+#endif //ALAYAVIM_REGISTER_H
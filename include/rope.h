@@ -0,0 +1,42 @@
+#ifndef ALAYAVIM_ROPE_H
+#define ALAYAVIM_ROPE_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+// A long line cut into chunks while it is typed into, so that a key moves
+// the bytes of one chunk instead of copying the whole line. A chunk grown
+// past twice CHUNK is split and an empty one dropped; the start of every
+// chunk is kept, so the chunk holding a byte is found by binary search.
+// Any UTF-8 may be in it; the bytes of non-ASCII characters are counted,
+// and characters are stepped over by their lead bytes.
+class Rope {
+public:
+  static constexpr size_t CHUNK = 1 << 16;
+
+private:
+  std::vector<std::string> chunks;
+  std::vector<size_t> starts; // of each chunk in the line
+  size_t length = 0;
+  size_t multibyte = 0; // bytes of non-ASCII characters
+
+  int find(size_t at) const; // the chunk holding byte at, the last one for the end
+  void restart(int from);
+
+public:
+  Rope() = default;
+  explicit Rope(std::string_view text);
+
+  size_t size() const;
+  bool ascii() const;
+  unsigned char at(size_t i) const;
+  size_t charStart(size_t i) const; // of the character holding byte i
+  size_t charNext(size_t i) const;  // start of the character after the one at i
+  void splice(size_t at, size_t removed, std::string_view inserted);
+  std::string substr(size_t from, size_t n) const;
+  std::string str() const;
+  size_t bytes() const;
+};
+
+#endif //ALAYAVIM_ROPE_H
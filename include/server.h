@@ -0,0 +1,61 @@
+#ifndef ALAYAVIM_SERVER_H
+#define ALAYAVIM_SERVER_H
+
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/ioctl.h>
+
+// Keeps the editor running with no terminal of its own (-S). The editor
+// reads keys from and draws on a pseudo-terminal as usual; a thread copies
+// what it draws to the attached client over a Unix socket, and the keys of
+// the client back. Without a client the output is dropped: the next client
+// to attach gets a full redraw. A new client takes over from the old one.
+class Server {
+public:
+  struct attachment {
+    std::string cwd;                 // of the client, for relative names
+    std::vector<std::string> files;  // to open, the first one is shown
+  };
+
+  static constexpr char DETACH = 28; // CTRL-\ in the client
+
+private:
+  std::string path;
+  int master = -1, listener = -1, client = -1;
+  int greeting = -1;   // a client still sending its header
+  std::string header;  // what it sent so far
+  std::chrono::steady_clock::time_point greetBy;
+  int fds[2] = {-1, -1};   // wakes the main loop for an attachment
+  int wake[2] = {-1, -1};  // stops the relay
+  std::thread relay;
+  std::mutex lock;
+  std::deque<attachment> pending;
+
+  void run();
+  void accept();
+  void hear();
+  bool forward();
+  void type(const char *p, size_t n);
+  void drop();
+  static bool greet(const std::string &got, attachment &a, struct winsize &size, std::string &rest);
+
+public:
+  Server() = default;
+  ~Server();
+  Server(const Server &) = delete;
+  Server &operator=(const Server &) = delete;
+
+  static std::string socketPath();
+  static int connect(const std::string &path);
+  static int attach(int fd, const std::vector<std::string> &files);
+
+  bool start(const std::string &file, const struct winsize &size);
+  int descriptor() const;
+  std::vector<attachment> collect();
+};
+
+#endif //ALAYAVIM_SERVER_H
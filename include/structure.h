@@ -0,0 +1,72 @@
+#ifndef ALAYAVIM_STRUCTURE_H
+#define ALAYAVIM_STRUCTURE_H
+
+#include <utility>
+#include <vector>
+
+#include "line.h"
+
+// The brackets and blank lines of a buffer, for %, { and }. Lines are kept
+// in blocks of a few hundred: a byte of flags per line, and the brackets a
+// line leaves unmatched if it has any. A segment tree over the blocks sums
+// their lines, blank lines and bracket depths, so the bracket matching one
+// and the next blank line are found in O(log n) however far away they are.
+// Built on first use; an edit marks its lines stale, rescanned when asked.
+class Structure {
+public:
+  static constexpr int TYPES = 3; // (), [] and {}
+
+private:
+  static constexpr int BLOCK = 512; // a block of twice as many lines is split
+
+  // One kind of bracket over some lines: openers minus closers, and the
+  // lowest depth reached reading them forward, and backward with the
+  // closers counted up
+  struct depth {
+    int sum = 0, low = 0, back = 0;
+  };
+  struct summary {
+    int lines = 0, blanks = 0, stale = 0;
+    depth d[TYPES];
+  };
+  struct brackets {
+    int close[TYPES] = {}, open[TYPES] = {}; // left unmatched in the line
+  };
+  enum : unsigned char { BLANK = 1, STALE = 2 };
+  struct block {
+    std::vector<unsigned char> flags;           // of each line
+    std::vector<std::pair<int, brackets>> marks; // the lines with brackets, by offset
+    summary sum;
+  };
+
+  bool built = false;
+  std::vector<block> blocks;
+  std::vector<summary> tree; // over the blocks, the root at 1
+  int leaves = 0;
+
+  static summary join(const summary &a, const summary &b);
+  static bool scan(std::string_view line, brackets &b);
+  static void tally(block &k);
+  void rebuild();
+  void update(int b);
+  void rescan(int b, int start, const std::vector<Line> &content);
+  int locate(int line, int &offset) const;
+  int startOf(int b) const;
+  template<typename Hit>
+  int forward(int node, int l, int r, int from, summary &acc, const Hit &hit) const;
+  template<typename Hit>
+  int backward(int node, int l, int r, int to, summary &acc, const Hit &hit) const;
+  int flagged(int from, int step, bool blank) const;
+
+public:
+  void clear();
+  void sync(const std::vector<Line> &content);
+  void edit(int pos, int removed, int inserted);
+  // The bracket matching the first one at or after byte y of line x
+  bool match(const std::vector<Line> &content, int x, int y, int &mx, int &my);
+  // The blank line ending the paragraph after line (step 1) or before it (-1), -1 if none
+  int paragraph(const std::vector<Line> &content, int line, int step);
+  size_t bytes() const;
+};
+
+#endif //ALAYAVIM_STRUCTURE_H
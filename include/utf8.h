@@ -0,0 +1,86 @@
+#ifndef ALAYAVIM_UTF8_H
+#define ALAYAVIM_UTF8_H
+
+#include <map>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "line.h"
+
+namespace utf8 {
+  size_t asciiPrefix(const char *s, size_t n);  // bytes before the first non-ASCII one
+  bool ascii(std::string_view s);
+  bool valid(std::string_view s);
+  int decode(const char *s, size_t n, char32_t &cp); // bytes of the sequence, 0 if invalid
+  int width(char32_t cp);                            // 0, 1 or 2 terminal cells
+  int missing(std::string_view s);                   // bytes still to come for the last character
+  size_t lastStart(std::string_view s);              // start of the last character
+  std::string sanitize(std::string_view s);          // invalid bytes become U+FFFD
+}
+
+// Cursor stops of a line with non-ASCII bytes, found by walking its
+// grapheme clusters. No table of every cluster is kept: a mark every
+// STEP bytes or so holds the byte offset and column of a cluster start,
+// so a query walks at most a chunk from the mark before it. Marks are
+// laid down, and rows wrapped, only as far as a query has gone; a line
+// drawn from its start is never walked to its end. The text is not
+// owned and must outlive the columns.
+class Columns {
+  static constexpr int STEP = 256;
+
+  std::string_view text;
+  mutable std::vector<std::pair<int, int>> marks; // byte, column
+  mutable bool walked = false;                    // marks reach the end
+  mutable int wrapWidth = 0;
+  mutable std::vector<std::pair<int, int>> rowStarts; // byte, column, for wrapWidth
+  mutable bool wrapped = false;                       // rowStarts reach the end
+
+  int cluster(int byte, int &cells) const;
+  void walk(int &byte, int &column, int maxByte, int maxColumn) const;
+  std::pair<int, int> find(int maxByte, int maxColumn) const;
+  void wrap(int width, int row, int byte) const;
+
+public:
+  bool valid = true;
+
+  explicit Columns(std::string_view line);
+
+  int width() const;
+  int columnOf(int byte) const;
+  int byteAt(int column) const;  // start of the cluster covering column
+  int next(int byte) const;
+  int prev(int byte) const;
+  int last() const;              // start of the last cluster
+  int rows(int width, int limit) const;  // rows wrapped at width, counted up to limit
+  int rowStart(int row, int width) const; // the end of the line past the last row
+  std::pair<int, int> place(int byte, int width) const; // row and column on screen
+  size_t bytes() const;
+};
+
+// Columns of the lines of a buffer. Whether a line is ASCII is kept in
+// one byte per line; ASCII lines, the common case, need nothing else as
+// their byte offsets are their columns. The columns of other lines are
+// built when the line is drawn or walked over, and at most MAX_LAYOUTS of
+// them are kept. A pointer from get() is valid until the next call.
+class ColumnCache {
+  static constexpr size_t MAX_LAYOUTS = 4096;
+
+  // A copy of the line keeps its bytes alive for the columns
+  struct layout {
+    Line text;
+    Columns columns;
+  };
+
+  std::vector<unsigned char> kinds;
+  std::map<int, layout> layouts;
+
+public:
+  void reset(size_t lines);
+  void edit(int pos, int removed, int inserted);
+  const Columns *get(int line, const Line &text);
+  size_t bytes() const;
+};
+
+#endif //ALAYAVIM_UTF8_H
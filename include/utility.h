@@ -6,6 +6,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <vector>
 #include <string>
 #include <cstdio>
@@ -21,13 +22,22 @@ constexpr char ENTER = 10;
 constexpr char BACKSPACE = 127;
 constexpr char TAB = 9;
 constexpr char REDO = 18;
+constexpr char CTRL_V = 22;
+constexpr char CTRL_W = 23;
 
 constexpr int UNDO_REDO_INTERVAL = 500;
+constexpr int FOLLOW_FRAME_INTERVAL = 50;
+constexpr int MAX_COUNT = 99999999;
+constexpr int MAX_MACRO_DEPTH = 100;
+constexpr int TAB_SIZE = 4;
+constexpr size_t LONG_LINE = 1 << 16; // a line this long is typed into as a rope
 
 enum class programState {
   Normal = 0,
   Insert = 1,
   Command = 2,
+  Conflict = 3,
+  Visual = 4,
 };
 
 enum class direction {
@@ -43,21 +53,50 @@ enum class atomType {
   INSERT = 2,
 };
 
+// Target of a normal mode motion. An operator works on the lines between
+// the cursor and (x, y) if linewise, otherwise on the characters, with
+// (x, y) itself included only if inclusive.
+struct motion {
+  int x = 0, y = 0;
+  bool linewise = false;
+  bool inclusive = false;
+  bool failed = false; // could not move: the operator does nothing
+};
+
+// Identity of a file on disk, used to tell our own writes from external ones.
+struct fileStamp {
+  long long mtime = -1;  // nanoseconds
+  long long size = -1;
+  long long inode = -1;
+  bool operator==(const fileStamp &o) const {
+    return mtime == o.mtime && size == o.size && inode == o.inode;
+  }
+  bool operator!=(const fileStamp &o) const { return !(*this == o); }
+};
+
 
 int nonblock(int fd, bool undo = false);
 void config_set(struct termios &oldt, struct termios &newt);
 void config_reset(struct termios &oldt);
 std::string align_num(int x, int width);
+fileStamp stamp_of(const std::string &file);
 
 namespace ANSI {
   std::string grey(const std::string &s);
   std::string red(const std::string &s);
   std::string cyan(const std::string &s);
   std::string purple(const std::string &s);
+  std::string reverse(const std::string &s);
+  std::string foreground(int code, const std::string &s);
+  std::string background(int code, const std::string &s);
   std::string clearScreen();
   std::string clearBuffer();
   std::string cursorPosition(int x, int y);
   std::string backspace();
+  std::string clearLine();
+  std::string eraseChars(int n);
+  std::string scrollRegion(int top, int bottom);
+  std::string resetScrollRegion();
 }
 
 #endif //ALAYAVIM_UTILITY_H
@@ -0,0 +1,46 @@
+#ifndef ALAYAVIM_WATCHER_H
+#define ALAYAVIM_WATCHER_H
+
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+
+// Watches the directories of the opened files, so that both in-place
+// writes and rename-over replacements (log rotation, code generators)
+// are noticed. On platforms without inotify, every file is reported on
+// each poll timeout and the caller filters by fileStamp.
+// A file written and kept open (a log) is never closed after writing:
+// once QUIET ms pass with no event for it, it is reported complete.
+class Watcher {
+public:
+  struct change {
+    std::string file;
+    bool complete; // closed after writing, moved in or removed; not a write still going on
+  };
+
+  static constexpr int QUIET = 300;
+
+private:
+  using clock = std::chrono::steady_clock;
+
+  int fd = -1;
+  std::map<int, std::string> dirs;  // watch descriptor -> directory, resolved
+  std::map<std::string, std::vector<std::string>> files; // directory/name -> the file as each buffer opened it
+  std::map<std::string, clock::time_point> settling;     // directory/name -> when it is quiet
+
+  static std::string key(const std::string &dir, const std::string &name);
+
+public:
+  Watcher();
+  ~Watcher();
+  Watcher(const Watcher &) = delete;
+  Watcher &operator=(const Watcher &) = delete;
+
+  void add(const std::string &file);
+  int descriptor() const;
+  int timeout() const;
+  std::vector<change> drain();
+};
+
+#endif //ALAYAVIM_WATCHER_H
@@ -0,0 +1,264 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "binary.h"
+#include "utility.h"
+
+namespace {
+  constexpr int SNIFF = 8000; // bytes looked at for a NUL, as git does
+  constexpr int PATCHED = 91; // bright red
+}
+
+bool Binary::forced = false;
+
+void Binary::force(bool on) {
+  forced = on;
+}
+bool Binary::detect(const std::string &file) {
+  if (forced) {
+    return true;
+  }
+  int fd = ::open(file.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  char head[SNIFF];
+  ssize_t got = pread(fd, head, SNIFF, 0);
+  ::close(fd);
+  return got > 0 && memchr(head, '\0', got) != nullptr;
+}
+Binary::~Binary() {
+  close();
+}
+// Maps the file anew; what was patched or done before is dropped
+bool Binary::open(const std::string &file) {
+  close();
+  fd = ::open(file.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st{};
+  fstat(fd, &st);
+  length = st.st_size;
+  if (length > 0) {
+    void *m = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+    map = m == MAP_FAILED ? nullptr : (const unsigned char *)m;
+  }
+  if (length > 0 && !map) {
+    close();
+    return false;
+  }
+  return true;
+}
+void Binary::close() {
+  if (map) {
+    munmap((void *)map, length);
+    map = nullptr;
+  }
+  if (fd >= 0) {
+    ::close(fd);
+    fd = -1;
+  }
+  length = 0;
+  patch.clear();
+  changes.clear();
+  where = 0;
+}
+// Bytes past the new end are gone: their patch and their undo steps too.
+// A file that grew keeps the old size until it is opened again.
+bool Binary::fit() {
+  struct stat st{};
+  if (fd < 0 || fstat(fd, &st) != 0 || st.st_size >= length) {
+    return false;
+  }
+  munmap((void *)map, length);
+  map = nullptr;
+  length = st.st_size;
+  if (length > 0) {
+    void *m = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+    map = m == MAP_FAILED ? nullptr : (const unsigned char *)m;
+  }
+  if (!map) {
+    length = 0;
+  }
+  patch.erase(patch.lower_bound(length), patch.end());
+  int kept = 0, before = 0;
+  for (int i = 0; i < (int)changes.size(); ++i) {
+    if (changes[i].at < length) {
+      changes[kept ++] = changes[i];
+      before += i < where;
+    }
+  }
+  changes.resize(kept);
+  where = before;
+  return true;
+}
+long long Binary::size() const {
+  return length;
+}
+unsigned char Binary::at(long long offset) const {
+  auto it = patch.find(offset);
+  return it != patch.end() ? it->second : map[offset];
+}
+size_t Binary::pending() const {
+  return patch.size();
+}
+// Like the records of a text buffer, changes within UNDO_REDO_INTERVAL
+// of each other are one undo step
+bool Binary::together(const change &a, const change &b) {
+  return b.when - a.when < std::chrono::milliseconds(UNDO_REDO_INTERVAL);
+}
+// A byte set back to what the file has leaves the patch
+void Binary::put(long long at, unsigned char byte) {
+  if (byte == map[at]) {
+    patch.erase(at);
+  } else {
+    patch[at] = byte;
+  }
+}
+void Binary::set(long long offset, unsigned char byte) {
+  unsigned char before = at(offset);
+  if (before == byte) {
+    return;
+  }
+  changes.resize(where);
+  changes.push_back({offset, before, byte, std::chrono::steady_clock::now()});
+  where ++;
+  put(offset, byte);
+}
+long long Binary::undo(int times) {
+  long long last = -1;
+  while (times -- > 0 && where > 0) {
+    do {
+      const change &c = changes[-- where];
+      put(c.at, c.before);
+      last = c.at;
+    } while (where > 0 && together(changes[where - 1], changes[where]));
+  }
+  return last;
+}
+long long Binary::redo(int times) {
+  long long last = -1;
+  while (times -- > 0 && where < (int)changes.size()) {
+    do {
+      const change &c = changes[where ++];
+      put(c.at, c.after);
+      last = c.at;
+    } while (where < (int)changes.size() && together(changes[where - 1], changes[where]));
+  }
+  return last;
+}
+// Each run of adjacent patched bytes is one pwrite(); the map is shared
+// with the file, so it shows the new bytes afterwards and the patch is
+// empty again. The undo steps stay: they hold the bytes, not the patch.
+bool Binary::save(const std::string &file) {
+  if (patch.empty()) {
+    return true;
+  }
+  int fd = ::open(file.c_str(), O_WRONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  bool ok = true;
+  std::string run;
+  long long start = 0;
+  auto flush = [&] {
+    size_t done = 0;
+    while (ok && done < run.size()) {
+      ssize_t n = pwrite(fd, run.data() + done, run.size() - done, start + (long long)done);
+      if (n <= 0) {
+        ok = false;
+      } else {
+        done += n;
+      }
+    }
+    run.clear();
+  };
+  for (const auto &entry: patch) {
+    if (!run.empty() && entry.first != start + (long long)run.size()) {
+      flush();
+    }
+    if (run.empty()) {
+      start = entry.first;
+    }
+    run.push_back((char)entry.second);
+  }
+  flush();
+  ::close(fd);
+  if (ok) {
+    patch.clear();
+  }
+  return ok;
+}
+// A tree node per patched byte, and the undo steps. The map is not on
+// the heap: its pages belong to the file.
+size_t Binary::bytes() const {
+  return patch.size() * (sizeof(std::pair<const long long, unsigned char>) + 4 * sizeof(void *))
+         + changes.capacity() * sizeof(change);
+}
+int Binary::digits() const {
+  int d = 1;
+  for (long long last = length > 0 ? length - 1 : 0; last >= 16; last >>= 4) {
+    d ++;
+  }
+  return std::max(8, d);
+}
+// 16 bytes a row like xxd, or fewer in a narrow window
+int Binary::perRow(int cols) const {
+  int per = 16;
+  while (per > 1 && column(per, per, true) > cols) {
+    per /= 2;
+  }
+  return per;
+}
+// The offset and ": ", then "xx " per byte with a space more in the
+// middle of 16, a space, and a character per byte
+int Binary::column(int per, int i, bool ascii) const {
+  int gap = per > 8 ? 1 : 0;
+  if (ascii) {
+    return digits() + 2 + 3 * per + gap + 1 + i;
+  }
+  return digits() + 2 + 3 * i + (i >= 8 ? gap : 0);
+}
+std::string Binary::row(long long first, int per, long long mirror, bool ascii) const {
+  char cell[24];
+  snprintf(cell, sizeof(cell), "%0*llx: ", digits(), first);
+  std::string hex = ANSI::grey(cell), text;
+  auto it = patch.lower_bound(first);
+  for (int i = 0; i < per; ++i) {
+    long long k = first + i;
+    std::string h = "  ", c;
+    if (k < length) {
+      unsigned char b = map[k];
+      bool patched = it != patch.end() && it->first == k;
+      if (patched) {
+        b = (it++)->second;
+      }
+      snprintf(cell, sizeof(cell), "%02x", b);
+      h = cell;
+      c = std::string(1, b >= 32 && b < 127 ? (char)b : '.');
+      if (patched) {
+        h = ANSI::foreground(PATCHED, h);
+        c = ANSI::foreground(PATCHED, c);
+      }
+      if (k == mirror && ascii) {
+        h = ANSI::reverse(h);
+      } else if (k == mirror) {
+        c = ANSI::reverse(c);
+      }
+    }
+    hex += h + " ";
+    if (per > 8 && i == 7) {
+      hex += " ";
+    }
+    text += c;
+  }
+  return hex + " " + text;
+}
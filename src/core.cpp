@@ -1,23 +1,116 @@
 #include "core.h"
 #include <vector>
 #include <string>
+#include <climits>
 
+fileFormat Core::load(const std::string &file, std::vector<Line> &content) {
+  fileFormat f = format::read(file, content);
+  if (content.empty()) {
+    content.emplace_back("");
+  }
+  return f;
+}
 Core::Core(const std::vector<std::string> &files) {
   buffer.clear();
   for (const auto &file : files) {
-    std::vector<std::string> content;
-    std::ifstream in(file);
-    if (!in.is_open()) {
-      content.emplace_back("");
+    open(file);
+  }
+  ensureLoaded(0);
+  buffer.front().display();
+}
+// Adds a buffer for a file, read when it is first shown
+int Core::open(const std::string &file) {
+  buffer.emplace_back(file);
+  buffer.back().onShared = [this](const std::vector<Line> *source) {
+    releaseRegisters(source);
+  };
+  return (int)buffer.size() - 1;
+}
+// Files are read when first shown, so opening hundreds of them is quick.
+// A binary file is mapped instead, and shown as bytes.
+void Core::ensureLoaded(int file) {
+  if (buffer[file].isLoaded())
+    return;
+  if (Binary::detect(buffer[file].name()) && buffer[file].loadBinary()) {
+    watcher.add(buffer[file].name());
+    return;
+  }
+  std::vector<Line> content;
+  fileFormat f = load(buffer[file].name(), content);
+  buffer[file].load(content, f);
+  watcher.add(buffer[file].name());
+}
+// Shows another buffer in the current window
+void Core::switchTo(int file) {
+  buffer[currentFile].setPrompt("");
+  currentFile = file;
+  layout.show(file);
+  ensureLoaded(file);
+}
+bool Core::shown(int file) const {
+  return layout.showing(file) > 0;
+}
+// Frames go through the layout while the screen is split, and always for
+// a server, whose client should only get the rows that changed
+bool Core::composed() const {
+  return served || layout.count() > 1;
+}
+// While frames are composed, a display() of any buffer draws the windows
+void Core::hookWindows() {
+  bool split = composed();
+  for (auto &file: buffer) {
+    if (split) {
+      file.onDisplay = [this] {
+        syncDiff();
+        layout.compose(buffer);
+      };
     } else {
-      std::string line;
-      while (std::getline(in, line)) {
-        content.emplace_back(line);
-      }
+      file.onDisplay = nullptr;
     }
-    buffer.emplace_back(content, file);
   }
-  buffer.front().display();
+}
+void Core::splitWindow(bool vertical) {
+  if (!layout.split(vertical, buffer)) {
+    buffer[currentFile].setPrompt(ANSI::purple("Not enough room."), true);
+    return;
+  }
+  hookWindows();
+  buffer[currentFile].display();
+}
+// Buffers outlive their windows, so closing one loses nothing
+void Core::closeWindow() {
+  if (layout.count() == 1) {
+    buffer[currentFile].setPrompt(ANSI::purple("Cannot close last window."), true);
+    return;
+  }
+  layout.close(buffer);
+  currentFile = layout.file();
+  hookWindows();
+  buffer[currentFile].display();
+}
+void Core::onlyWindow() {
+  layout.only();
+  hookWindows();
+  buffer[currentFile].display();
+}
+// CTRL-W s/v split, c/q close, o keeps only the current window, and
+// w/W/CTRL-W or h/j/k/l go to another one.
+void Core::windowCommand(char ch) {
+  switch (ch) {
+    case 's': case 'S': splitWindow(false); return;
+    case 'v': splitWindow(true); return;
+    case 'c': case 'q': closeWindow(); return;
+    case 'o': onlyWindow(); return;
+    case 'w': case CTRL_W: layout.cycle(1, buffer); break;
+    case 'W': layout.cycle(-1, buffer); break;
+    case 'h': layout.go(direction::LEFT, buffer); break;
+    case 'j': layout.go(direction::DOWN, buffer); break;
+    case 'k': layout.go(direction::UP, buffer); break;
+    case 'l': layout.go(direction::RIGHT, buffer); break;
+    default: return;
+  }
+  currentFile = layout.file();
+  buffer[currentFile].display();
 }
 void Core::save() {
   buffer[currentFile].save(true);
@@ -32,14 +125,132 @@ int Core::saveAll() {
   }
   return modified;
 }
-void Core::handleESC() {
+// One key: a character, or ESC [ A-D for an arrow. While a macro is
+// being recorded, the keys typed (not the replayed ones) are kept.
+void Core::press(const std::string &key) {
+  if (recordingInto && !replaying) {
+    recorded += key;
+  }
+  clearPrompt();
+  char ch = key[0];
+  // Only typing works on the rope of a long line; any other key reads the lines
+  if (state != programState::Insert) {
+    buffer[currentFile].settle();
+    buffer[currentFile].endTyping();
+  }
+  if (buffer[currentFile].isBinary() && (state == programState::Normal || state == programState::Insert)
+      && ch != ESC) {
+    handleBinary(ch);
+    return;
+  }
+  if (ch == REDO) {
+    handleREDO();
+  } else if (ch == TAB) {
+    handleTAB();
+  } else if (ch == ESC && key.size() == 3) {
+    switch (key[2]) {
+      case 'A':
+        handle(direction::UP);
+        break;
+      case 'B':
+        handle(direction::DOWN);
+        break;
+      case 'C':
+        handle(direction::RIGHT);
+        break;
+      case 'D':
+        handle(direction::LEFT);
+        break;
+      default:
+        break;
+    }
+  } else if (ch == ESC) {
+    handleESC();
+  } else if (ch == ENTER) {
+    handleENTER();
+  } else if (ch == BACKSPACE) {
+    handleBACKSPACE();
+  } else {
+    handle(ch);
+  }
+}
+// The keys of a buffer shown as bytes. The cursor moves by bytes (h, l)
+// and rows (j, k), and insert mode (i, a or R) overwrites the byte under
+// it, in hex or in the ASCII column, which TAB switches to. Nothing is
+// inserted or deleted: the file keeps its size, so :w patches it in place.
+// The arrows and ESC go the usual way.
+void Core::handleBinary(char ch) {
+  FileManager &file = buffer[currentFile];
+  if (ch == TAB) {
+    file.switchColumn();
+    return;
+  }
+  if (state == programState::Insert) {
+    if (ch == BACKSPACE) {
+      file.moveCursor(direction::LEFT);
+    } else if (ch == ENTER) {
+      file.moveCursor(direction::DOWN);
+    } else {
+      file.overwrite(ch);
+    }
+    return;
+  }
+  char prefix = lastChar;
+  if (prefix == CTRL_W || ch == CTRL_W || ch == ':') {
+    handleNormal(ch);
+    return;
+  }
   lastChar = 0;
+  if (std::isdigit(ch) && (ch != '0' || count > 0)) {
+    count = std::min(count * 10 + (ch - '0'), MAX_COUNT);
+    return;
+  }
+  long long times = std::max(1, count), at = file.cursorOffset(), per = file.rowBytes();
+  bool counted = count > 0;
+  resetPending();
+  switch (ch) {
+    case 'h': case BACKSPACE: file.moveOffset(at - times); break;
+    case 'l': case ' ': file.moveOffset(at + times); break;
+    case 'k': file.moveOffset(at - times * per); break;
+    case 'j': case ENTER: file.moveOffset(at + times * per); break;
+    case '0': file.moveOffset(at - at % per); break;
+    case '$': file.moveOffset(at - at % per + per - 1); break;
+    case 'G': file.moveOffset(counted ? (times - 1) * per : LLONG_MAX); break;
+    case 'g':
+      if (prefix == 'g') {
+        file.moveOffset(counted ? (times - 1) * per : 0);
+      } else {
+        count = counted ? (int)times : 0;
+        lastChar = 'g';
+      }
+      break;
+    case 'u': handleUNDO((int)times); break;
+    case REDO: count = (int)times; handleREDO(); break;
+    case 'i': case 'a': case 'R':
+      state = programState::Insert;
+      file.setPrompt(ANSI::red("[REPLACE]"), true);
+      break;
+    default:
+      break;
+  }
+}
+void Core::handleESC() {
+  resetPending();
+  buffer[currentFile].endTyping();
   switch (state) {
+    case programState::Conflict:
+      resolveConflict(false);
+      break;
     case programState::Normal:
       buffer[currentFile].setPrompt(ANSI::purple("[Hint] Type :q to quit"), true);
       break;
     case programState::Command:
       break;
+    case programState::Visual:
+      state = programState::Normal;
+      buffer[currentFile].stopVisual();
+      buffer[currentFile].setPrompt(ANSI::cyan("[NORMAL]"), true);
+      break;
     case programState::Insert:
       state = programState::Normal;
       buffer[currentFile].setPrompt(ANSI::cyan("[NORMAL]"), true);
@@ -52,24 +263,33 @@ void Core::exit(int code) {
   returnCode = code;
 }
 void Core::handleTAB() {
-  lastChar = 0;
-  constexpr int tabSize = 4;
-  for (int i = 0; i < tabSize; ++i)
+  resetPending();
+  for (int i = 0; i < TAB_SIZE; ++i)
     buffer[currentFile].insertChar(' ');
 }
 void Core::handleBACKSPACE() {
-  lastChar = 0;
+  resetPending();
   switch (state) {
+    case programState::Conflict:
+      break;
     case programState::Normal:
+    case programState::Visual:
       buffer[currentFile].toLastChar();
       break ;
     case programState::Command:
       if (command.empty()) {
         state = programState::Normal;
         buffer[currentFile].setPrompt("");
+        nextConflict();
       } else {
-        command.pop_back();
-        printf("%s", ANSI::backspace().c_str());
+        // A whole character, as wide as it was drawn
+        size_t start = utf8::lastStart(command);
+        char32_t cp = 0;
+        int cells = utf8::decode(command.data() + start, command.size() - start, cp) ? utf8::width(cp) : 1;
+        command.erase(start);
+        for (int k = 0; k < cells && !FileManager::isSuspended(); ++k) {
+          printf("%s", ANSI::backspace().c_str());
+        }
       }
       break;
     case programState::Insert:
@@ -78,16 +298,12 @@ void Core::handleBACKSPACE() {
   }
 }
 void Core::clearPrompt() {
-  if (state != programState::Command) {
+  if (state != programState::Command && state != programState::Conflict) {
     buffer[currentFile].clearPrompt();
   }
 }
-bool Core::validReplace(std::string command, std::pair<int, int> &info) {
-  if (command.size() < 5) return false;
-  bool inFile = command[0] == '%';
-  if (inFile) {
-    command = command.substr(1);
-  }
+bool Core::validReplace(std::string command, int from, int to, std::pair<int, int> &info,
+                        const std::vector<int> *rows) {
   if (command.size() < 5)
     return false;
   if (command[0] != 's')
@@ -102,19 +318,298 @@ bool Core::validReplace(std::string command, std::pair<int, int> &info) {
   if (i + 2 >= command.size()) return false;
   std::string pattern = command.substr(2, i - 2);
   std::string replacement = command.substr(i + 1, (int)(command.size()) - i - 3);
-  info = buffer[currentFile].replace(pattern, replacement, inFile);
+  info = buffer[currentFile].replace(pattern, replacement, from, to, rows);
+  return true;
+}
+// An address is a line number, ".", "$", "'<" or "'>", then any number of
+// +n or -n; a bare +n or -n is relative to the cursor. Lines are 0-based.
+bool Core::parseAddress(const std::string &command, size_t &i, int &line) const {
+  const FileManager &file = buffer[currentFile];
+  if (i < command.size() && std::isdigit(command[i])) {
+    long long n = 0;
+    while (i < command.size() && std::isdigit(command[i])) {
+      n = std::min((long long)MAX_COUNT, n * 10 + (command[i ++] - '0'));
+    }
+    line = (int)n - 1;
+  } else if (i < command.size() && command[i] == '.') {
+    line = file.cursorLine();
+    i ++;
+  } else if (i < command.size() && command[i] == '$') {
+    line = file.lineCount() - 1;
+    i ++;
+  } else if (i + 1 < command.size() && command[i] == '\'' && (command[i + 1] == '<' || command[i + 1] == '>')) {
+    line = command[i + 1] == '<' ? file.marks().first : file.marks().second;
+    i += 2;
+  } else if (i < command.size() && (command[i] == '+' || command[i] == '-')) {
+    line = file.cursorLine();
+  } else {
+    return false;
+  }
+  while (i < command.size() && (command[i] == '+' || command[i] == '-')) {
+    int sign = command[i ++] == '+' ? 1 : -1;
+    long long n = 0;
+    bool digits = false;
+    while (i < command.size() && std::isdigit(command[i])) {
+      n = std::min((long long)MAX_COUNT, n * 10 + (command[i ++] - '0'));
+      digits = true;
+    }
+    line = (int)std::max((long long)-1, std::min((long long)MAX_COUNT, line + sign * (digits ? n : 1)));
+  }
+  return true;
+}
+// A range is "%" or one or two addresses separated by ",". Without one,
+// both ends are the cursor line.
+bool Core::parseRange(const std::string &command, size_t &i, int &from, int &to, bool &given) const {
+  from = to = buffer[currentFile].cursorLine();
+  given = true;
+  if (i < command.size() && command[i] == '%') {
+    from = 0;
+    to = buffer[currentFile].lineCount() - 1;
+    i ++;
+    return true;
+  }
+  if (!parseAddress(command, i, from)) {
+    given = false;
+    return i >= command.size() || command[i] != ',';
+  }
+  to = from;
+  if (i < command.size() && command[i] == ',') {
+    i ++;
+    return parseAddress(command, i, to);
+  }
+  return true;
+}
+// [range]d [x], [range]y [x], [range]> and [range]<, [range]s/old/new/g,
+// [range]g/pattern/cmd and [range]v/pattern/cmd, or an address alone to
+// jump there. Returns false for anything else.
+bool Core::runEx(const std::string &command) {
+  FileManager &file = buffer[currentFile];
+  size_t i = 0;
+  int from, to;
+  bool given;
+  if (!parseRange(command, i, from, to, given)) {
+    return false;
+  }
+  std::string rest = command.substr(i);
+  if (rest.empty() && !given) {
+    return false;
+  }
+  int last = file.lineCount() - 1;
+  if (from > to) {
+    std::swap(from, to);
+  }
+  if (from < 0 || to > last) {
+    file.setPrompt(ANSI::purple(rest.empty() ? "Invalid Line Number." : "Invalid Range."), true);
+    return true;
+  }
+  std::pair<int, int> info;
+  if (rest.empty()) {
+    file.jumpTo(to + 1);
+  } else if (rest[0] == 'g' || rest[0] == 'v') {
+    global(rest, given ? from : 0, given ? to : last);
+  } else if (rest.compare(0, 4, "sort") == 0) {
+    sort(rest.substr(4), given ? from : 0, given ? to : last);
+  } else if (rest[0] == '!') {
+    if (!given) {
+      file.setPrompt(ANSI::purple("A range is needed, as in :%!sort"), true);
+    } else {
+      filterLines(rest.substr(1), from, to);
+    }
+  } else if (validReplace(rest, from, to, info)) {
+    if (!info.second)
+      file.setPrompt(ANSI::purple("Pattern not found."), true);
+    else
+      file.setPrompt(ANSI::purple("Replaced " + std::to_string(info.second)
+                                  + " occurrence(s) in " + std::to_string(info.first) + " line(s)."), true);
+  } else if (rest == "d" || rest == "y" || (rest.size() == 3 && (rest[0] == 'd' || rest[0] == 'y')
+                                            && rest[1] == ' ' && std::isalnum(rest[2]))) {
+    Register yanked;
+    file.operateLines(rest[0], from, to, yanked);
+    keep(rest.size() == 3 ? (char)std::tolower(rest[2]) : '"', std::move(yanked));
+    int lines = to - from + 1;
+    if (lines > 2) {
+      file.setPrompt(ANSI::purple(std::to_string(lines) + (rest[0] == 'd' ? " fewer lines" : " lines yanked")), true);
+    }
+  } else if (rest.find_first_not_of('>') == std::string::npos
+             || rest.find_first_not_of('<') == std::string::npos) {
+    file.shiftLines(from, to, (int)rest.size(), rest[0] == '>');
+  } else {
+    return false;
+  }
   return true;
 }
+// :sort [u][n] sorts by text, or by the first number of each line with n,
+// and keeps only the first of identical lines with u; :sort! reverses.
+void Core::sort(const std::string &options, int from, int to) {
+  FileManager &file = buffer[currentFile];
+  size_t i = 0;
+  bool reverse = i < options.size() && options[i] == '!';
+  i += reverse;
+  if (options.find_first_not_of(" un", i) != std::string::npos) {
+    file.setPrompt(ANSI::purple("Invalid Command."), true);
+    return;
+  }
+  bool numeric = options.find('n', i) != std::string::npos;
+  bool unique = options.find('u', i) != std::string::npos;
+  int removed = to - from + 1 - file.sortLines(from, to, numeric, unique, reverse);
+  if (removed > 0) {
+    file.setPrompt(ANSI::purple(std::to_string(removed) + " fewer lines"), true);
+  }
+}
+// :{range}!cmd replaces the lines with the output of cmd given them
+void Core::filterLines(const std::string &cmd, int from, int to) {
+  FileManager &file = buffer[currentFile];
+  int status = 0;
+  int printed = file.filterLines(from, to, cmd, status);
+  if (printed < 0) {
+    file.setPrompt(ANSI::purple(status > 0 ? cmd + " failed [exit " + std::to_string(status) + "]" : "Cannot run " + cmd), true);
+  } else {
+    file.setPrompt(ANSI::purple(std::to_string(to - from + 1) + " lines filtered, " + std::to_string(printed)
+                                + " printed" + (status ? " [exit " + std::to_string(status) + "]" : "")), true);
+  }
+}
+// :diffthis marks the current buffer; the second buffer marked is compared
+// with the first until :diffoff.
+void Core::diffThis() {
+  FileManager &file = buffer[currentFile];
+  if (file.isBinary()) {
+    file.setPrompt(ANSI::purple("Cannot compare a binary file."), true);
+  } else if (diffSide() >= 0) {
+    file.setPrompt(ANSI::purple("Already compared."), true);
+  } else if (diffed[1] >= 0) {
+    file.setPrompt(ANSI::purple("Two buffers are compared already, :diffoff first."), true);
+  } else if (diffed[0] < 0) {
+    diffed[0] = currentFile;
+    file.setPrompt(ANSI::purple("[Diff] :diffthis another buffer to compare with " + file.name()), true);
+  } else {
+    diffed[1] = currentFile;
+    startDiff();
+  }
+}
+void Core::diffOff() {
+  for (int side = 0; side < 2; ++side) {
+    if (diffed[side] >= 0) {
+      FileManager &file = buffer[diffed[side]];
+      file.onChange = nullptr;
+      file.diffOf = nullptr;
+      file.recolor();
+    }
+    diffed[side] = -1;
+  }
+  buffer[currentFile].display();
+}
+// Compares the two buffers whole. Later edits of either side are told to
+// the diff, which compares only the hunks they touched before a frame.
+void Core::startDiff() {
+  for (int side = 0; side < 2; ++side) {
+    ensureLoaded(diffed[side]);
+    FileManager &file = buffer[diffed[side]];
+    file.onChange = [this, side](int pos, int removed, int inserted) {
+      diff.edit(side, pos, removed, inserted);
+    };
+    file.diffOf = [this, side](int line) {
+      refreshDiff();
+      return diff.kindOf(side, line);
+    };
+  }
+  diff.reset(buffer[diffed[0]].lineCount(), buffer[diffed[1]].lineCount());
+  refreshDiff();
+  buffer[currentFile].setPrompt(ANSI::purple("[Diff] " + std::to_string(diff.size()) + " hunk(s)"), true);
+  buffer[currentFile].display();
+}
+// Which side of the diff the current buffer is, -1 if none
+int Core::diffSide() const {
+  return currentFile == diffed[0] ? 0 : currentFile == diffed[1] ? 1 : -1;
+}
+void Core::refreshDiff() {
+  if (diffed[1] >= 0 && diff.refresh(*buffer[diffed[0]].snapshot(), *buffer[diffed[1]].snapshot())) {
+    buffer[diffed[0]].recolor();
+    buffer[diffed[1]].recolor();
+  }
+}
+// Before a frame: the windows of the other side scroll with the current one
+void Core::syncDiff() {
+  int side = diffSide();
+  if (diffed[1] < 0 || side < 0) {
+    return;
+  }
+  refreshDiff();
+  view at = buffer[currentFile].current();
+  layout.align(diffed[1 - side], diff.facing(side, at.posX), diff.facing(side, at.windowStartX));
+}
+// ]c and [c: to the first line of the next or the previous hunk
+void Core::jumpHunk(int step, int times) {
+  FileManager &file = buffer[currentFile];
+  int side = diffSide();
+  if (diffed[1] < 0 || side < 0) {
+    file.setPrompt(ANSI::purple("Not compared, :diffthis first."), true);
+    return;
+  }
+  refreshDiff();
+  int line = file.cursorLine(), to = -1;
+  for (int k = 0; k < times; ++k) {
+    int n = diff.next(side, line, step);
+    if (n < 0) break;
+    to = line = n;
+  }
+  if (to < 0) {
+    file.setPrompt(ANSI::purple("No more hunks."), true);
+  } else {
+    file.jumpTo(std::min(to, file.lineCount() - 1) + 1);
+  }
+}
+// :g/pattern/cmd runs cmd on the lines containing pattern, :v (or :g!) on
+// the others. The lines are found in one scan, and d and s change them
+// in one edit, so the whole command is one undo step.
+void Core::global(const std::string &command, int from, int to) {
+  FileManager &file = buffer[currentFile];
+  bool invert = command[0] == 'v';
+  size_t i = 1;
+  if (!invert && i < command.size() && command[i] == '!') {
+    invert = true;
+    i ++;
+  }
+  if (i >= command.size() || std::isalnum(command[i]) || command[i] == ' ') {
+    file.setPrompt(ANSI::purple("Invalid Command."), true);
+    return;
+  }
+  char delimiter = command[i ++];
+  size_t end = command.find(delimiter, i);
+  std::string pattern = command.substr(i, end == std::string::npos ? std::string::npos : end - i);
+  std::string cmd = end == std::string::npos ? "" : command.substr(end + 1);
+  if (pattern.empty()) {
+    file.setPrompt(ANSI::purple("Invalid Command."), true);
+    return;
+  }
+  std::pair<int, int> info;
+  std::vector<int> rows = file.matching(pattern, invert, from, to);
+  if (rows.empty()) {
+    file.setPrompt(ANSI::purple("Pattern not found: " + pattern), true);
+  } else if (cmd == "d") {
+    int n = (int)rows.size();
+    Register yanked;
+    file.deleteRows(std::move(rows), yanked);
+    keep('"', std::move(yanked));
+    file.setPrompt(ANSI::purple(std::to_string(n) + " fewer lines"), true);
+  } else if (validReplace(cmd, from, to, info, &rows)) {
+    file.setPrompt(ANSI::purple("Replaced " + std::to_string(info.second)
+                                + " occurrence(s) in " + std::to_string(info.first) + " line(s)."), true);
+  } else {
+    file.setPrompt(ANSI::purple("Invalid Command."), true);
+  }
+}
 void Core::handleREDO() {
-  auto res = buffer[currentFile].redo();
+  int times = std::max(1, count);
+  resetPending();
+  auto res = buffer[currentFile].redo(times);
   if (!res) {
     buffer[currentFile].setPrompt(ANSI::purple("No more redo."), true);
   } else {
     buffer[currentFile].setPrompt(ANSI::purple("A redo finished."), true);
   }
 }
-void Core::handleUNDO() {
-  auto res = buffer[currentFile].undo();
+void Core::handleUNDO(int times) {
+  auto res = buffer[currentFile].undo(times);
   if (!res) {
     buffer[currentFile].setPrompt(ANSI::purple("No more undo."), true);
   } else {
@@ -122,15 +617,21 @@ void Core::handleUNDO() {
   }
 }
 void Core::handleENTER() {
-  lastChar = 0;
+  resetPending();
   std::pair<int, int> info;
   switch (state) {
     case programState::Normal:
+    case programState::Visual:
       buffer[currentFile].toNextLine();
       break ;
+    case programState::Conflict:
+      break;
     case programState::Command:
       buffer[currentFile].setPrompt("");
-      if (command == "q" || command == "q!") {
+      if ((command == "q" || command == "q!") && layout.count() > 1) {
+        state = programState::Normal;
+        closeWindow();
+      } else if (command == "q" || command == "q!") {
         if (command.back() != '!' && !buffer[currentFile].isSaved()) {
           buffer[currentFile].setPrompt(ANSI::purple("[Warning] You should save by :w first, or :wq. "));
           state = programState::Normal;
@@ -142,7 +643,21 @@ void Core::handleENTER() {
         state = programState::Normal;
       } else if (command == "wq" || command == "wq!") {
         save();
-        exit(0);
+        if (layout.count() > 1) {
+          state = programState::Normal;
+          closeWindow();
+        } else {
+          exit(0);
+        }
+      } else if (command == "sp" || command == "split" || command == "vs" || command == "vsplit") {
+        state = programState::Normal;
+        splitWindow(command[0] == 'v');
+      } else if (command == "clo" || command == "close") {
+        state = programState::Normal;
+        closeWindow();
+      } else if (command == "on" || command == "only") {
+        state = programState::Normal;
+        onlyWindow();
       } else if (command == "wa" || command == "wa!") {
         int cnt = saveAll();
         state = programState::Normal;
@@ -152,8 +667,7 @@ void Core::handleENTER() {
         if (command.back() != '!' && !buffer[currentFile].isSaved()) {
           buffer[currentFile].setPrompt(ANSI::purple("[Warning] You should save by :w first. (Or add ! to override)"));
         } else if (currentFile + 1 < buffer.size()) {
-          buffer[currentFile].setPrompt("");
-          currentFile++;
+          switchTo(currentFile + 1);
           buffer[currentFile].openPrompt();
         } else {
           buffer[currentFile].setPrompt(ANSI::purple("No next file."), true);
@@ -163,8 +677,7 @@ void Core::handleENTER() {
         if (command.back() != '!' && !buffer[currentFile].isSaved()) {
           buffer[currentFile].setPrompt(ANSI::purple("[Warning] You should save by :w first. (Or add ! to override)"));
         } else if (currentFile > 0) {
-          buffer[currentFile].setPrompt("");
-          currentFile--;
+          switchTo(currentFile - 1);
           buffer[currentFile].openPrompt();
         } else {
           buffer[currentFile].setPrompt(ANSI::purple("No previous file."), true);
@@ -176,8 +689,7 @@ void Core::handleENTER() {
         } else if (command.back() != '!' && !buffer[currentFile].isSaved()) {
           buffer[currentFile].setPrompt(ANSI::purple("[Warning] You should save by :w first. (Or add ! to override) "));
         } else {
-          buffer[currentFile].setPrompt("");
-          currentFile = 0;
+          switchTo(0);
           buffer[currentFile].openPrompt();
         }
         state = programState::Normal;
@@ -187,22 +699,42 @@ void Core::handleENTER() {
         } else if (command.back() != '!' && !buffer[currentFile].isSaved()) {
           buffer[currentFile].setPrompt(ANSI::purple("[Warning] You should save by :w first. "));
         } else {
-          buffer[currentFile].setPrompt("");
-          currentFile = (int)buffer.size() - 1;
           state = programState::Normal;
+          switchTo((int)buffer.size() - 1);
           buffer[currentFile].openPrompt();
         }
         state = programState::Normal;
+      } else if (command == "follow") {
+        state = programState::Normal;
+        follow(currentFile);
+      } else if (command == "nofollow") {
+        state = programState::Normal;
+        buffer[currentFile].unfollow();
+        buffer[currentFile].setPrompt(ANSI::purple("[Stopped following " + buffer[currentFile].name() + "]"), true);
+      } else if (command.compare(0, 5, "grep ") == 0) {
+        state = programState::Normal;
+        startGrep(command.substr(5));
+      } else if (command == "cn" || command == "cnext" || command == "cn!" || command == "cnext!"
+                 || command == "cp" || command == "cprev" || command == "cp!" || command == "cprev!") {
+        state = programState::Normal;
+        if (quickfix.empty()) {
+          buffer[currentFile].setPrompt(ANSI::purple("No matches."), true);
+        } else if (command[1] == 'n' && quickfixIndex + 1 >= (int)quickfix.size()) {
+          buffer[currentFile].setPrompt(ANSI::purple(grep.running() ? "No more matches yet." : "No more matches."), true);
+        } else if (command[1] == 'p' && quickfixIndex <= 0) {
+          buffer[currentFile].setPrompt(ANSI::purple("Already at the first match."), true);
+        } else {
+          goQuickfix(quickfixIndex + (command[1] == 'n' ? 1 : -1), command.back() == '!');
+        }
+      } else if (command == "reg" || command == "registers") {
+        state = programState::Normal;
+        buffer[currentFile].setPrompt(ANSI::purple(registerInfo()), true);
+      } else if (command == "mem" || command.compare(0, 4, "mem ") == 0) {
+        state = programState::Normal;
+        buffer[currentFile].setPrompt(ANSI::purple(memoryInfo(command.size() > 4 ? command.substr(4) : "")), true);
       } else if (command == "file") {
         buffer[currentFile].filePrompt();
         state = programState::Normal;
-      } else if (validReplace(command, info)) {
-        state = programState::Normal;
-        if (!info.second)
-          buffer[currentFile].setPrompt(ANSI::purple("Pattern not found."), true);
-        else
-          buffer[currentFile].setPrompt(ANSI::purple("Replaced " + std::to_string(info.second)
-                                                     + " occurrence(s) in " + std::to_string(info.first) + " line(s)."), true);
       } else if (command == "set number") {
         for (auto &file: buffer) {
           file.setNumber();
@@ -215,15 +747,39 @@ void Core::handleENTER() {
         }
         state = programState::Normal;
         buffer[currentFile].display();
-      } else if (std::all_of(command.begin(), command.end(), ::isdigit)) {
+      } else if (command == "set wrap" || command == "set nowrap") {
+        for (auto &file: buffer) {
+          file.setWrap(command == "set wrap");
+        }
+        state = programState::Normal;
+        buffer[currentFile].display();
+      } else if (command == "diffthis" || command == "difft") {
+        state = programState::Normal;
+        diffThis();
+      } else if (command == "diffoff" || command == "diffo") {
         state = programState::Normal;
-        if (!buffer[currentFile].jumpTo(std::stoi(command))) {
-          buffer[currentFile].setPrompt(ANSI::purple("Invalid Line Number."), true);
+        diffOff();
+      } else if (command == "diffupdate" || command == "diffu") {
+        state = programState::Normal;
+        if (diffed[1] >= 0) {
+          startDiff();
+        }
+      } else if (command == "set intern" || command == "set nointern") {
+        Line::intern(command == "set intern");
+        if (Line::interning()) {
+          for (auto &file: buffer) {
+            file.intern();
+          }
         }
+        state = programState::Normal;
+        buffer[currentFile].display();
+      } else if (buffer[currentFile].isBinary() ? jumpOffset(command) : runEx(command)) {
+        state = programState::Normal;
       } else {
         state = programState::Normal;
         buffer[currentFile].setPrompt(ANSI::purple("Invalid Command."), true);
       }
+      nextConflict();
       break;
     case programState::Insert:
       buffer[currentFile].enter();
@@ -231,75 +787,676 @@ void Core::handleENTER() {
   }
 }
 void Core::handle(direction ch) {
-  lastChar = 0;
+  resetPending();
   switch (state) {
     case programState::Normal:
+    case programState::Visual:
       buffer[currentFile].moveCursor(ch);
       break;
     case programState::Command:
       // check history command
       break;
+    case programState::Conflict:
+      break;
     case programState::Insert:
       buffer[currentFile].moveCursor(ch);
       break;
   }
 }
+void Core::resetPending() {
+  lastChar = 0;
+  count = 0;
+  pendingOperator = 0;
+  operatorCount = 0;
+  pendingRegister = 0;
+}
+void Core::releaseRegisters(const std::vector<Line> *source) {
+  for (auto &entry: registers) {
+    if (entry.second.shares() == source) {
+      entry.second.materialize();
+    }
+  }
+}
+// Puts yanked or deleted text in register name (if any) and in the
+// unnamed register.
+void Core::keep(char name, Register yanked) {
+  if (yanked.empty()) {
+    return;
+  }
+  if (name && name != '"') {
+    registers[name] = yanked;
+  }
+  registers['"'] = std::move(yanked);
+}
+std::string Core::registerInfo() const {
+  std::string info;
+  for (const auto &entry: registers) {
+    if (entry.second.empty()) continue;
+    info += std::string(info.empty() ? "" : " ") + "\"" + entry.first + " "
+            + std::to_string(entry.second.size()) + (entry.second.linewise ? "L" : "C");
+  }
+  return info.empty() ? "No registers." : info;
+}
+// :mem sums the memory of the buffers, the registers and the quickfix
+// list; :mem {file} also writes it per buffer to file as JSON.
+std::string Core::memoryInfo(const std::string &dump) const {
+  MemoryCount count;
+  memoryUsage total;
+  std::string json = "{\"buffers\": [";
+  for (int i = 0; i < (int)buffer.size(); ++i) {
+    memoryUsage use = buffer[i].memory(count);
+    total.text += use.text;
+    total.history += use.history;
+    total.records += use.records;
+    total.caches += use.caches;
+    json += std::string(i ? ", " : "") + "{\"file\": " + MemoryCount::json(buffer[i].name())
+            + ", \"loaded\": " + (buffer[i].isLoaded() ? "true" : "false")
+            + ", \"lines\": " + std::to_string(buffer[i].lineCount())
+            + ", \"text\": " + std::to_string(use.text)
+            + ", \"history\": " + std::to_string(use.history)
+            + ", \"records\": " + std::to_string(use.records)
+            + ", \"caches\": " + std::to_string(use.caches) + "}";
+  }
+  size_t held = 0;
+  for (const auto &entry: registers) {
+    held += entry.second.bytes(count);
+  }
+  held += MemoryCount::heap(recorded);
+  size_t matches = quickfix.capacity() * sizeof(Grep::match);
+  for (const auto &m: quickfix) {
+    matches += MemoryCount::heap(m.text);
+  }
+  size_t pooled = Line::pooled(), pool = Line::poolBytes();
+  size_t all = total.text + total.history + total.caches + held + matches + pool;
+  json += "], \"registers\": " + std::to_string(held) + ", \"quickfix\": " + std::to_string(matches)
+          + ", \"pool\": {\"lines\": " + std::to_string(pooled) + ", \"bytes\": " + std::to_string(pool) + "}"
+          + ", \"total\": " + std::to_string(all) + "}\n";
+  std::string info = "[mem] text " + MemoryCount::human(total.text)
+                     + ", undo " + MemoryCount::human(total.history) + " (" + std::to_string(total.records) + " records)"
+                     + ", caches " + MemoryCount::human(total.caches)
+                     + ", registers " + MemoryCount::human(held)
+                     + (quickfix.empty() ? "" : ", quickfix " + MemoryCount::human(matches))
+                     + (pooled ? ", pool " + MemoryCount::human(pool) + " (" + std::to_string(pooled) + " lines)" : "")
+                     + ", total " + MemoryCount::human(all);
+  if (!dump.empty()) {
+    std::ofstream out(dump);
+    out << json << std::flush;
+    info += out ? " [Written to " + dump + "]" : " [Cannot write " + dump + "]";
+  }
+  return info;
+}
+void Core::runMotion(const std::string &key) {
+  bool counted = count > 0 || operatorCount > 0;
+  int times = (int)std::min((long long)MAX_COUNT, (long long)std::max(1, operatorCount) * std::max(1, count));
+  char op = pendingOperator, name = pendingRegister;
+  resetPending();
+  motion m = buffer[currentFile].findMotion(key, times, counted, op != 0);
+  if (m.failed && replaying) {
+    aborted = true;
+  }
+  if (op) {
+    Register yanked;
+    buffer[currentFile].operate(op, m, yanked);
+    keep(name, std::move(yanked));
+  } else {
+    buffer[currentFile].moveTo(m);
+  }
+}
+// Normal mode commands are ["x][count][operator[count]]motion, or
+// ["x][count]command, where dd and yy work on count lines.
+void Core::handleNormal(char ch) {
+  char prefix = lastChar;
+  lastChar = 0;
+  if (prefix == 'q') {
+    if (std::isalnum(ch)) {
+      recordingInto = (char)std::tolower(ch);
+      recorded.clear();
+      buffer[currentFile].setPrompt(ANSI::purple(std::string("recording @") + recordingInto), true);
+    }
+    resetPending();
+    return;
+  }
+  if (prefix == '@') {
+    int times = std::max(1, count);
+    resetPending();
+    if (std::isalnum(ch) || ch == '@' || ch == '"') {
+      replay((char)std::tolower(ch), times);
+    }
+    return;
+  }
+  if (prefix == CTRL_W) {
+    resetPending();
+    if (state == programState::Visual) {
+      state = programState::Normal;
+      buffer[currentFile].stopVisual();
+      buffer[currentFile].setPrompt("");
+    }
+    windowCommand(ch);
+    return;
+  }
+  if (std::isdigit(ch) && (ch != '0' || count > 0)) {
+    count = std::min(count * 10 + (ch - '0'), MAX_COUNT);
+    return;
+  }
+  if (prefix == 'g') {
+    if (ch == 'g') {
+      runMotion("gg");
+    } else {
+      resetPending();
+    }
+    return;
+  }
+  if (prefix == ']' || prefix == '[') {
+    int times = std::max(1, count);
+    resetPending();
+    if (ch == 'c') {
+      jumpHunk(prefix == ']' ? 1 : -1, times);
+    }
+    return;
+  }
+  if (prefix == '"') {
+    if (std::isalnum(ch) || ch == '"') {
+      pendingRegister = (char)std::tolower(ch);
+    } else {
+      resetPending();
+    }
+    return;
+  }
+  switch (ch) {
+    case 'g':
+    case '"':
+    case ']':
+    case '[':
+    case CTRL_W:
+      lastChar = ch;
+      return;
+    case 'h': case 'j': case 'k': case 'l': case '0': case '$': case 'G':
+    case 'w': case 'b': case 'e': case 'W': case 'B': case 'E':
+    case '%': case '{': case '}':
+      runMotion(std::string(1, ch));
+      return;
+    case 'd': case 'y': case '>': case '<':
+      if (state == programState::Visual) {
+        handleVisual(ch);
+      } else if (pendingOperator == ch) {
+        runMotion("_");
+      } else if (pendingOperator) {
+        resetPending();
+      } else {
+        pendingOperator = ch;
+        operatorCount = count;
+        count = 0;
+      }
+      return;
+    default:
+      break;
+  }
+  if (pendingOperator) {
+    resetPending();
+    return;
+  }
+  if (state == programState::Visual && ch == 'x') {
+    handleVisual('d');
+    return;
+  }
+  int times = std::max(1, count);
+  char name = pendingRegister ? pendingRegister : '"';
+  resetPending();
+  if (ch == ':') {
+    command = state == programState::Visual ? "'<,'>" : "";
+    state = programState::Command;
+    buffer[currentFile].stopVisual();
+    buffer[currentFile].setPrompt(ANSI::purple(":"));
+    if (!FileManager::isSuspended()) {
+      buffer[currentFile].updateCommandDisplay();
+      printf("%s", ANSI::purple(command).c_str());
+      fflush(stdout);
+    }
+  } else if (ch == 'v' || ch == 'V' || ch == CTRL_V) {
+    if (buffer[currentFile].visual() == ch) {
+      handleESC();
+    } else {
+      state = programState::Visual;
+      buffer[currentFile].startVisual(ch);
+      buffer[currentFile].setPrompt(ANSI::cyan(ch == 'v' ? "[VISUAL]" : ch == 'V' ? "[VISUAL LINE]" : "[VISUAL BLOCK]"));
+    }
+  } else if (state == programState::Visual) {
+    if (ch == 'o') {
+      buffer[currentFile].swapVisual();
+    }
+  } else if (ch == 'q') {
+    if (recordingInto) {
+      stopRecording();
+    } else if (!replaying) {
+      lastChar = 'q';
+    }
+  } else if (ch == '@') {
+    count = times;
+    lastChar = '@';
+  } else if (ch == 'u') {
+    handleUNDO(times);
+  } else if (ch == 'i') {
+    state = programState::Insert;
+    buffer[currentFile].setPrompt(ANSI::red("[INSERT]"), true);
+  } else if (ch == 'p') {
+    auto it = registers.find(name);
+    if (it == registers.end() || it->second.empty()) {
+      buffer[currentFile].setPrompt(ANSI::purple(std::string("Register ") + name + " is empty."), true);
+    } else {
+      buffer[currentFile].paste(it->second, times);
+    }
+  }
+}
+// The keys of a macro are kept as text in the register, split at ENTER,
+// so that they can be pasted, edited and yanked back like any text.
+void Core::stopRecording() {
+  recorded.pop_back(); // the q that stopped it
+  std::vector<Line> lines;
+  std::string line;
+  for (char c: recorded) {
+    if (c == ENTER) {
+      lines.emplace_back(line);
+      line.clear();
+    } else {
+      line.push_back(c);
+    }
+  }
+  lines.emplace_back(line);
+  int n = (int)lines.size();
+  registers[recordingInto] = Register(std::make_shared<const std::vector<Line>>(std::move(lines)),
+                                      0, n, false);
+  buffer[currentFile].setPrompt(ANSI::purple(std::string("Recorded @") + recordingInto), true);
+  recordingInto = 0;
+  recorded.clear();
+}
+// Runs the keys of a register times times. Nothing is drawn until the
+// outermost replay ends, and what it changed in each buffer is one undo
+// step.
+void Core::replay(char name, int times) {
+  if (name == '@') {
+    name = lastMacro;
+  }
+  auto it = registers.find(name);
+  if (!name || it == registers.end() || it->second.empty()) {
+    buffer[currentFile].setPrompt(ANSI::purple(std::string("Register ") + (name ? name : '@') + " is empty."), true);
+    return;
+  }
+  if (replaying >= MAX_MACRO_DEPTH) {
+    return;
+  }
+  lastMacro = name;
+  std::string keys;
+  const Register &reg = it->second;
+  for (int i = 0; i < reg.size(); ++i) {
+    if (i) keys.push_back(ENTER);
+    keys += reg.line(i);
+  }
+  if (reg.linewise) {
+    keys.push_back(ENTER);
+  }
+  bool outer = replaying == 0;
+  std::vector<int> marks;
+  if (outer) {
+    for (const auto &file: buffer) {
+      marks.push_back(file.history());
+    }
+    FileManager::suspend(true);
+  }
+  // As in vim, a motion that fails stops the macro, its other runs and
+  // the macros that ran it
+  replaying ++;
+  for (int t = 0; t < times && !end && !aborted; ++t) {
+    for (size_t i = 0; i < keys.size() && !end && !aborted; ) {
+      size_t len = keys[i] == ESC && i + 2 < keys.size() && keys[i + 1] == '['
+                   && keys[i + 2] >= 'A' && keys[i + 2] <= 'D' ? 3 : 1;
+      press(keys.substr(i, len));
+      i += len;
+    }
+  }
+  replaying --;
+  if (outer) {
+    aborted = false;
+    FileManager::suspend(false);
+    for (int i = 0; i < (int)buffer.size(); ++i) {
+      buffer[i].join(marks[i]);
+    }
+    if (!end) {
+      redraw();
+    }
+  }
+}
+// An operator in visual mode applies to the selection at once, then
+// returns to normal mode.
+void Core::handleVisual(char op) {
+  int times = std::max(1, count);
+  char name = pendingRegister;
+  resetPending();
+  Register yanked;
+  state = programState::Normal;
+  buffer[currentFile].setPrompt("");
+  buffer[currentFile].operateVisual(op, times, yanked);
+  keep(name, std::move(yanked));
+}
 void Core::handle(char ch) {
   switch (state) {
     case programState::Normal:
-      if (ch == 'u') {
-        handleUNDO();
-      } else if (ch == 'i') {
-        state = programState::Insert;
-        buffer[currentFile].setPrompt(ANSI::red("[INSERT]"), true);
-      } else if (ch == ':') {
-        state = programState::Command;
-        command = "";
-        buffer[currentFile].setPrompt(ANSI::purple(":"));
-        buffer[currentFile].updateCommandDisplay();
-      } else if (ch == 'h' || ch == 'j' || ch == 'k' || ch == 'l') {
-        switch (ch) {
-          case 'h':
-            buffer[currentFile].moveCursor(direction::LEFT);
-            break;
-          case 'j':
-            buffer[currentFile].moveCursor(direction::DOWN);
-            break;
-          case 'k':
-            buffer[currentFile].moveCursor(direction::UP);
-            break;
-          case 'l':
-            buffer[currentFile].moveCursor(direction::RIGHT);
-            break;
-          default:
-            break;
-        }
-      } else if (ch == '0' || ch == '$') {
-        if (ch == '0') buffer[currentFile].toLineFront();
-        else buffer[currentFile].toLineEnd();
-      } else if (ch == 'G') {
-        buffer[currentFile].toLastLine();
-      } else if (ch == 'g' && lastChar == 'g') {
-        buffer[currentFile].toFirstLine();
-        ch = 0;
-      } else if (ch == 'd' && lastChar == 'd') {
-        buffer[currentFile].deleteLine();
-        ch = 0;
-      } else if (ch == 'y' && lastChar == 'y') {
-        buffer[currentFile].copyLine();
-        ch = 0;
-      } else if (ch == 'p') {
-        buffer[currentFile].pasteLine();
-      }
-
+    case programState::Visual:
+      handleNormal(ch);
       break;
     case programState::Command:
-      printf("%s", ANSI::purple(std::string(1, ch)).c_str());
       command.push_back(ch);
+      if (!utf8::missing(command) && !FileManager::isSuspended()) {
+        printf("%s", ANSI::purple(command.substr(utf8::lastStart(command))).c_str());
+      }
+      break;
+    case programState::Conflict:
+      if (ch == 'r' || ch == 'R') {
+        resolveConflict(true);
+      } else if (ch == 'k' || ch == 'K') {
+        resolveConflict(false);
+      }
       break;
     case programState::Insert:
       buffer[currentFile].insertChar(ch);
       break;
   }
-  lastChar = ch;
-}
\ No newline at end of file
+}
+// :grep /pattern/ (or :grep pattern) searches every buffer: the loaded
+// ones as they are in memory, the others on disk.
+void Core::startGrep(std::string pattern) {
+  if (pattern.size() >= 2 && pattern.front() == '/' && pattern.back() == '/') {
+    pattern = pattern.substr(1, pattern.size() - 2);
+  }
+  if (pattern.empty()) {
+    buffer[currentFile].setPrompt(ANSI::purple("Invalid Command."), true);
+    return;
+  }
+  std::vector<Grep::target> targets;
+  for (int i = 0; i < (int)buffer.size(); ++i) {
+    // A binary buffer has no lines: its file is searched on disk
+    bool inMemory = buffer[i].isLoaded() && !buffer[i].isBinary();
+    targets.push_back({i, buffer[i].name(), inMemory ? buffer[i].snapshot() : nullptr});
+  }
+  quickfix.clear();
+  quickfixIndex = -1;
+  grepPattern = pattern;
+  grep.start(pattern, std::move(targets));
+  buffer[currentFile].setPrompt(ANSI::purple("[grep] Searching " + std::to_string(buffer.size()) + " files..."), true);
+}
+// Goes to match k of the quickfix list, in its file
+void Core::goQuickfix(int k, bool force) {
+  const Grep::match &m = quickfix[k];
+  if (m.file != currentFile && !force && !buffer[currentFile].isSaved()) {
+    buffer[currentFile].setPrompt(ANSI::purple("[Warning] You should save by :w first. (Or add ! to override)"));
+    return;
+  }
+  quickfixIndex = k;
+  if (m.file != currentFile) {
+    switchTo(m.file);
+  }
+  FileManager &file = buffer[currentFile];
+  int line = std::min(m.line, file.lineCount() - 1);
+  file.moveTo(motion{line, m.column, false, false});
+  file.setPrompt(ANSI::purple("(" + std::to_string(k + 1) + " of " + std::to_string(quickfix.size())
+                              + (grep.running() ? "+" : "") + ") " + file.name() + ":"
+                              + std::to_string(line + 1) + ": " + m.text), true);
+}
+int Core::grepDescriptor() const {
+  return grep.descriptor();
+}
+// Matches arrive file by file while the search runs; the first one is
+// shown at once, and the prompt counts the rest (at most once per frame).
+void Core::handleGrep() {
+  auto found = grep.collect();
+  bool running = grep.running();
+  for (auto &m: found) {
+    quickfix.push_back(std::move(m));
+  }
+  if (state != programState::Normal) {
+    return;
+  }
+  if (quickfixIndex < 0 && !quickfix.empty()) {
+    goQuickfix(0, false);
+  } else if (quickfixIndex < 0 && !running) {
+    buffer[currentFile].setPrompt(ANSI::purple("Pattern not found: " + grepPattern), true);
+  } else if (quickfixIndex >= 0 && (!running || (!found.empty() && std::chrono::steady_clock::now() - lastGrepPrompt
+                                                     >= std::chrono::milliseconds(FOLLOW_FRAME_INTERVAL)))) {
+    lastGrepPrompt = std::chrono::steady_clock::now();
+    buffer[currentFile].setPrompt(ANSI::purple("[grep] " + std::to_string(quickfix.size()) + " matches in "
+                                               + std::to_string(grep.files()) + " of "
+                                               + std::to_string(buffer.size()) + " files"
+                                               + (running ? "..." : "")), true);
+  }
+}
+int Core::watchDescriptor() const {
+  return watcher.descriptor();
+}
+int Core::highlightDescriptor() const {
+  return Highlighter::descriptor();
+}
+void Core::handleHighlight() {
+  Highlighter::drain();
+  bool colored = false;
+  for (int file: layout.files()) {
+    colored = buffer[file].collectHighlight() || colored;
+  }
+  if (colored && state != programState::Conflict) {
+    redraw();
+  }
+}
+int Core::pollTimeout() const {
+  int wait = watcher.timeout();
+  if (framePending) {
+    auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+            lastFrame + std::chrono::milliseconds(FOLLOW_FRAME_INTERVAL) - std::chrono::steady_clock::now());
+    int frame = std::max(0, (int)left.count());
+    return wait < 0 ? frame : std::min(wait, frame);
+  }
+  return wait;
+}
+void Core::handleFileChange() {
+  for (const auto &change: watcher.drain()) {
+    const std::string &file = change.file;
+    for (int i = 0; i < (int)buffer.size(); ++i) {
+      if (buffer[i].name() != file)
+        continue;
+      if (buffer[i].following()) {
+        if (!buffer[i].pull() && buffer[i].readable()) {
+          std::vector<Line> content;
+          fileFormat f = load(file, content);
+          buffer[i].reload(content, f);
+          buffer[i].follow();
+          if (shown(i)) redraw();
+        } else if (shown(i)) {
+          framePending = true;
+        }
+        continue;
+      }
+      // A file still being written is read once, when it is closed or quiet
+      if (!change.complete || !buffer[i].changedOnDisk())
+        continue;
+      if (!buffer[i].readable()) {
+        buffer[i].markDeleted();
+        if (i == currentFile && state != programState::Command) {
+          buffer[currentFile].setPrompt(ANSI::red("[Deleted] " + file + " is gone from disk; the buffer is kept"), true);
+        }
+      } else if (buffer[i].unchanged()) {
+        reread(buffer[i]);
+        if (i == currentFile && state != programState::Command) {
+          buffer[currentFile].setPrompt(ANSI::purple("[Reloaded " + file + "]"), true);
+        } else if (shown(i)) {
+          redraw();
+        }
+      } else if (std::find(conflicts.begin(), conflicts.end(), i) == conflicts.end()) {
+        conflicts.push_back(i);
+      }
+    }
+  }
+  tick();
+  nextConflict();
+}
+// :N or :0xN in a binary buffer goes to that byte
+bool Core::jumpOffset(const std::string &command) {
+  bool hex = command.size() > 2 && command[0] == '0' && (command[1] == 'x' || command[1] == 'X');
+  std::string digits = hex ? command.substr(2) : command;
+  if (digits.empty() || digits.size() > 15
+      || digits.find_first_not_of(hex ? "0123456789abcdefABCDEF" : "0123456789") != std::string::npos) {
+    return false;
+  }
+  buffer[currentFile].moveOffset(std::stoll(digits, nullptr, hex ? 16 : 10));
+  return true;
+}
+// A file changed on disk is read again, or mapped again if binary. A
+// file gone or unreadable is not: reading it would empty the buffer.
+bool Core::reread(FileManager &file) {
+  if (!file.readable()) {
+    file.markDeleted();
+    return false;
+  }
+  if (file.isBinary()) {
+    file.reopen();
+    return true;
+  }
+  std::vector<Line> content;
+  fileFormat f = load(file.name(), content);
+  file.reload(content, f);
+  return true;
+}
+void Core::redraw() {
+  buffer[currentFile].display();
+  if (state == programState::Command) {
+    buffer[currentFile].updateCommandDisplay();
+    printf("%s", ANSI::purple(command).c_str());
+    fflush(stdout);
+  }
+}
+void Core::tick() {
+  if (!framePending)
+    return;
+  auto now = std::chrono::steady_clock::now();
+  if (now - lastFrame < std::chrono::milliseconds(FOLLOW_FRAME_INTERVAL))
+    return;
+  framePending = false;
+  lastFrame = now;
+  if (state == programState::Command || composed()) {
+    redraw();
+  } else {
+    buffer[currentFile].drawAppended();
+  }
+}
+void Core::follow(int file) {
+  ensureLoaded(file);
+  if (!buffer[file].isSaved()) {
+    buffer[currentFile].setPrompt(ANSI::purple("[Warning] You should save by :w first."), true);
+  } else if (!buffer[file].follow()) {
+    buffer[currentFile].setPrompt(ANSI::purple("Cannot follow " + buffer[file].name() + "."), true);
+  } else {
+    buffer[file].toLastLine();
+    if (file == currentFile)
+      buffer[currentFile].setPrompt(ANSI::purple("[Following " + buffer[file].name() + "]"), true);
+  }
+}
+void Core::followAll() {
+  for (int i = 0; i < (int)buffer.size(); ++i) {
+    follow(i);
+  }
+}
+void Core::serve() {
+  served = true;
+  hookWindows();
+}
+// -d: the first two files side by side, compared
+void Core::diffSplit() {
+  if (buffer.size() < 2) {
+    buffer[currentFile].setPrompt(ANSI::purple("-d needs two files."), true);
+    buffer[currentFile].display();
+    return;
+  }
+  ensureLoaded(1);
+  if (buffer[0].isBinary() || buffer[1].isBinary()) {
+    buffer[currentFile].setPrompt(ANSI::purple("-d cannot compare binary files."), true);
+    return;
+  }
+  switchTo(1);
+  splitWindow(true);
+  switchTo(0);
+  diffed[0] = 0;
+  diffed[1] = 1;
+  startDiff();
+}
+// A client attached to the server: its files are opened, or just shown
+// if they are open already, and everything is drawn for its terminal.
+// Names are compared resolved, so ./a.txt and a link to it find the
+// buffer of a.txt; a file not on disk yet by its resolved directory.
+void Core::attach(const std::string &cwd, const std::vector<std::string> &files) {
+  char dir[PATH_MAX];
+  std::string here = getcwd(dir, sizeof(dir)) ? dir : "";
+  auto absolute = [](const std::string &base, const std::string &name) {
+    return name[0] == '/' ? name : base + "/" + name;
+  };
+  auto resolved = [&](const std::string &base, const std::string &name) {
+    std::string path = absolute(base, name);
+    char real[PATH_MAX];
+    if (realpath(path.c_str(), real)) {
+      return std::string(real);
+    }
+    auto slash = path.find_last_of('/');
+    std::string parent = slash == 0 ? "/" : path.substr(0, slash);
+    if (realpath(parent.c_str(), real)) {
+      return std::string(real) + (real[1] ? "/" : "") + path.substr(slash + 1);
+    }
+    return path;
+  };
+  int first = -1;
+  for (const auto &name: files) {
+    std::string path = absolute(cwd, name), real = resolved(cwd, name);
+    int found = -1;
+    for (int i = 0; i < (int)buffer.size() && found < 0; ++i) {
+      if (resolved(here, buffer[i].name()) == real) {
+        found = i;
+      }
+    }
+    if (found < 0) {
+      found = open(cwd == here ? name : path);
+    }
+    if (first < 0) {
+      first = found;
+    }
+  }
+  for (auto &file: buffer) {
+    file.getTerminalSize();
+  }
+  layout.resize();
+  hookWindows();
+  if (first >= 0 && first != currentFile) {
+    switchTo(first);
+    buffer[currentFile].openPrompt();
+  }
+  redraw();
+}
+void Core::nextConflict() {
+  if (end || conflicts.empty() || state == programState::Command || state == programState::Conflict)
+    return;
+  conflictReturn = state;
+  state = programState::Conflict;
+  buffer[currentFile].setPrompt(ANSI::red("[Conflict] " + buffer[conflicts.front()].name()
+                                          + " changed on disk. (r)eload / (k)eep buffer?"));
+}
+void Core::resolveConflict(bool reload) {
+  auto &file = buffer[conflicts.front()];
+  conflicts.erase(conflicts.begin());
+  bool read = false;
+  if (reload) {
+    read = reread(file);
+  } else {
+    file.syncStamp();
+  }
+  state = conflictReturn;
+  if (reload && !read) {
+    buffer[currentFile].setPrompt(ANSI::red("[Deleted] " + file.name() + " is gone from disk; the buffer is kept"), true);
+  } else {
+    buffer[currentFile].setPrompt(ANSI::purple(reload ? "[Reloaded " + file.name() + "]"
+                                                      : "[Kept buffer of " + file.name() + "]"), true);
+  }
+  nextConflict();
+}
@@ -0,0 +1,365 @@
+#include <algorithm>
+#include <string_view>
+#include <functional>
+#include <vector>
+
+#include "diff.h"
+
+namespace {
+  using hunk = Diff::hunk;
+
+  struct range {
+    int a0, a1, b0, b1;
+  };
+
+  // Numbers lines by their text: equal lines, equal numbers. Open
+  // addressing over one array, as there is a number for most lines.
+  class Numbering {
+    std::vector<int> slots;          // number + 1, 0 if free
+    std::vector<std::string_view> texts;
+    size_t mask;
+
+  public:
+    explicit Numbering(size_t lines) {
+      size_t size = 16;
+      while (size < 2 * lines) size <<= 1;
+      slots.assign(size, 0);
+      mask = size - 1;
+      texts.reserve(lines);
+    }
+    int of(std::string_view text) {
+      for (size_t i = std::hash<std::string_view>()(text) & mask; ; i = (i + 1) & mask) {
+        if (!slots[i]) {
+          texts.push_back(text);
+          slots[i] = (int)texts.size();
+          return slots[i] - 1;
+        }
+        if (texts[slots[i] - 1] == text) {
+          return slots[i] - 1;
+        }
+      }
+    }
+    size_t size() const {
+      return texts.size();
+    }
+  };
+
+  // Appends a hunk, joining it to the last one when they touch
+  void add(std::vector<hunk> &out, int a, int aCount, int b, int bCount) {
+    if (!out.empty()) {
+      hunk &last = out.back();
+      if (last.start[0] + last.count[0] == a && last.start[1] + last.count[1] == b) {
+        last.count[0] += aCount;
+        last.count[1] += bCount;
+        return;
+      }
+    }
+    out.push_back({{a, b}, {aCount, bCount}, false});
+  }
+
+  // Above this many edits the middle of a range is guessed rather than
+  // searched for, as git does; about the square root of its size.
+  int costLimit(int n) {
+    int cost = 1;
+    for (int diagonals = n + 3; diagonals != 0; diagonals >>= 2) {
+      cost <<= 1;
+    }
+    return std::max(cost, 256);
+  }
+
+  // The linear-space refinement of Myers' O(ND) algorithm. Paths are
+  // grown from both corners of a range at once, keeping only the furthest
+  // point of each diagonal, until they meet; the range is then split where
+  // they met and both halves are compared the same way.
+  class Myers {
+    const std::vector<int> &a, &b;
+    std::vector<int> forward, backward; // furthest x of each diagonal, -1 if not reached
+
+    bool middle(const range &r, int &x, int &y);
+
+  public:
+    Myers(const std::vector<int> &a_, const std::vector<int> &b_)
+            : a(a_), b(b_), forward(a_.size() + b_.size() + 3), backward(a_.size() + b_.size() + 3) {}
+
+    // Marks the elements of a and b that are not in a longest common subsequence
+    void run(std::vector<char> &changedA, std::vector<char> &changedB);
+  };
+
+  // A point on a shortest path through the range, strictly inside it.
+  // Diagonal k holds the points with x - y == k; the backward paths count
+  // x and y from the far corner.
+  bool Myers::middle(const range &r, int &x, int &y) {
+    int n = r.a1 - r.a0, m = r.b1 - r.b0, delta = n - m, off = m + 1;
+    std::fill(forward.begin(), forward.begin() + n + m + 3, -1);
+    std::fill(backward.begin(), backward.begin() + n + m + 3, -1);
+    auto furthest = [&](const std::vector<int> &v, int k) {
+      if (k == 0 && v[off] < 0) {
+        return 0;
+      }
+      int best = v[k + off];
+      if (k > -m && v[k - 1 + off] >= 0 && v[k - 1 + off] < n) {
+        best = std::max(best, v[k - 1 + off] + 1);
+      }
+      if (k < n && v[k + 1 + off] >= 0 && v[k + 1 + off] - (k + 1) < m) {
+        best = std::max(best, v[k + 1 + off]);
+      }
+      return best;
+    };
+    int limit = costLimit(n + m);
+    for (int d = 0; ; ++d) {
+      for (int k = -d; k <= d; k += 2) {
+        if (k < -m || k > n) continue;
+        int px = furthest(forward, k);
+        if (px < 0) continue;
+        int start = px;
+        while (px < n && px - k < m && a[r.a0 + px] == b[r.b0 + px - k]) {
+          px ++;
+        }
+        forward[k + off] = px;
+        int back = delta - k;
+        if (back >= -m && back <= n && backward[back + off] >= 0 && px + backward[back + off] >= n) {
+          if (px == n && px - k == m) {
+            px = start;
+          }
+          x = r.a0 + px;
+          y = r.b0 + px - k;
+          return true;
+        }
+      }
+      for (int k = -d; k <= d; k += 2) {
+        if (k < -m || k > n) continue;
+        int px = furthest(backward, k);
+        if (px < 0) continue;
+        int start = px;
+        while (px < n && px - k < m && a[r.a1 - 1 - px] == b[r.b1 - 1 - (px - k)]) {
+          px ++;
+        }
+        backward[k + off] = px;
+        int front = delta - k;
+        if (front >= -m && front <= n && forward[front + off] >= 0 && px + forward[front + off] >= n) {
+          if (px == n && px - k == m) {
+            px = start;
+          }
+          x = r.a1 - px;
+          y = r.b1 - (px - k);
+          return true;
+        }
+      }
+      if (d < limit) continue;
+      // Too costly: split after the path that got furthest
+      int best = -1;
+      for (int k = -d; k <= d; ++k) {
+        if (k < -m || k > n) continue;
+        if (forward[k + off] >= 0 && 2 * forward[k + off] - k > best) {
+          best = 2 * forward[k + off] - k;
+          x = r.a0 + forward[k + off];
+          y = r.b0 + forward[k + off] - k;
+        }
+        if (backward[k + off] >= 0 && 2 * backward[k + off] - k > best) {
+          best = 2 * backward[k + off] - k;
+          x = r.a1 - backward[k + off];
+          y = r.b1 - (backward[k + off] - k);
+        }
+      }
+      return best > 0 && best < n + m;
+    }
+  }
+
+  void Myers::run(std::vector<char> &changedA, std::vector<char> &changedB) {
+    std::vector<range> todo{{0, (int)a.size(), 0, (int)b.size()}};
+    while (!todo.empty()) {
+      range r = todo.back();
+      todo.pop_back();
+      while (r.a0 < r.a1 && r.b0 < r.b1 && a[r.a0] == b[r.b0]) {
+        r.a0 ++;
+        r.b0 ++;
+      }
+      while (r.a0 < r.a1 && r.b0 < r.b1 && a[r.a1 - 1] == b[r.b1 - 1]) {
+        r.a1 --;
+        r.b1 --;
+      }
+      int x = 0, y = 0;
+      if (r.a0 < r.a1 && r.b0 < r.b1 && middle(r, x, y) && x + y > r.a0 + r.b0 && x + y < r.a1 + r.b1) {
+        todo.push_back({x, r.a1, y, r.b1});
+        todo.push_back({r.a0, x, r.b0, y});
+      } else {
+        std::fill(changedA.begin() + r.a0, changedA.begin() + r.a1, 1);
+        std::fill(changedB.begin() + r.b0, changedB.begin() + r.b1, 1);
+      }
+    }
+  }
+}
+
+// Lines equal at both ends are skipped first. The rest are hashed, equal
+// lines to the same number, so that the search compares integers; lines
+// found on one side only are changed for sure and left out of it.
+void Diff::compare(const std::vector<Line> &a, int a0, int a1,
+                   const std::vector<Line> &b, int b0, int b1, std::vector<hunk> &out) {
+  while (a0 < a1 && b0 < b1 && a[a0] == b[b0]) {
+    a0 ++;
+    b0 ++;
+  }
+  while (a0 < a1 && b0 < b1 && a[a1 - 1] == b[b1 - 1]) {
+    a1 --;
+    b1 --;
+  }
+  if (a0 == a1 || b0 == b1) {
+    if (a0 < a1 || b0 < b1) {
+      add(out, a0, a1 - a0, b0, b1 - b0);
+    }
+    return;
+  }
+  Numbering ids((a1 - a0) + (b1 - b0));
+  std::vector<char> sides((a1 - a0) + (b1 - b0)); // bit 1 if the line is in a, bit 2 if in b
+  auto hash = [&](const std::vector<Line> &lines, int from, int to, char bit) {
+    std::vector<int> out;
+    out.reserve(to - from);
+    for (int i = from; i < to; ++i) {
+      int id = ids.of(lines[i].view());
+      sides[id] |= bit;
+      out.push_back(id);
+    }
+    return out;
+  };
+  std::vector<int> x = hash(a, a0, a1, 1), y = hash(b, b0, b1, 2);
+  std::vector<char> changedA(x.size(), 1), changedB(y.size(), 1);
+  auto keep = [&](const std::vector<int> &all, std::vector<int> &kept, std::vector<int> &at) {
+    for (int i = 0; i < (int)all.size(); ++i) {
+      if (sides[all[i]] == 3) {
+        kept.push_back(all[i]);
+        at.push_back(i);
+      }
+    }
+  };
+  std::vector<int> keptA, keptB, atA, atB;
+  keep(x, keptA, atA);
+  keep(y, keptB, atB);
+  std::vector<char> searchedA(keptA.size()), searchedB(keptB.size());
+  Myers(keptA, keptB).run(searchedA, searchedB);
+  for (size_t i = 0; i < atA.size(); ++i) {
+    changedA[atA[i]] = searchedA[i];
+  }
+  for (size_t i = 0; i < atB.size(); ++i) {
+    changedB[atB[i]] = searchedB[i];
+  }
+  // The lines left unchanged on both sides face each other in order
+  int i = 0, j = 0, n = (int)x.size(), m = (int)y.size();
+  while (i < n || j < m) {
+    if ((i < n && changedA[i]) || (j < m && changedB[j])) {
+      int si = i, sj = j;
+      while (i < n && changedA[i]) i ++;
+      while (j < m && changedB[j]) j ++;
+      add(out, a0 + si, i - si, b0 + sj, j - sj);
+    } else {
+      i ++;
+      j ++;
+    }
+  }
+}
+
+// Index of the last hunk starting at or before line, -1 if none
+int Diff::find(int side, int line) const {
+  auto it = std::upper_bound(hunks.begin(), hunks.end(), line, [side](int l, const hunk &h) {
+    return l < h.start[side];
+  });
+  return (int)(it - hunks.begin()) - 1;
+}
+
+// Everything differs until the first refresh()
+void Diff::reset(int lines0, int lines1) {
+  hunks.assign(1, {{0, 0}, {lines0, lines1}, true});
+  pending = true;
+}
+
+// Lines pos..pos+removed of a side became inserted lines. The hunks they
+// touch and the lines facing them on the other side become one stale
+// hunk; the hunks below move.
+void Diff::edit(int side, int pos, int removed, int inserted) {
+  int other = 1 - side, end = pos + removed;
+  auto first = std::lower_bound(hunks.begin(), hunks.end(), pos, [side](const hunk &h, int p) {
+    return h.start[side] + h.count[side] < p;
+  });
+  auto last = first;
+  while (last != hunks.end() && last->start[side] <= end) {
+    ++last;
+  }
+  // Equal lines face each other at this offset until the next hunk
+  int offset = first == hunks.begin() ? 0 : (first - 1)->start[other] + (first - 1)->count[other]
+                                            - (first - 1)->start[side] - (first - 1)->count[side];
+  hunk merged{{0, 0}, {0, 0}, true};
+  merged.start[side] = pos;
+  merged.start[other] = pos + offset;
+  int to = end, otherTo = end + offset;
+  if (first != last) {
+    const hunk &f = *first, &l = *(last - 1);
+    if (f.start[side] <= pos) {
+      merged.start[side] = f.start[side];
+      merged.start[other] = f.start[other];
+    }
+    if (l.start[side] + l.count[side] >= end) {
+      to = l.start[side] + l.count[side];
+      otherTo = l.start[other] + l.count[other];
+    } else {
+      otherTo = end + l.start[other] + l.count[other] - l.start[side] - l.count[side];
+    }
+  }
+  merged.count[side] = to - merged.start[side] + inserted - removed;
+  merged.count[other] = otherTo - merged.start[other];
+  auto at = hunks.erase(first, last);
+  at = hunks.insert(at, merged);
+  for (++at; at != hunks.end(); ++at) {
+    at->start[side] += inserted - removed;
+  }
+  pending = true;
+}
+
+bool Diff::stale() const {
+  return pending;
+}
+
+// Compares the stale hunks again; false if there were none
+bool Diff::refresh(const std::vector<Line> &a, const std::vector<Line> &b) {
+  if (!pending) {
+    return false;
+  }
+  std::vector<hunk> fresh;
+  for (const auto &h: hunks) {
+    if (h.stale) {
+      compare(a, h.start[0], h.start[0] + h.count[0], b, h.start[1], h.start[1] + h.count[1], fresh);
+    } else {
+      fresh.push_back(h);
+    }
+  }
+  hunks.swap(fresh);
+  pending = false;
+  return true;
+}
+
+size_t Diff::size() const {
+  return hunks.size();
+}
+
+char Diff::kindOf(int side, int line) const {
+  int i = find(side, line);
+  if (i < 0 || line >= hunks[i].start[side] + hunks[i].count[side]) {
+    return 0;
+  }
+  return hunks[i].count[1 - side] ? 'c' : 'a';
+}
+
+int Diff::facing(int side, int line) const {
+  int i = find(side, line), other = 1 - side;
+  if (i < 0) {
+    return line;
+  }
+  const hunk &h = hunks[i];
+  if (line < h.start[side] + h.count[side]) {
+    return h.start[other] + std::min(line - h.start[side], std::max(0, h.count[other] - 1));
+  }
+  return line - h.start[side] - h.count[side] + h.start[other] + h.count[other];
+}
+
+int Diff::next(int side, int line, int step) const {
+  int i = step > 0 ? find(side, line) + 1 : find(side, line - 1);
+  return i >= 0 && i < (int)hunks.size() ? hunks[i].start[side] : -1;
+}
@@ -1,11 +1,17 @@
 #include <vector>
 #include <string>
 #include <memory>
+#include <cstring>
 
 #include "log.h"
 #include "filemanager.h"
+#include "filter.h"
+#include "highlight.h"
+#include "utf8.h"
 #include "utility.h"
 
+bool FileManager::suspended = false;
+
 void FileManager::getTerminalSize() {
   struct winsize w{};
   ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
@@ -13,32 +19,153 @@ void FileManager::getTerminalSize() {
   terminalWidth = w.ws_col;
 }
 
-void FileManager::splitLine(const std::string &line, std::vector<std::string> &output, int lineid) const {
-  int len = (int)line.size();
+std::string FileManager::paint(std::string_view line, int from, int to, const std::vector<span> *spans,
+                               int selFrom, int selTo, bool invalid) const {
+  if (!spans && (selTo <= from || selFrom >= to)) {
+    return invalid ? utf8::sanitize(line.substr(from, to - from)) : std::string(line.substr(from, to - from));
+  }
+  std::vector<int> color(to - from, 0);
+  if (spans) {
+    for (const auto &s: *spans) {
+      if (s.to <= from) continue;
+      if (s.from >= to) break;
+      std::fill(color.begin() + (std::max(s.from, from) - from),
+                color.begin() + (std::min(s.to, to) - from), Highlighter::colorOf(s.kind));
+    }
+  }
+  std::string row;
+  for (int k = from; k < to; ) {
+    int c = color[k - from];
+    bool selected = k >= selFrom && k < selTo;
+    int j = k + 1;
+    while (j < to && color[j - from] == c && (j >= selFrom && j < selTo) == selected) {
+      j ++;
+    }
+    std::string piece(line.substr(k, j - k));
+    if (invalid) piece = utf8::sanitize(piece);
+    if (c) piece = ANSI::foreground(c, piece);
+    if (selected) piece = ANSI::reverse(piece);
+    row += piece;
+    k = j;
+  }
+  return row;
+}
+// A line that differs from the other buffer of a diff has its rows filled
+// with a background: blue if only this side has it, magenta if changed.
+// Only rows [first, first + count) of the line are made, so a line of
+// many megabytes costs the rows on the screen. False if rows below were
+// left out.
+bool FileManager::splitLine(int line, std::vector<std::string> &output, int selFrom, int selTo,
+                            const std::vector<span> *spans, char differs, int first, int count) const {
+  int len = lengthOf(line);
+  auto fill = [&](std::string row, int used) {
+    return differs ? ANSI::background(differs == 'a' ? 44 : 45, row + std::string(std::max(0, width - used), ' '))
+                   : row;
+  };
+  auto gutter = [&](int r) {
+    if (!numbered) return std::string();
+    return r == 0 ? ANSI::grey(align_num(line + 1, lineWidth - 1)) + " " : std::string(lineWidth, ' ');
+  };
+  // The line in the rope is read a row at a time
+  auto segment = [&](int from, int to, bool invalid) {
+    if (line != ropeLine) {
+      return paint((*content)[line], from, to, spans, selFrom, selTo, invalid);
+    }
+    return paint(rope.substr(from, to - from), 0, to - from, nullptr, selFrom - from, selTo - from, false);
+  };
   if (len == 0) {
-    output.push_back(numbered ? ANSI::grey(align_num(lineid, lineWidth - 1)) + " " : "");
-    return ;
+    if (first == 0 && count > 0) {
+      output.push_back(gutter(0) + fill(selFrom >= 0 ? ANSI::reverse(" ") : "", selFrom >= 0));
+    }
+    return count > 0;
   }
-  for (int i = 0; i < len; i += width) {
-    if (numbered) {
-      if (lineid == -1) {
-        output.push_back(std::string(lineWidth - 1, ' ')
-                         + " " + line.substr(i, width));
-      } else {
-        output.push_back(ANSI::grey(align_num(lineid, lineWidth - 1))
-                         + " " + line.substr(i, width));
-        lineid = -1;
+  if (line == ropeLine) {
+    int stride = ropeStride();
+    if (!wrapping) {
+      if (first == 0 && count > 0) {
+        int from = ropeFrom(std::min(windowStartCol, len)), to = std::max(from, ropeFrom(std::min(windowStartCol + stride, len)));
+        output.push_back(gutter(0) + fill(segment(from, to, false), ropeWidth(from, to)));
       }
-    } else {
-      output.push_back(line.substr(i, width));
+      return count > 0;
+    }
+    int rows = (len + stride - 1) / stride;
+    for (int r = first; r < rows && r - first < count; ++r) {
+      int from = ropeFrom(r * stride), to = ropeFrom(std::min(len, (r + 1) * stride));
+      output.push_back(gutter(r) + fill(segment(from, to, false), differs ? ropeWidth(from, to) : 0));
     }
+    return rows - first <= count;
   }
+  const Columns *cols = columnsOf(line);
+  if (!wrapping) {
+    if (first > 0 || count <= 0) {
+      return count > 0;
+    }
+    int from = cols ? cols->byteAt(windowStartCol) : std::min(windowStartCol, len);
+    std::string lead;
+    if (cols && cols->columnOf(from) < windowStartCol) {
+      from = cols->next(from); // a wide character cut by the left edge
+      lead = " ";
+    }
+    int to = std::max(from, cols ? cols->byteAt(windowStartCol + width) : std::min(windowStartCol + width, len));
+    int used = cols ? (to == len ? cols->width() : cols->columnOf(to)) - windowStartCol : to - from;
+    output.push_back(gutter(0) + fill(lead + segment(from, to, cols && !cols->valid), used));
+    return true;
+  }
+  // ASCII lines wrap every width bytes; others where the columns say,
+  // which wrap only as far as the rows shown
+  int rows = cols ? cols->rows(width, first + count + 1) : (len + width - 1) / width;
+  for (int r = first; r < rows && r - first < count; ++r) {
+    int from = cols ? cols->rowStart(r, width) : r * width;
+    int to = cols ? cols->rowStart(r + 1, width) : std::min(len, from + width);
+    output.push_back(gutter(r) + fill(segment(from, to, cols && !cols->valid),
+                                      cols ? cols->columnOf(to) - cols->columnOf(from) : to - from));
+  }
+  return rows - first <= count;
+}
+std::pair<int, int> FileManager::selectionOf(int line) const {
+  if (!visualKind) {
+    return {-1, -1};
+  }
+  int x1 = visualX, y1 = visualY, x2 = posX, y2 = posY;
+  if (std::make_pair(x2, y2) < std::make_pair(x1, y1)) {
+    std::swap(x1, x2);
+    std::swap(y1, y2);
+  }
+  if (line < x1 || line > x2) {
+    return {-1, -1};
+  }
+  int len = lengthOf(line);
+  switch (visualKind) {
+    case 'v':
+      return {line == x1 ? y1 : 0, line == x2 ? std::max(nextChar(line, y2), y2 + 1) : std::max(len, 1)};
+    case 'V':
+      return {0, std::max(len, 1)};
+    default: {
+      auto block = blockColumns();
+      return bytesOf(line, block.first, block.second);
+    }
+  }
+}
+std::pair<int, int> FileManager::blockColumns() const {
+  int a = columnOf(visualX, visualY), b = columnOf(posX, posY);
+  int aEnd = std::max(a + 1, columnOf(visualX, nextChar(visualX, visualY)));
+  int bEnd = std::max(b + 1, columnOf(posX, nextChar(posX, posY)));
+  return {std::min(a, b), std::max(aEnd, bEnd)};
+}
+std::pair<int, int> FileManager::bytesOf(int line, int c1, int c2) const {
+  int from = byteAt(line, c1);
+  int to = c2 > 0 ? nextChar(line, byteAt(line, c2 - 1)) : 0;
+  return {from, std::max(from, to)};
 }
 
-FileManager::FileManager(const std::vector<std::string> &fileContent,
+FileManager::FileManager(const std::vector<Line> &fileContent,
             std::string name) : filename(std::move(name)) {
-  content = std::make_shared<std::vector<std::string>>(fileContent);
-  assert(!fileContent.empty());
+  getTerminalSize();
+  load(fileContent);
+}
+// A buffer whose file is read when it is first shown
+FileManager::FileManager(std::string name) : filename(std::move(name)), loaded(false) {
+  content = std::make_shared<std::vector<Line>>(1);
   getTerminalSize();
 }
 
@@ -47,31 +174,394 @@ FileManager::FileManager(FileManager &&other) noexcept :
         content(std::move(other.content)),
         log(std::move(other.log)),
         prompt(std::move(other.prompt)),
+        loaded(other.loaded),
         ephemeral(other.ephemeral),
         saved(other.saved),
+        deleted(other.deleted),
         numbered(other.numbered),
+        wrapping(other.wrapping),
         posX(other.posX),
         posY(other.posY),
         terminalHeight(other.terminalHeight),
         terminalWidth(other.terminalWidth),
         windowStartX(other.windowStartX),
+        windowStartRow(other.windowStartRow),
+        windowStartCol(other.windowStartCol),
+        shownRows(other.shownRows),
+        shownEnd(other.shownEnd),
         lineWidth(other.lineWidth),
         width(other.width),
-        where(other.where) {
+        where(other.where),
+        revision(other.revision),
+        stamp(other.stamp),
+        format(other.format),
+        followFd(other.followFd),
+        followOffset(other.followOffset),
+        followPartial(other.followPartial),
+        appendedFrom(other.appendedFrom),
+        visualKind(other.visualKind),
+        visualX(other.visualX),
+        visualY(other.visualY),
+        markStartX(other.markStartX),
+        markEndX(other.markEndX),
+        columns(std::move(other.columns)),
+        typing(std::move(other.typing)),
+        rope(std::move(other.rope)),
+        ropeLine(other.ropeLine),
+        ropeEdited(other.ropeEdited),
+        ropeSource(std::move(other.ropeSource)),
+        binary(std::move(other.binary)),
+        offset(other.offset),
+        topOffset(other.topOffset),
+        perRow(other.perRow),
+        asciiSide(other.asciiSide),
+        lowNibble(other.lowNibble),
+        highlighter(std::move(other.highlighter)),
+        onShared(std::move(other.onShared)),
+        onDisplay(std::move(other.onDisplay)),
+        onChange(std::move(other.onChange)),
+        diffOf(std::move(other.diffOf)) {
   other.content = nullptr;
+  other.followFd = -1;
+}
+FileManager::~FileManager() {
+  unfollow();
+}
+const std::string &FileManager::name() const {
+  return filename;
+}
+bool FileManager::isLoaded() const {
+  return loaded;
+}
+void FileManager::load(const std::vector<Line> &fileContent, const fileFormat &f) {
+  assert(!fileContent.empty());
+  format = f;
+  ropeLine = -1;
+  ropeEdited = false;
+  rope = Rope();
+  ropeSource = Line();
+  content = std::make_shared<std::vector<Line>>(fileContent);
+  loaded = true;
+  revision ++;
+  columns.reset(content->size());
+  structure.clear();
+  syncStamp();
+  if (auto lang = Highlighter::detect(filename)) {
+    highlighter = std::make_shared<Highlighter>(lang, content->size());
+  }
+}
+// Maps the file to show it as bytes; the buffer keeps one empty line,
+// which nothing edits. False if the file cannot be mapped.
+bool FileManager::loadBinary() {
+  auto b = std::make_unique<Binary>();
+  if (!b->open(filename)) {
+    return false;
+  }
+  binary = std::move(b);
+  content = std::make_shared<std::vector<Line>>(1);
+  loaded = true;
+  revision ++;
+  columns.reset(content->size());
+  structure.clear();
+  offset = topOffset = 0;
+  syncStamp();
+  return true;
+}
+bool FileManager::isBinary() const {
+  return binary != nullptr;
+}
+// A binary file changed on disk is mapped again; its patch goes
+void FileManager::reopen() {
+  binary->open(filename);
+  moveOffset(offset);
+  saved = true;
+  deleted = false;
+  revision ++;
+  syncStamp();
+}
+// The lines as they are now; an edit after this copies them first
+std::shared_ptr<const std::vector<Line>> FileManager::snapshot() {
+  settle();
+  return content;
+}
+// Puts the line in the rope back in content, whole. Only typing works on
+// the rope: Core settles the buffer before any other key, and whatever
+// else reads the lines (saving, reloading, a snapshot) settles it first.
+// The rope is kept with the line it was settled into, so typing into the
+// same line again reopens it without a copy, and settling a rope that
+// was not typed into copies nothing.
+void FileManager::settle() {
+  if (ropeLine < 0) {
+    return;
+  }
+  int line = ropeLine;
+  ropeLine = -1;
+  if (!ropeEdited) {
+    return;
+  }
+  ropeEdited = false;
+  detach();
+  changed(line, 1, 1);
+  (*content)[line] = Line(rope.str());
+  ropeSource = (*content)[line];
 }
 [[nodiscard]]
 bool FileManager::isSaved() const {
+  return saved && !deleted;
+}
+// Not edited since it was read or written, whether or not the file is there
+bool FileManager::unchanged() const {
   return saved;
 }
+bool FileManager::changedOnDisk() const {
+  return stamp_of(filename) != stamp;
+}
+bool FileManager::readable() const {
+  return access(filename.c_str(), R_OK) == 0;
+}
+// Nothing is read: the buffer keeps its lines and counts as not saved,
+// so :q asks first and :w writes the file again. If the file comes
+// back, an unchanged buffer reads it like any other change.
+void FileManager::markDeleted() {
+  deleted = true;
+  syncStamp();
+}
+void FileManager::syncStamp() {
+  stamp = stamp_of(filename);
+}
+void FileManager::reload(const std::vector<Line> &fresh, const fileFormat &f) {
+  settle();
+  format = f;
+  int oldSize = (int)content->size(), newSize = (int)fresh.size();
+  int prefix = 0, suffix = 0;
+  while (prefix < oldSize && prefix < newSize && (*content)[prefix] == fresh[prefix]) {
+    prefix ++;
+  }
+  while (suffix < oldSize - prefix && suffix < newSize - prefix
+         && (*content)[oldSize - 1 - suffix] == fresh[newSize - 1 - suffix]) {
+    suffix ++;
+  }
+  // Only the changed middle goes through the log, so undo can step back
+  // over an external rewrite like over any other edit.
+  int oldEnd = oldSize - suffix, newEnd = newSize - suffix;
+  int oldX = posX, oldY = posY;
+  if (prefix < oldEnd || prefix < newEnd) {
+    commitRange(prefix, oldEnd - prefix,
+                std::vector<Line>(fresh.begin() + prefix, fresh.begin() + newEnd));
+  }
+  if (posX >= oldEnd) {
+    posX += newEnd - oldEnd;
+  }
+  posX = std::min(posX, (int)content->size() - 1);
+  posY = byteAt(posX, columnOf(posX, std::min(posY, (int)(*content)[posX].size())));
+  if (prefix < oldEnd || prefix < newEnd) {
+    log.push_back(std::make_unique<LogCursor>(LogCursor(oldX, oldY, posX, posY)));
+    where += 1;
+  }
+  saved = true;
+  deleted = false;
+  syncStamp();
+}
+bool FileManager::following() const {
+  return followFd >= 0;
+}
+bool FileManager::follow() {
+  unfollow();
+  if (binary) {
+    return false;
+  }
+  followFd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+  if (followFd < 0) {
+    return false;
+  }
+  struct stat st{};
+  fstat(followFd, &st);
+  followOffset = st.st_size;
+  char last = '\n';
+  if (followOffset > 0) {
+    pread(followFd, &last, 1, followOffset - 1);
+  }
+  // An empty file is loaded as one empty line, which new bytes extend
+  followPartial = followOffset == 0 || last != '\n';
+  syncStamp();
+  return true;
+}
+void FileManager::unfollow() {
+  if (followFd >= 0) {
+    close(followFd);
+    followFd = -1;
+  }
+}
+bool FileManager::pull() {
+  settle();
+  struct stat st{};
+  fstat(followFd, &st);
+  if (stamp_of(filename).inode != (long long)st.st_ino || st.st_size < followOffset) {
+    return false; // rotated or truncated
+  }
+  detach();
+  bool pinned = posX + 1 == (int)content->size();
+  int from = (int)content->size() - (followPartial ? 1 : 0);
+  int before = (int)content->size();
+  char buf[1 << 16];
+  ssize_t n;
+  while ((n = pread(followFd, buf, sizeof(buf), followOffset)) > 0) {
+    followOffset += n;
+    ssize_t start = 0;
+    for (ssize_t j = start; j <= n; ++j) {
+      if (j < n && buf[j] != '\n')
+        continue;
+      if (j == n && start == n)
+        break;
+      std::string_view piece(buf + start, j - start);
+      std::string joined;
+      if (followPartial) {
+        joined = content->back().str().append(piece);
+        piece = joined;
+      }
+      if (j < n && format.crlf && !piece.empty() && piece.back() == '\r') {
+        piece.remove_suffix(1);
+      }
+      if (followPartial) {
+        content->back() = Line(piece);
+      } else {
+        content->emplace_back(piece);
+      }
+      followPartial = j == n;
+      start = j + 1;
+    }
+  }
+  syncStamp();
+  format.finalNewline = !followPartial;
+  if (from < (int)content->size()) {
+    changed(from, before - from, (int)content->size() - from);
+  }
+  if (from < (int)content->size() && (appendedFrom < 0 || from < appendedFrom)) {
+    appendedFrom = from;
+  }
+  if (pinned) {
+    posX = (int)content->size() - 1;
+    posY = 0;
+  }
+  return true;
+}
+void FileManager::drawAppended() {
+  if (appendedFrom < 0) {
+    return;
+  }
+  if (onDisplay) {
+    display();
+    return;
+  }
+  int from = appendedFrom;
+  appendedFrom = -1;
+  int height = terminalHeight - (prompt.empty() ? 0 : 1);
+  int newLineWidth = numbered ? (int)std::max(4ul, 1 + std::to_string(content->size()).size()) : 0;
+  bool pinned = posX + 1 == (int)content->size();
+  if (from != shownEnd || shownRows < height || newLineWidth != lineWidth) {
+    display();
+    return;
+  }
+  if (!pinned) {
+    return; // the new lines are below the window
+  }
+  std::vector<std::string> output;
+  if (highlighter) {
+    highlighter->request(*content, from, (int)content->size() - 1, 0);
+  }
+  for (int i = from; i < (int)content->size() && (int)output.size() < height; ++i) {
+    splitLine(i, output, -1, -1, highlighter ? highlighter->spans(i) : nullptr);
+  }
+  if ((int)output.size() >= height) {
+    display();
+    return;
+  }
+  // Scroll the text rows (the prompt row stays) and print only the new rows
+  printf("%s%s", ANSI::scrollRegion(1, height).c_str(), ANSI::cursorPosition(height, 1).c_str());
+  for (const auto &row: output) {
+    printf("\n%s%s", ANSI::clearLine().c_str(), row.c_str());
+  }
+  printf("%s", ANSI::resetScrollRegion().c_str());
+  int k = (int)output.size();
+  while (k > 0) {
+    int rest = rowsOf(windowStartX, windowStartRow + k + 1) - windowStartRow;
+    if (k >= rest) {
+      k -= rest;
+      windowStartX ++;
+      windowStartRow = 0;
+    } else {
+      windowStartRow += k;
+      k = 0;
+    }
+  }
+  shownEnd = (int)content->size();
+  auto place = placeOf(posX, posY);
+  printf("%s", ANSI::cursorPosition(height - rowsOf(posX) + place.first + 1,
+                                    place.second + lineWidth + 1).c_str());
+  fflush(stdout);
+}
 void FileManager::setNumber() {
   numbered = true;
 }
 void FileManager::setNoNumber() {
   numbered = false;
 }
+// Without wrapping a line is one row, scrolled sideways to the cursor
+void FileManager::setWrap(bool on) {
+  wrapping = on;
+  windowStartCol = 0;
+  windowStartRow = 0;
+  revision ++;
+}
 
-void FileManager::commitModify(int pos, const std::string &newContent) {
+void FileManager::changed(int pos, int removed, int inserted) {
+  revision ++;
+  columns.edit(pos, removed, inserted);
+  structure.edit(pos, removed, inserted);
+  if (highlighter) {
+    highlighter->edit(pos, removed, inserted);
+  }
+  if (onChange) {
+    onChange(pos, removed, inserted);
+  }
+}
+// Typing goes through here. A long line moves into the rope at its
+// first edit and stays there while it is typed into, so a key costs a
+// chunk of it, not a copy; settle() puts it back. Other lines are made anew.
+void FileManager::splice(int pos, int at, int removed, std::string_view inserted) {
+  if (pos != ropeLine && (*content)[pos].size() >= LONG_LINE) {
+    settle();
+    if (!(*content)[pos].shares(ropeSource)) {
+      rope = Rope((*content)[pos]);
+      ropeSource = (*content)[pos];
+    }
+    ropeLine = pos;
+  }
+  changed(pos, 1, 1);
+  saved = false;
+  if (pos == ropeLine) {
+    rope.splice(at, removed, inserted);
+    ropeEdited = true;
+    return;
+  }
+  settle();
+  detach();
+  std::string text = (*content)[pos].str();
+  text.replace(at, removed, inserted);
+  (*content)[pos] = Line(text);
+}
+void FileManager::commitSplice(int pos, int at, int removed, std::string inserted) {
+  if (where < log.size()) {
+    log.erase(log.begin() + where, log.end());
+  }
+  log.push_back(std::make_unique<LogSplice>(LogSplice(pos, at, textOf(pos, at, removed), inserted)));
+  where += 1;
+  splice(pos, at, removed, inserted);
+}
+void FileManager::commitModify(int pos, Line newContent) {
+  settle();
+  detach();
+  changed(pos, 1, 1);
   saved = false;
   if (where < log.size()) {
     log.erase(log.begin() + where, log.end());
@@ -81,7 +571,10 @@ void FileManager::commitModify(int pos, const std::string &newContent) {
   (*content)[pos] = newContent;
   where += 1;
 }
-void FileManager::commitInsert(int pos, const std::string &newContent) {
+void FileManager::commitInsert(int pos, Line newContent) {
+  settle();
+  detach();
+  changed(pos, 0, 1);
   saved = false;
   if (where < log.size()) {
     log.erase(log.begin() + where, log.end());
@@ -91,17 +584,112 @@ void FileManager::commitInsert(int pos, const std::string &newContent) {
   where += 1;
 }
 void FileManager::commitDelete(int pos) {
+  settle();
+  detach();
+  changed(pos, 1, 0);
   saved = false;
   if (where < log.size()) {
     log.erase(log.begin() + where, log.end());
   }
-  log.push_back(std::make_unique<LogContent>(LogContent(atomType::DELETE, posX, (*content)[pos], "")));
+  log.push_back(std::make_unique<LogContent>(LogContent(atomType::DELETE, pos, (*content)[pos], "")));
   content->erase(content->begin() + pos);
   where += 1;
 }
+std::shared_ptr<const std::vector<Line>> FileManager::commitRange(int pos, int count,
+                                                                  std::vector<Line> newContent) {
+  settle();
+  detach();
+  saved = false;
+  if (where < log.size()) {
+    log.erase(log.begin() + where, log.end());
+  }
+  auto oldContent = std::make_shared<const std::vector<Line>>(
+          std::make_move_iterator(content->begin() + pos),
+          std::make_move_iterator(content->begin() + pos + count));
+  replaceLines(pos, count, newContent);
+  log.push_back(std::make_unique<LogRange>(
+          pos, oldContent, std::make_shared<const std::vector<Line>>(std::move(newContent))));
+  where += 1;
+  return oldContent;
+}
+void FileManager::detach() {
+  if (content.use_count() > 1 && onShared) {
+    onShared(content.get());
+  }
+  if (content.use_count() > 1) {
+    content = std::make_shared<std::vector<Line>>(*content);
+  }
+}
+void FileManager::replaceLines(int pos, int count, const std::vector<Line> &lines) {
+  changed(pos, count, (int)lines.size());
+  int common = std::min(count, (int)lines.size());
+  std::copy(lines.begin(), lines.begin() + common, content->begin() + pos);
+  if (count > common) {
+    content->erase(content->begin() + pos + common, content->begin() + pos + count);
+  } else {
+    content->insert(content->begin() + pos + common, lines.begin() + common, lines.end());
+  }
+}
+std::shared_ptr<const std::vector<Line>> FileManager::commitFilter(std::vector<int> rows) {
+  settle();
+  detach();
+  saved = false;
+  if (where < log.size()) {
+    log.erase(log.begin() + where, log.end());
+  }
+  auto removed = std::make_shared<std::vector<Line>>();
+  removed->reserve(rows.size());
+  removeRows(rows, removed.get());
+  log.push_back(std::make_unique<LogFilter>(std::move(rows), removed));
+  where += 1;
+  return removed;
+}
+// One pass over the lines from the first removed one: the kept lines are
+// moved up, whatever the number of removed ones.
+void FileManager::removeRows(const std::vector<int> &rows, std::vector<Line> *removed) {
+  int n = (int)content->size(), first = rows.front();
+  changed(first, n - first, n - first - (int)rows.size());
+  size_t k = 0;
+  int w = first;
+  for (int r = first; r < n; ++r) {
+    if (k < rows.size() && rows[k] == r) {
+      if (removed) {
+        removed->push_back(std::move((*content)[r]));
+      }
+      k ++;
+    } else {
+      (*content)[w ++] = std::move((*content)[r]);
+    }
+  }
+  content->resize(w);
+}
+void FileManager::restoreRows(const std::vector<int> &rows, const std::vector<Line> &removed) {
+  int n = (int)content->size(), total = n + (int)rows.size(), first = rows.front();
+  changed(first, n - first, total - first);
+  content->resize(total);
+  int r = n - 1;
+  size_t k = rows.size();
+  for (int i = total - 1; k > 0; --i) {
+    if (rows[k - 1] == i) {
+      (*content)[i] = removed[-- k];
+    } else {
+      (*content)[i] = std::move((*content)[r --]);
+    }
+  }
+}
 void FileManager::undo(const std::unique_ptr<Log> &log_) {
+  if (auto typed = dynamic_cast<LogSplice *>(log_.get())) {
+    splice(typed->posX, typed->at, (int)typed->inserted.size(), typed->removed);
+    return;
+  }
+  settle();
+  detach();
   saved = false;
-  if (dynamic_cast<LogContent *>(log_.get()) == nullptr) {
+  if (auto range = dynamic_cast<LogRange *>(log_.get())) {
+    replaceLines(range->posX, (int)range->newContent->size(), *range->oldContent);
+  } else if (auto filter = dynamic_cast<LogFilter *>(log_.get())) {
+    restoreRows(filter->rows, *filter->removed);
+  } else if (dynamic_cast<LogContent *>(log_.get()) == nullptr) {
     auto &log = dynamic_cast<LogCursor &>(*log_);
     posX = log.oldX;
     posY = log.oldY;
@@ -109,20 +697,33 @@ void FileManager::undo(const std::unique_ptr<Log> &log_) {
     auto &log = dynamic_cast<LogContent &>(*log_);
     switch (log.type) {
       case atomType::MODIFY:
+        changed(log.posX, 1, 1);
         (*content)[log.posX] = log.oldContent;
         break;
       case atomType::INSERT:
+        changed(log.posX, 1, 0);
         content->erase(content->begin() + log.posX);
         break;
       case atomType::DELETE:
+        changed(log.posX, 0, 1);
         content->insert(content->begin() + log.posX, log.oldContent);
         break;
     }
   }
 }
 void FileManager::redo(const std::unique_ptr<Log> &log_) {
+  if (auto typed = dynamic_cast<LogSplice *>(log_.get())) {
+    splice(typed->posX, typed->at, (int)typed->removed.size(), typed->inserted);
+    return;
+  }
+  settle();
+  detach();
   saved = false;
-  if (dynamic_cast<LogContent *>(log_.get()) == nullptr) {
+  if (auto range = dynamic_cast<LogRange *>(log_.get())) {
+    replaceLines(range->posX, (int)range->oldContent->size(), *range->newContent);
+  } else if (auto filter = dynamic_cast<LogFilter *>(log_.get())) {
+    removeRows(filter->rows, nullptr);
+  } else if (dynamic_cast<LogContent *>(log_.get()) == nullptr) {
     auto &log = dynamic_cast<LogCursor &>(*log_);
     posX = log.newX;
     posY = log.newY;
@@ -130,48 +731,91 @@ void FileManager::redo(const std::unique_ptr<Log> &log_) {
     auto &log = dynamic_cast<LogContent &>(*log_);
     switch (log.type) {
       case atomType::MODIFY:
+        changed(log.posX, 1, 1);
         (*content)[log.posX] = log.newContent;
         break;
       case atomType::INSERT:
+        changed(log.posX, 0, 1);
         content->insert(content->begin() + log.posX, log.newContent);
         break;
       case atomType::DELETE:
+        changed(log.posX, 1, 0);
         content->erase(content->begin() + log.posX);
         break;
     }
   }
 }
-bool FileManager::undo() {
+bool FileManager::undo(int times) {
+  if (binary) {
+    shrunk();
+    long long at = binary->undo(times);
+    if (at < 0) {
+      return false;
+    }
+    saved = false;
+    revision ++;
+    moveOffset(at);
+    return true;
+  }
   if (where == 0) {
     return false;
   }
-  int oldWhere = where;
-  -- where;
-  while (where > 0 && duration(*log[where - 1], *log[where]) < UNDO_REDO_INTERVAL) {
+  while (times -- > 0 && where > 0) {
+    int oldWhere = where;
     -- where;
-  }
-  for (int i = oldWhere - 1; i >= where; -- i) {
-    undo(log[i]);
+    while (where > 0 && (log[where]->joined || duration(*log[where - 1], *log[where]) < UNDO_REDO_INTERVAL)) {
+      -- where;
+    }
+    for (int i = oldWhere - 1; i >= where; -- i) {
+      undo(log[i]);
+    }
   }
   display();
   return true;
 }
-bool FileManager::redo() {
+bool FileManager::redo(int times) {
+  if (binary) {
+    shrunk();
+    long long at = binary->redo(times);
+    if (at < 0) {
+      return false;
+    }
+    saved = false;
+    revision ++;
+    moveOffset(at);
+    return true;
+  }
   if (where == log.size()) {
     return false;
   }
-  int oldWhere = where;
-  ++ where;
-  while (where < log.size() && duration(*log[where - 1], *log[where]) < UNDO_REDO_INTERVAL) {
+  while (times -- > 0 && where < log.size()) {
+    int oldWhere = where;
     ++ where;
-  }
-  for (int i = oldWhere; i < where; ++ i) {
-    redo(log[i]);
+    while (where < log.size() && (log[where]->joined || duration(*log[where - 1], *log[where]) < UNDO_REDO_INTERVAL)) {
+      ++ where;
+    }
+    for (int i = oldWhere; i < where; ++ i) {
+      redo(log[i]);
+    }
   }
   display();
   return true;
 }
-
+int FileManager::history() const {
+  return where;
+}
+// Makes the records since the history point one undo step
+void FileManager::join(int since) {
+  for (int k = since + 1; k < where; ++k) {
+    log[k]->joined = true;
+  }
+}
+void FileManager::suspend(bool on) {
+  suspended = on;
+}
+bool FileManager::isSuspended() {
+  return suspended;
+}
 
 void FileManager::setPrompt(const std::string &p, bool e) {
   prompt = p;
@@ -179,48 +823,212 @@ void FileManager::setPrompt(const std::string &p, bool e) {
   display();
 }
 void FileManager::updateCommandDisplay() const {
+  if (suspended) return;
   printf("%s", ANSI::cursorPosition(terminalHeight, 2).c_str());
   fflush(stdout);
 }
-void FileManager::display() {
-  std::vector<std::string> output;
-  lineWidth = 0;
-  if (numbered) {
-    lineWidth = (int)std::max(4ul, 1 + std::to_string(content->size()).size());
+// The line in the rope is read from it. It has no columns: a byte is a
+// column, so the cursor is placed without reading the line from its
+// start. Its rows are stride bytes apart, and a row holds the characters
+// that start in it; with a character wider than one byte it is a column
+// narrower than the window, so a wide one cut by its end still fits.
+int FileManager::lengthOf(int line) const {
+  return line == ropeLine ? (int)rope.size() : (int)(*content)[line].size();
+}
+std::string FileManager::textOf(int line, int from, int n) const {
+  return line == ropeLine ? rope.substr(from, n) : (*content)[line].substr(from, n);
+}
+int FileManager::ropeStride() const {
+  return rope.ascii() ? width : std::max(1, width - 1);
+}
+// The first character of the rope starting at byte or after it
+int FileManager::ropeFrom(int byte) const {
+  int start = (int)rope.charStart(byte);
+  return start == byte ? byte : (int)rope.charNext(start);
+}
+// Terminal cells of the bytes [from, to) of the rope
+int FileManager::ropeWidth(int from, int to) const {
+  std::string text = rope.substr(from, to - from);
+  return rope.ascii() || utf8::ascii(text) ? (int)text.size() : Columns(text).width();
+}
+const Columns *FileManager::columnsOf(int line) const {
+  return line == ropeLine ? nullptr : columns.get(line, (*content)[line]);
+}
+int FileManager::widthOf(int line) const {
+  const Columns *cols = columnsOf(line);
+  return cols ? cols->width() : lengthOf(line);
+}
+int FileManager::columnOf(int line, int byte) const {
+  const Columns *cols = columnsOf(line);
+  return cols ? cols->columnOf(byte) : byte;
+}
+int FileManager::byteAt(int line, int column) const {
+  if (line == ropeLine) {
+    return (int)rope.charStart(std::max(column, 0));
   }
-  width = terminalWidth - lineWidth;
-
-  assert (width > 0);
-  size_t cursorX = 0, cursorY = 0;
-  for (size_t i = 0; i < content->size(); ++i) {
+  const Columns *cols = columnsOf(line);
+  return cols ? cols->byteAt(column) : std::min(column, lengthOf(line));
+}
+int FileManager::nextChar(int line, int byte) const {
+  if (line == ropeLine) {
+    return (int)rope.charNext(byte);
+  }
+  const Columns *cols = columnsOf(line);
+  return cols ? cols->next(byte) : std::min(byte + 1, lengthOf(line));
+}
+int FileManager::prevChar(int line, int byte) const {
+  if (line == ropeLine) {
+    return byte > 0 ? (int)rope.charStart(byte - 1) : 0;
+  }
+  const Columns *cols = columnsOf(line);
+  return cols ? cols->prev(byte) : std::max(byte - 1, 0);
+}
+int FileManager::lineEnd(int line) const {
+  if (line == ropeLine) {
+    return rope.size() > 0 ? (int)rope.charStart(rope.size() - 1) : 0;
+  }
+  const Columns *cols = columnsOf(line);
+  return cols ? cols->last() : std::max(lengthOf(line) - 1, 0);
+}
+std::pair<int, int> FileManager::placeOf(int line, int byte) const {
+  if (line == ropeLine) {
+    int stride = ropeStride(), row = wrapping ? byte / stride : 0;
+    int from = ropeFrom(wrapping ? row * stride : windowStartCol);
+    return {row, byte >= from ? ropeWidth(from, byte) : byte - windowStartCol};
+  }
+  if (!wrapping) {
+    return {0, columnOf(line, byte) - windowStartCol};
+  }
+  const Columns *cols = columnsOf(line);
+  return cols ? cols->place(byte, width) : std::make_pair(byte / width, byte % width);
+}
+// Rows of a line, counted only as far as limit: a line that is not
+// ASCII is wrapped no further than that
+int FileManager::rowsOf(int line, int limit) const {
+  if (!wrapping) {
+    return 1;
+  }
+  if (line == ropeLine) {
+    return std::max(1, ((int)rope.size() + ropeStride() - 1) / ropeStride());
+  }
+  if (const Columns *cols = columnsOf(line)) {
+    return cols->rows(width, std::max(limit, 1));
+  }
+  return std::max(1, (lengthOf(line) + width - 1) / width);
+}
+void FileManager::scrollToCursor(int height) {
+  if (!wrapping) {
+    int span = posX == ropeLine ? ropeStride() : width;
+    int col = columnOf(posX, posY), end = std::max(col + 1, columnOf(posX, nextChar(posX, posY)));
+    if (col < windowStartCol) {
+      windowStartCol = col;
+    } else if (end > windowStartCol + span) {
+      windowStartCol = end - span;
+    }
+  }
+  int cursorRow = placeOf(posX, posY).first;
+  windowStartX = std::min(windowStartX, (int)content->size() - 1);
+  windowStartRow = std::min(windowStartRow, rowsOf(windowStartX, windowStartRow + 1) - 1);
+  if (posX < windowStartX || (posX == windowStartX && cursorRow < windowStartRow)) {
+    windowStartX = posX;
+    windowStartRow = cursorRow;
+    return;
+  }
+  // Rows from the top of the window to the cursor, counted only as far as
+  // one screen: the rest of the file is never wrapped.
+  int rows = cursorRow - windowStartRow;
+  for (int i = windowStartX; i < posX && rows < height; ++i) {
+    rows += rowsOf(i, height - rows);
+  }
+  if (rows < height) {
+    return;
+  }
+  // Cursor went below the window: put it on the last row.
+  int need = height - 1;
+  int line = posX, row = cursorRow;
+  while (row < need && line > 0) {
+    need -= row;
+    row = rowsOf(-- line);
+  }
+  windowStartX = line;
+  windowStartRow = std::max(0, row - need);
+}
+// The rows of the window from its first shown row, at most height of
+// them; fit() has placed the window around the cursor.
+std::vector<std::string> FileManager::frame(int height, int &cursorRow) {
+  if (binary) {
+    return binaryFrame(height, cursorRow);
+  }
+  appendedFrom = -1;
+  if (highlighter) {
+    highlighter->request(*content, windowStartX, windowStartX + height - 1, height);
+  }
+  std::vector<std::string> output;
+  cursorRow = 0;
+  int cursorPlace = placeOf(posX, posY).first;
+  int i = windowStartX;
+  bool whole = true;
+  for (; i < (int)content->size() && (int)output.size() < height; ++i) {
+    int first = i == windowStartX ? windowStartRow : 0;
     if (posX == i) {
-      cursorX = output.size() + (posY / width);
-      cursorY = posY % width + lineWidth;
+      cursorRow = (int)output.size() + cursorPlace - first;
     }
-    splitLine((*content)[i], output, (int)i + 1);
+    auto selection = selectionOf(i);
+    whole = splitLine(i, output, selection.first, selection.second,
+                      highlighter ? highlighter->spans(i) : nullptr, diffOf ? diffOf(i) : 0,
+                      first, height - (int)output.size());
   }
-
-  size_t height = terminalHeight;
+  shownEnd = whole ? i : i - 1;
+  return output;
+}
+// A file truncated on disk is mapped again before the map is read, and
+// the cursor pulled back into it
+void FileManager::shrunk() {
+  if (binary->fit()) {
+    offset = std::max(0LL, std::min(offset, binary->size() - 1));
+    topOffset = std::min(topOffset, offset);
+    lowNibble = false;
+    revision ++;
+  }
+}
+// Only the rows of the window are read from the map
+std::vector<std::string> FileManager::binaryFrame(int height, int &cursorRow) const {
+  std::vector<std::string> output;
+  cursorRow = (int)((offset - topOffset) / perRow);
+  for (long long first = topOffset; first < binary->size() && (int)output.size() < height; first += perRow) {
+    output.push_back(binary->row(first, perRow, offset, asciiSide));
+  }
+  return output;
+}
+int FileManager::binaryColumn() const {
+  return binary->column(perRow, (int)(offset % perRow), asciiSide) + (lowNibble ? 1 : 0);
+}
+void FileManager::display() {
+  if (suspended) return;
+  if (onDisplay) {
+    onDisplay();
+    return;
+  }
+  int height = terminalHeight;
   if (!prompt.empty()) {
     height --;
   }
-  if (cursorX >= windowStartX + height) {
-    windowStartX = cursorX - height + 1;
-  } else if (cursorX < windowStartX) {
-    windowStartX = cursorX;
-  }
-  size_t endLine = std::min(windowStartX + height, output.size());
+  fit(height, terminalWidth);
+  int cursorX = 0;
+  auto output = frame(height, cursorX);
+  size_t cursorY = binary ? binaryColumn() : placeOf(posX, posY).second + lineWidth;
   clearTerminal();
   size_t row = 0;
 
-  for (size_t i = windowStartX; i < endLine; ++i) {
-    printf("%s", output[i].c_str());
+  for (const auto &text: output) {
+    printf("%s", text.c_str());
     row ++;
     if (row != terminalHeight) {
       printf("\n");
       fflush(stdout);
     }
   }
+  shownRows = (int)row;
   if (prompt.size() > 0) {
     while (row < terminalHeight - 1) {
       printf("\n");
@@ -229,34 +1037,136 @@ void FileManager::display() {
     printf("%s", prompt.c_str());
     fflush(stdout);
   }
-  printf("%s", ANSI::cursorPosition(cursorX - windowStartX + 1, cursorY + 1).c_str());
+  printf("%s", ANSI::cursorPosition(cursorX + 1, cursorY + 1).c_str());
   fflush(stdout);
 }
+view FileManager::current() const {
+  return {posX, posY, windowStartX, windowStartRow, visualKind, visualX, visualY, offset, topOffset, windowStartCol};
+}
+// Takes the view of another window; lines may have gone since it was left
+void FileManager::show(const view &v) {
+  int last = (int)content->size() - 1;
+  posX = std::min(v.posX, last);
+  posY = byteAt(posX, columnOf(posX, std::min(v.posY, lengthOf(posX))));
+  windowStartX = std::min(v.windowStartX, last);
+  windowStartRow = v.windowStartRow;
+  windowStartCol = v.windowStartCol;
+  visualKind = v.visualKind;
+  visualX = std::min(v.visualX, last);
+  visualY = std::min(v.visualY, lengthOf(visualX));
+  if (binary) {
+    offset = std::max(0LL, std::min(v.offset, binary->size() - 1));
+    topOffset = v.topOffset;
+    lowNibble = false;
+  }
+}
+// Sizes the gutter and the text for a window cols wide, then scrolls it
+// so that the cursor is on one of its height rows.
+void FileManager::fit(int height, int cols) {
+  if (binary) {
+    shrunk();
+    perRow = binary->perRow(cols);
+    long long row = offset - offset % perRow;
+    topOffset -= topOffset % perRow;
+    if (row < topOffset) {
+      topOffset = row;
+    } else if (row >= topOffset + (long long)height * perRow) {
+      topOffset = row - (long long)(std::max(height, 1) - 1) * perRow;
+    }
+    return;
+  }
+  lineWidth = 0;
+  if (numbered) {
+    lineWidth = (int)std::max(4ul, 1 + std::to_string(content->size()).size());
+  }
+  width = std::max(1, cols - lineWidth);
+  scrollToCursor(height);
+}
+// Draws the window into a rectangle of the terminal; nothing else on
+// the screen is touched.
+// Draws the rows of a window that differ from the ones in shown
+void FileManager::render(int top, int left, int height, int cols, std::vector<std::string> &shown) {
+  int cursorRow = 0;
+  auto output = frame(height, cursorRow);
+  shownRows = (int)output.size();
+  output.resize(std::max(shownRows, height));
+  shown.resize(height, std::string(1, '\0'));
+  std::string out;
+  for (int r = 0; r < height; ++r) {
+    if (output[r] == shown[r]) {
+      continue;
+    }
+    out += ANSI::cursorPosition(top + r + 1, left + 1) + ANSI::eraseChars(cols) + output[r];
+    shown[r] = std::move(output[r]);
+  }
+  printf("%s", out.c_str());
+}
+// Row and column of the cursor in the window, gutter included
+std::pair<int, int> FileManager::cursorCell() const {
+  if (binary) {
+    return {(int)((offset - topOffset) / perRow), binaryColumn()};
+  }
+  auto place = placeOf(posX, posY);
+  int row = place.first - windowStartRow;
+  for (int i = windowStartX; i < posX; ++i) {
+    row += rowsOf(i);
+  }
+  return {row, place.second + lineWidth};
+}
+// What a window of this buffer shows, but for where its cursor is
+std::string FileManager::signature() const {
+  if (binary) {
+    // The byte under the cursor is marked in the other column too
+    return std::to_string(revision) + ' ' + std::to_string(topOffset) + ' ' + std::to_string(perRow) + ' '
+           + std::to_string(offset) + ' ' + std::to_string(asciiSide);
+  }
+  std::string s = std::to_string(revision) + ' ' + std::to_string(windowStartX) + ' '
+                  + std::to_string(windowStartRow) + ' ' + std::to_string(windowStartCol) + ' '
+                  + std::to_string(lineWidth) + ' '
+                  + std::to_string(width);
+  if (visualKind) {
+    s += ' ' + std::to_string(visualKind) + ' ' + std::to_string(visualX) + ' ' + std::to_string(visualY)
+         + ' ' + std::to_string(posX) + ' ' + std::to_string(posY);
+  }
+  return s;
+}
+const std::string &FileManager::promptText() const {
+  return prompt;
+}
 void FileManager::moveCursor(direction d) {
+  endTyping();
+  if (binary) {
+    long long step = d == direction::UP ? -perRow : d == direction::DOWN ? perRow
+                     : d == direction::LEFT ? -1 : 1;
+    if (offset + step >= 0 && offset + step < binary->size()) {
+      moveOffset(offset + step);
+    }
+    return;
+  }
   switch (d) {
     case direction::UP:
       if (posX > 0) {
+        posY = byteAt(posX - 1, columnOf(posX, posY));
         posX--;
-        posY = std::min((int)(*content)[posX].size(), posY);
         display();
       }
       break;
     case direction::DOWN:
       if (posX + 1 < content->size()) {
+        posY = byteAt(posX + 1, columnOf(posX, posY));
         posX++;
-        posY = std::min((int)(*content)[posX].size(), posY);
         display();
       }
       break;
     case direction::LEFT:
       if (posY > 0) {
-        posY--;
+        posY = prevChar(posX, posY);
         display();
       }
       break;
     case direction::RIGHT:
-      if (posY < (int)(*content)[posX].size()) {
-        posY++;
+      if (posY < lengthOf(posX)) {
+        posY = nextChar(posX, posY);
         display();
       }
       break;
@@ -267,11 +1177,9 @@ void FileManager::toLastChar() {
   if (posX || posY) {
     if (posY == 0) {
       posX --;
-      posY = (*content)[posX].size();
-      if (posY)
-        -- posY;
+      posY = lineEnd(posX);
     } else {
-      posY --;
+      posY = prevChar(posX, posY);
     }
     display();
   }
@@ -293,9 +1201,7 @@ void FileManager::toLineFront() {
   display();
 }
 void FileManager::toLineEnd() {
-  posY = (*content)[posX].size();
-  if (posY)
-    posY --;
+  posY = lineEnd(posX);
   display();
 }
 void FileManager::toLastLine() {
@@ -318,6 +1224,8 @@ bool FileManager::jumpTo(int line) {
   return false;
 }
 void FileManager::enter() {
+  endTyping();
+  settle();
   std::string head = (*content)[posX].substr(0, posY);
   std::string remaining = (*content)[posX].substr(posY);
   commitModify(posX, head);
@@ -325,13 +1233,15 @@ void FileManager::enter() {
   toNextLine(true);
 }
 void FileManager::backspace() {
+  endTyping();
   int oldX = posX, oldY = posY;
   if (posY > 0) {
-    auto tmp = (*content)[posX];
-    tmp = tmp.erase(posY - 1, 1);
-    commitModify(posX, tmp);
-    posY--;
+    // The whole character before the cursor, with its combining marks
+    int from = prevChar(posX, posY);
+    commitSplice(posX, from, posY - from, "");
+    posY = from;
   } else if (posX > 0) {
+    settle();
     posY = (*content)[posX - 1].size();
     std::string newRow = (*content)[posX - 1] + (*content)[posX];
     commitModify(posX - 1, newRow);
@@ -342,36 +1252,532 @@ void FileManager::backspace() {
   where += 1;
   display();
 }
-void FileManager::deleteLine() {
-  if (content->empty())
+// 0 for a blank, 2 for a letter, digit or _ (or any non-ASCII byte), 1 for
+// other characters; a WORD (big) is any run of non-blanks
+int FileManager::classOf(int line, int byte, bool big) const {
+  unsigned char c = (*content)[line][byte];
+  if (c == ' ' || c == '\t' || c == '\r') {
+    return 0;
+  }
+  return big || std::isalnum(c) || c == '_' || c >= 0x80 ? 2 : 1;
+}
+// w, b and e (W, B and E for WORDs). An empty line is a word for w and b.
+// With an operator, w stops at the end of the line of the last word.
+motion FileManager::wordMotion(char key, int count, bool operating) const {
+  bool big = std::isupper(key);
+  key = (char)std::tolower(key);
+  int x = posX, y = posY, last = (int)content->size() - 1;
+  auto size = [this](int line) {
+    return (int)(*content)[line].size();
+  };
+  // One character on, across line ends; false at the end of the buffer
+  auto ahead = [&]() {
+    if (y < size(x) && nextChar(x, y) < size(x)) {
+      y = nextChar(x, y);
+    } else if (x < last) {
+      x ++;
+      y = 0;
+    } else {
+      return false;
+    }
+    return true;
+  };
+  auto back = [&]() {
+    if (y > 0) {
+      y = prevChar(x, std::min(y, size(x)));
+    } else if (x > 0) {
+      x --;
+      y = size(x);
+    } else {
+      return false;
+    }
+    return true;
+  };
+  for (int k = 0; k < count; ++k) {
+    if (key == 'w') {
+      if (y < size(x)) {
+        int c = classOf(x, y, big);
+        while (c && y < size(x) && classOf(x, y, big) == c) {
+          y = nextChar(x, y);
+        }
+      }
+      int from = x;
+      while (true) {
+        if (y >= size(x)) {
+          if (x == last) break;
+          x ++;
+          y = 0;
+          if (size(x) == 0) break;
+        } else if (classOf(x, y, big) == 0) {
+          y = nextChar(x, y);
+        } else {
+          break;
+        }
+      }
+      if (operating && k == count - 1 && x != from) {
+        x = from;
+        y = size(from);
+      }
+    } else if (key == 'e') {
+      if (!ahead()) break;
+      bool more = true;
+      while (more && (y >= size(x) || classOf(x, y, big) == 0)) {
+        more = ahead();
+      }
+      if (!more) break;
+      int c = classOf(x, y, big);
+      while (nextChar(x, y) < size(x) && classOf(x, nextChar(x, y), big) == c) {
+        y = nextChar(x, y);
+      }
+    } else {
+      if (!back()) break;
+      bool more = true;
+      while (more && size(x) > 0 && (y >= size(x) || classOf(x, y, big) == 0)) {
+        more = back();
+      }
+      if (!more) break;
+      if (size(x) > 0) {
+        int c = classOf(x, y, big);
+        while (y > 0 && classOf(x, prevChar(x, y), big) == c) {
+          y = prevChar(x, y);
+        }
+      }
+    }
+  }
+  if (!operating && y >= size(x)) {
+    y = lineEnd(x);
+  }
+  motion m{x, y, false, key == 'e'};
+  m.failed = x == posX && y == posY; // at an end of the buffer already
+  return m;
+}
+motion FileManager::findMotion(const std::string &key, int count, bool counted, bool operating) const {
+  motion m{posX, posY, false, false};
+  int last = (int)content->size() - 1;
+  // Like vim, h, j, k and l fail only where they cannot move at all; a
+  // count past the edge goes as far as it can
+  if (key == "h") {
+    m.failed = posY == 0;
+    for (int k = 0; k < count && m.y > 0; ++k) {
+      m.y = prevChar(posX, m.y);
+    }
+  } else if (key == "l") {
+    int len = (int)(*content)[posX].size();
+    m.failed = operating ? posY >= len : nextChar(posX, posY) >= len;
+    for (int k = 0; k < count && m.y < len; ++k) {
+      m.y = nextChar(posX, m.y);
+    }
+  } else if (key == "j" || key == "k") {
+    m.failed = key == "j" ? posX == last : posX == 0;
+    m.x = key == "j" ? std::min(last, posX + count) : std::max(0, posX - count);
+    m.y = byteAt(m.x, columnOf(posX, posY));
+    m.linewise = true;
+  } else if (key == "0") {
+    m.y = 0;
+  } else if (key == "$") {
+    m.x = std::min(last, posX + count - 1);
+    m.y = lineEnd(m.x);
+    m.inclusive = true;
+  } else if (key == "G" || key == "gg") {
+    m.failed = counted && count - 1 > last; // no such line
+    m.x = counted ? std::min(last, count - 1) : (key == "G" ? last : 0);
+    m.y = 0;
+    m.linewise = true;
+  } else if (key == "_") { // dd, yy
+    m.x = std::min(last, posX + count - 1);
+    m.linewise = true;
+  } else if (key.size() == 1 && std::strchr("wbeWBE", key[0])) {
+    m = wordMotion(key[0], count, operating);
+  } else if (key == "%") {
+    if (counted) { // to count percent of the file
+      m.x = std::max(0, std::min(last, (int)(((long long)count * (last + 1) + 99) / 100) - 1));
+      m.y = 0;
+      m.linewise = true;
+    } else if (structure.match(*content, posX, posY, m.x, m.y)) {
+      m.inclusive = true;
+    } else {
+      m.failed = true; // no bracket from the cursor on, or no partner
+    }
+  } else if (key == "{" || key == "}") {
+    int step = key == "}" ? 1 : -1;
+    for (int k = 0; k < count; ++k) {
+      int blank = structure.paragraph(*content, m.x, step);
+      if (blank < 0) {
+        m.x = step > 0 ? last : 0;
+        m.y = step > 0 ? (operating ? (int)(*content)[last].size() : lineEnd(last)) : 0;
+        break;
+      }
+      m.x = blank;
+      m.y = 0;
+    }
+    m.failed = m.x == posX && m.y == posY; // at the first or last line already
+  }
+  return m;
+}
+void FileManager::moveTo(const motion &m) {
+  if (m.failed) {
+    return;
+  }
+  posX = m.x;
+  posY = m.y;
+  display();
+}
+void FileManager::operate(char op, const motion &m, Register &yanked) {
+  if (m.failed) {
     return;
+  }
   int oldX = posX, oldY = posY;
+  if (op == '>' || op == '<') {
+    shiftLines(std::min(posX, m.x), std::max(posX, m.x), 1, op == '>');
+    return;
+  }
+  if (m.linewise) {
+    int from = std::min(posX, m.x), to = std::max(posX, m.x);
+    if (op == 'y') {
+      // A yank goes to the first line, an Ex :y stays
+      posY = byteAt(from, columnOf(posX, posY));
+      posX = from;
+    }
+    operateLines(op, from, to, yanked);
+    return;
+  }
+  int x1 = posX, y1 = posY, x2 = m.x, y2 = m.y;
+  if (std::make_pair(x2, y2) < std::make_pair(x1, y1)) {
+    std::swap(x1, x2);
+    std::swap(y1, y2);
+  }
+  if (m.inclusive) {
+    y2 = std::max(y2 + 1, nextChar(x2, y2));
+  }
+  const Line &first = (*content)[x1], &last = (*content)[x2];
+  y1 = std::min(y1, (int)first.size());
+  y2 = std::min(y2, (int)last.size());
+  if (x1 == x2 && y1 >= y2) {
+    return;
+  }
+  if (op == 'd') {
+    auto removed = commitRange(x1, x2 - x1 + 1, {first.substr(0, y1) + last.substr(y2)});
+    yanked = Register(removed, 0, x2 - x1 + 1, false, y1, y2);
+  } else {
+    yanked = Register(content, x1, x2 + 1, false, y1, y2);
+  }
+  posX = x1;
+  posY = op == 'd' ? std::min(y1, lineEnd(x1)) : y1; // on a character, as in normal mode
+  if (op == 'd') {
+    log.push_back(std::make_unique<LogCursor>(LogCursor(oldX, oldY, posX, posY)));
+    where += 1;
+  }
+  display();
+}
+void FileManager::operateLines(char op, int from, int to, Register &yanked) {
+  int oldX = posX, oldY = posY;
+  if (op == '>' || op == '<') {
+    shiftLines(from, to, 1, op == '>');
+    return;
+  }
+  if (op == 'd') {
+    std::vector<Line> rest;
+    if (to - from + 1 == (int)content->size()) {
+      rest.emplace_back("");
+    }
+    yanked = Register(commitRange(from, to - from + 1, std::move(rest)), 0, to - from + 1, true);
+    posX = std::min(from, (int)content->size() - 1);
+    posY = 0;
+    log.push_back(std::make_unique<LogCursor>(LogCursor(oldX, oldY, posX, posY)));
+    where += 1;
+  } else {
+    yanked = Register(content, from, to + 1, true);
+  }
+  display();
+}
+std::vector<int> FileManager::matching(const std::string &pattern, bool invert, int from, int to) const {
+  std::vector<int> rows;
+  for (int i = from; i <= to; ++i) {
+    if (((*content)[i].find(pattern) != std::string::npos) != invert) {
+      rows.push_back(i);
+    }
+  }
+  return rows;
+}
+void FileManager::deleteRows(std::vector<int> rows, Register &yanked) {
+  if (rows.empty()) {
+    return;
+  }
+  int oldX = posX, oldY = posY;
+  int n = (int)rows.size(), after = rows.back() + 1 - n;
+  if (n == (int)content->size()) {
+    yanked = Register(commitRange(0, n, {""}), 0, n, true);
+  } else {
+    yanked = Register(commitFilter(std::move(rows)), 0, n, true);
+  }
+  // On the line after the last removed one, as in Vim
+  posX = std::min(after, (int)content->size() - 1);
   posY = 0;
-  commitDelete(posX);
-  if (posX + 1 >= content->size() && posX) {
-    posX --;
+  log.push_back(std::make_unique<LogCursor>(LogCursor(oldX, oldY, posX, posY)));
+  where += 1;
+  display();
+}
+void FileManager::shiftLines(int from, int to, int levels, bool right) {
+  int oldX = posX, oldY = posY;
+  size_t indent = (size_t)levels * TAB_SIZE;
+  std::vector<Line> lines;
+  lines.reserve(to - from + 1);
+  for (int i = from; i <= to; ++i) {
+    const Line &line = (*content)[i];
+    if (right) {
+      lines.push_back(line.empty() ? line : Line(std::string(indent, ' ') + line));
+    } else {
+      lines.push_back(line.substr(std::min(indent, std::min(line.find_first_not_of(' '), line.size()))));
+    }
   }
+  commitRange(from, to - from + 1, std::move(lines));
+  posX = from;
+  posY = (int)std::min((*content)[posX].find_first_not_of(' '), (*content)[posX].size());
   log.push_back(std::make_unique<LogCursor>(LogCursor(oldX, oldY, posX, posY)));
   where += 1;
   display();
 }
-void FileManager::copyLine() {
-  if (content->empty()) return;
-  board = (*content)[posX];
+// Lines [from, to] become lines, as one undo step; the cursor goes to the first
+void FileManager::replaceRange(int from, int to, std::vector<Line> lines) {
+  int oldX = posX, oldY = posY;
+  if (lines.empty() && to - from + 1 == (int)content->size()) {
+    lines.emplace_back();
+  }
+  commitRange(from, to - from + 1, std::move(lines));
+  posX = std::min(from, (int)content->size() - 1);
+  posY = 0;
+  log.push_back(std::make_unique<LogCursor>(LogCursor(oldX, oldY, posX, posY)));
+  where += 1;
+  display();
 }
-void FileManager::pasteLine() {
-  if (board.empty()) return;
-  commitInsert(posX + 1, board);
-  toNextLine(true);
+// :sort copies the handles of the lines, not their text. Returns the
+// number of lines left.
+int FileManager::sortLines(int from, int to, bool numeric, bool unique, bool reverse) {
+  std::vector<Line> lines(content->begin() + from, content->begin() + to + 1);
+  filter::sort(lines, numeric, unique, reverse);
+  int left = (int)lines.size();
+  replaceRange(from, to, std::move(lines));
+  return left;
+}
+// :{range}!cmd. Returns the number of lines cmd printed, -1 if it did not run.
+int FileManager::filterLines(int from, int to, const std::string &cmd, int &status) {
+  std::vector<Line> lines;
+  status = filter::run(cmd, content->data() + from, content->data() + to + 1, lines);
+  if (status < 0 || (status > 0 && lines.empty())) {
+    return -1; // a failed command that printed nothing leaves the lines
+  }
+  int printed = (int)lines.size();
+  replaceRange(from, to, std::move(lines));
+  return printed;
+}
+char FileManager::visual() const {
+  return visualKind;
+}
+void FileManager::startVisual(char kind) {
+  if (!visualKind) {
+    visualX = posX;
+    visualY = posY;
+  }
+  visualKind = kind;
+  display();
+}
+void FileManager::stopVisual() {
+  if (!visualKind) return;
+  markStartX = std::min(visualX, posX);
+  markEndX = std::max(visualX, posX);
+  visualKind = 0;
+  display();
+}
+void FileManager::swapVisual() {
+  std::swap(visualX, posX);
+  std::swap(visualY, posY);
+  display();
+}
+void FileManager::operateVisual(char op, int count, Register &yanked) {
+  int x1 = visualX, y1 = visualY, x2 = posX, y2 = posY;
+  if (std::make_pair(x2, y2) < std::make_pair(x1, y1)) {
+    std::swap(x1, x2);
+    std::swap(y1, y2);
+  }
+  char kind = visualKind;
+  markStartX = x1;
+  markEndX = x2;
+  visualKind = 0;
+  if (op == '>' || op == '<') {
+    shiftLines(x1, x2, count, op == '>');
+  } else if (kind == 'v' || kind == 'V') {
+    posX = x1;
+    posY = y1;
+    operate(op, motion{x2, y2, kind == 'V', true}, yanked);
+  } else {
+    // Block: the same display columns of every line, as one range edit
+    int oldX = posX, oldY = posY;
+    auto block = blockColumns();
+    std::vector<Line> pieces, lines;
+    for (int i = x1; i <= x2; ++i) {
+      const Line &line = (*content)[i];
+      auto range = bytesOf(i, block.first, block.second);
+      size_t a = range.first, b = range.second;
+      pieces.push_back(line.substr(a, b - a));
+      if (op == 'd') {
+        lines.push_back(line.substr(0, a) + line.substr(b));
+      }
+    }
+    int n = (int)pieces.size();
+    yanked = Register(std::make_shared<const std::vector<Line>>(std::move(pieces)), 0, n, false);
+    yanked.blockwise = true;
+    if (op == 'd') {
+      commitRange(x1, n, std::move(lines));
+    }
+    posX = x1;
+    posY = byteAt(x1, block.first);
+    if (op == 'd') {
+      log.push_back(std::make_unique<LogCursor>(LogCursor(oldX, oldY, posX, posY)));
+      where += 1;
+    }
+    display();
+  }
+}
+int FileManager::cursorLine() const {
+  return posX;
+}
+int FileManager::lineCount() const {
+  return (int)content->size();
+}
+std::pair<int, int> FileManager::marks() const {
+  int last = (int)content->size() - 1;
+  return {std::min(markStartX, last), std::min(markEndX, last)};
+}
+void FileManager::paste(const Register &reg, int count) {
+  if (reg.empty()) return;
+  int oldX = posX, oldY = posY;
+  std::vector<Line> lines;
+  if (reg.blockwise) {
+    // Each piece goes after the cursor column of successive lines
+    int col = (*content)[posX].empty() ? 0 : columnOf(posX, nextChar(posX, posY));
+    int existing = std::min(reg.size(), (int)content->size() - posX);
+    int first = 0;
+    for (int i = 0; i < reg.size(); ++i) {
+      std::string line = i < existing ? (*content)[posX + i].str() : "";
+      int have = i < existing ? widthOf(posX + i) : 0;
+      int at;
+      if (have < col) {
+        line.append(col - have, ' ');
+        at = (int)line.size();
+      } else {
+        at = byteAt(posX + i, col);
+      }
+      if (i == 0) {
+        first = at;
+      }
+      std::string piece = reg.line(i).str(), text;
+      for (int k = 0; k < count; ++k) {
+        text += piece;
+      }
+      lines.push_back(line.insert(at, text));
+    }
+    commitRange(posX, existing, std::move(lines));
+    posY = first;
+  } else if (reg.linewise) {
+    lines.reserve((size_t)reg.size() * count);
+    for (int k = 0; k < count; ++k) {
+      for (int i = 0; i < reg.size(); ++i) {
+        lines.push_back(reg.line(i));
+      }
+    }
+    commitRange(posX + 1, 0, std::move(lines));
+    posX ++;
+    posY = 0;
+  } else {
+    // Characters go after the cursor; copies of a multi-line text are
+    // joined end to start.
+    const Line &line = (*content)[posX];
+    int col = nextChar(posX, posY);
+    std::string last = line.substr(0, col);
+    for (int k = 0; k < count; ++k) {
+      last += reg.line(0);
+      for (int i = 1; i < reg.size(); ++i) {
+        lines.push_back(std::move(last));
+        last = reg.line(i);
+      }
+    }
+    int endX = posX + (int)lines.size(), endY = (int)last.size();
+    lines.push_back(last.append(line.view().substr(col)));
+    commitRange(posX, 1, std::move(lines));
+    posX = endX;
+    posY = prevChar(endX, endY);
+  }
+  log.push_back(std::make_unique<LogCursor>(LogCursor(oldX, oldY, posX, posY)));
+  where += 1;
+  display();
+}
+long long FileManager::cursorOffset() const {
+  return offset;
+}
+int FileManager::rowBytes() const {
+  return perRow;
+}
+// Clamped to the bytes of the file
+void FileManager::moveOffset(long long to) {
+  offset = std::max(0LL, std::min(to, binary->size() - 1));
+  lowNibble = false;
+  display();
+}
+void FileManager::switchColumn() {
+  asciiSide = !asciiSide;
+  lowNibble = false;
   display();
 }
+// Insert mode of a binary buffer: a hex digit sets half of the byte under
+// the cursor, in the ASCII column a key sets all of it. The file keeps its
+// size, so the cursor stops on the last byte.
+bool FileManager::overwrite(char c) {
+  shrunk();
+  if (binary->size() == 0) {
+    return false;
+  }
+  unsigned char byte = binary->at(offset);
+  if (asciiSide) {
+    byte = (unsigned char)c;
+  } else if (std::isxdigit((unsigned char)c)) {
+    int digit = std::isdigit((unsigned char)c) ? c - '0' : std::tolower(c) - 'a' + 10;
+    byte = lowNibble ? (byte & 0xf0) | digit : (byte & 0x0f) | digit << 4;
+  } else {
+    return false;
+  }
+  binary->set(offset, byte);
+  saved = false;
+  revision ++;
+  if (!asciiSide && !lowNibble) {
+    lowNibble = true;
+    display();
+  } else if (offset + 1 < binary->size()) {
+    moveOffset(offset + 1);
+  } else {
+    lowNibble = false;
+    display();
+  }
+  return true;
+}
+// The bytes of a character cut short by another key are dropped
+void FileManager::endTyping() {
+  typing.clear();
+}
 void FileManager::insertChar(char c) {
-  std::string tmp = (*content)[posX];
-  tmp.insert(posY, 1, c);
-  commitModify(posX, tmp);
-  log.push_back(std::make_unique<LogCursor>(LogCursor(posX, posY, posX, posY + 1)));
+  // Keys arrive byte by byte: a multibyte character is inserted whole
+  if (!typing.empty() && ((unsigned char)c & 0xc0) != 0x80) {
+    endTyping();
+  }
+  typing.push_back(c);
+  if (utf8::missing(typing) > 0) {
+    return;
+  }
+  int newY = posY + (int)typing.size();
+  commitSplice(posX, posY, 0, typing);
+  typing.clear();
+  log.push_back(std::make_unique<LogCursor>(LogCursor(posX, posY, posX, newY)));
   where += 1;
-  posY ++;
+  posY = newY;
   display();
 }
 std::string FileManager::replace_str(const std::string &s, const std::string &pattern, const std::string &replacement, int &occurs, int row) {
@@ -403,49 +1809,81 @@ std::string FileManager::replace_str(const std::string &s, const std::string &pa
   }
   return result;
 }
-std::pair<int, int> FileManager::replace(const std::string &pattern, const std::string &replacement, bool inFile) {
-  saved = false;
+std::pair<int, int> FileManager::replace(const std::string &pattern, const std::string &replacement, int from, int to,
+                                         const std::vector<int> *only) {
   int cntLine = 0, cnt = 0;
-  if (inFile) {
-    int pos = 0;
-    for (auto &line: (*content)) {
-      int occurs = 0;
-      auto res = replace_str(line, pattern, replacement, occurs, pos);
-      if (occurs > 0) {
-        cnt += occurs;
-        cntLine ++;
-        commitModify(pos, res);
-      }
-      pos ++;
+  std::vector<std::pair<int, std::string>> rows;
+  int total = only ? (int)only->size() : to - from + 1;
+  for (int k = 0; k < total; ++k) {
+    int row = only ? (*only)[k] : from + k;
+    int occurs = 0;
+    auto res = replace_str((*content)[row].str(), pattern, replacement, occurs, row);
+    if (occurs > 0) {
+      cnt += occurs;
+      cntLine ++;
+      rows.emplace_back(row, std::move(res));
     }
-  } else {
-    std::string res = replace_str((*content)[posX], pattern, replacement, cnt, posX);
-    cntLine = 1;
-    if (cnt > 0) {
-      commitModify(posX, res);
+  }
+  if (!rows.empty()) {
+    // One record spanning the first to the last changed line
+    int first = rows.front().first, last = rows.back().first;
+    std::vector<Line> lines(content->begin() + first, content->begin() + last + 1);
+    for (auto &entry: rows) {
+      lines[entry.first - first] = std::move(entry.second);
     }
+    commitRange(first, last - first + 1, std::move(lines));
   }
   return {cntLine, cnt};
 }
 std::string FileManager::fileInfo() {
-  size_t bytes = 0;
-  for (const std::string &line: (*content)) {
-    if (bytes) ++ bytes;
-    bytes += line.size();
+  if (binary) {
+    size_t patched = binary->pending();
+    return " [" + std::to_string(binary->size()) + " bytes] [binary]"
+           + (patched ? " [" + std::to_string(patched) + " bytes patched]" : "");
   }
   return " [" + std::to_string(content->size()) + " lines]"
-         + " [" + std::to_string(bytes) + " bytes]";
+         + " [" + std::to_string(format::size(*content, format)) + " bytes]" + format::describe(format)
+         + (deleted ? " [deleted]" : "");
+}
+// Makes every line anew, so that equal lines share a block of the pool.
+// The undo records keep the blocks they had.
+void FileManager::intern() {
+  if (!loaded) {
+    return;
+  }
+  settle();
+  detach();
+  for (auto &line: *content) {
+    line = Line(line.view());
+  }
+}
+memoryUsage FileManager::memory(MemoryCount &count) const {
+  memoryUsage use;
+  use.text = count.shared(content.get()) + rope.bytes();
+  use.history = log.capacity() * sizeof(log[0]);
+  for (const auto &record: log) {
+    use.history += record->bytes(count);
+  }
+  use.records = log.size();
+  if (binary) {
+    use.text = binary->bytes();
+  }
+  use.caches = columns.bytes() + structure.bytes() + (highlighter ? highlighter->bytes() : 0)
+               + MemoryCount::heap(prompt) + MemoryCount::heap(typing);
+  return use;
 }
 void FileManager::save(bool print) {
-  std::ofstream out(filename);
-  if (!out) {
+  settle();
+  if (binary) {
+    shrunk();
+  }
+  if (binary ? !binary->save(filename) : !format::write(filename, *content, format)) {
     std::cerr << "Cannot write files." << std::endl;
     return ;
   }
-  for (const auto &line : (*content)) {
-    out << line << std::endl;
-  }
   saved = true;
+  deleted = false;
+  syncStamp();
   if (print)
     setPrompt(ANSI::purple("[Saved " + filename + "]"), true);
 }
@@ -457,6 +1895,17 @@ void FileManager::clearPrompt() {
 void FileManager::openPrompt() {
   setPrompt(ANSI::purple("[Opened " + filename + "]"), true);
 }
+// The colors of the lines changed without an edit here: the next frame draws them again
+void FileManager::recolor() {
+  revision ++;
+}
+bool FileManager::collectHighlight() {
+  if (highlighter && highlighter->collect()) {
+    revision ++;
+    return true;
+  }
+  return false;
+}
 void FileManager::filePrompt() {
   setPrompt(ANSI::purple(filename + fileInfo() + (saved ? " [Saved]" : " [Not Saved]")), true);
 }
\ No newline at end of file
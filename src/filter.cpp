@@ -0,0 +1,249 @@
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <csignal>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#include "filter.h"
+
+namespace {
+  constexpr size_t PARALLEL = 1 << 16; // fewer lines are sorted on one thread
+  constexpr size_t CHUNK = 1 << 16;
+  constexpr int BATCH = 512;           // iovecs of one writev
+
+  // Sorts runs of v on several threads at once, then merges them pairwise,
+  // the merges of a round in parallel too. Both steps are stable.
+  template<typename T, typename Less>
+  void parallelSort(std::vector<T> &v, Less less) {
+    size_t n = v.size();
+    unsigned threads = std::max(1u, std::min(8u, std::thread::hardware_concurrency()));
+    if (n < PARALLEL || threads == 1) {
+      std::stable_sort(v.begin(), v.end(), less);
+      return;
+    }
+    auto each = [](size_t count, const auto &job) {
+      std::vector<std::thread> pool;
+      for (size_t k = 0; k < count; ++k) {
+        pool.emplace_back(job, k);
+      }
+      for (auto &t: pool) {
+        t.join();
+      }
+    };
+    std::vector<size_t> bounds;
+    for (unsigned k = 0; k <= threads; ++k) {
+      bounds.push_back(n * k / threads);
+    }
+    each(threads, [&](size_t k) {
+      std::stable_sort(v.begin() + bounds[k], v.begin() + bounds[k + 1], less);
+    });
+    while (bounds.size() > 2) {
+      each((bounds.size() - 1) / 2, [&](size_t k) {
+        std::inplace_merge(v.begin() + bounds[2 * k], v.begin() + bounds[2 * k + 1],
+                           v.begin() + bounds[2 * k + 2], less);
+      });
+      std::vector<size_t> merged;
+      for (size_t k = 0; k < bounds.size(); k += 2) {
+        merged.push_back(bounds[k]);
+      }
+      if (merged.back() != bounds.back()) {
+        merged.push_back(bounds.back());
+      }
+      bounds.swap(merged);
+    }
+  }
+
+  // The first decimal number of a line, negative after a '-'
+  bool numberOf(std::string_view s, long long &value) {
+    size_t i = s.find_first_of("0123456789");
+    if (i == std::string_view::npos) {
+      return false;
+    }
+    bool negative = i > 0 && s[i - 1] == '-';
+    long long v = 0;
+    for (; i < s.size() && s[i] >= '0' && s[i] <= '9'; ++i) {
+      v = v > (LLONG_MAX - 9) / 10 ? LLONG_MAX : v * 10 + (s[i] - '0');
+    }
+    value = negative ? -v : v;
+    return true;
+  }
+
+  struct keyed {
+    bool number;  // lines without one go first
+    long long value;
+    Line line;
+  };
+
+  // Adds the complete lines of a chunk to out, keeping the last partial one
+  void split(const char *p, const char *end, std::string &partial, std::vector<Line> &out) {
+    while (p < end) {
+      auto nl = (const char *)memchr(p, '\n', end - p);
+      if (!nl) {
+        partial.append(p, end - p);
+        return;
+      }
+      if (partial.empty()) {
+        out.emplace_back(std::string_view(p, nl - p));
+      } else {
+        partial.append(p, nl - p);
+        out.emplace_back(partial);
+        partial.clear();
+      }
+      p = nl + 1;
+    }
+  }
+}
+
+namespace filter {
+  // Only the handles of the lines move, never their text
+  void sort(std::vector<Line> &lines, bool numeric, bool unique, bool reverse) {
+    if (numeric) {
+      std::vector<keyed> keys(lines.size());
+      for (size_t i = 0; i < lines.size(); ++i) {
+        keys[i].number = numberOf(lines[i], keys[i].value);
+        keys[i].line = std::move(lines[i]);
+      }
+      auto less = [](const keyed &a, const keyed &b) {
+        return a.number != b.number ? !a.number : a.number && a.value < b.value;
+      };
+      if (reverse) {
+        parallelSort(keys, [&](const keyed &a, const keyed &b) { return less(b, a); });
+      } else {
+        parallelSort(keys, less);
+      }
+      if (unique) {
+        // Lines with the same number are the same, as are lines without one
+        keys.erase(std::unique(keys.begin(), keys.end(), [](const keyed &a, const keyed &b) {
+          return a.number == b.number && (!a.number || a.value == b.value);
+        }), keys.end());
+      }
+      lines.resize(keys.size());
+      for (size_t i = 0; i < lines.size(); ++i) {
+        lines[i] = std::move(keys[i].line);
+      }
+      return;
+    }
+    if (reverse) {
+      parallelSort(lines, [](const Line &a, const Line &b) { return b.view() < a.view(); });
+    } else {
+      parallelSort(lines, [](const Line &a, const Line &b) { return a.view() < b.view(); });
+    }
+    if (unique) {
+      lines.erase(std::unique(lines.begin(), lines.end()), lines.end());
+    }
+  }
+
+  // One loop polls both pipes: lines are written straight from their own
+  // bytes with writev as the command takes them, and its output is split
+  // into lines as it comes, so neither side is ever copied whole.
+  int run(const std::string &cmd, const Line *begin, const Line *end, std::vector<Line> &out) {
+    int in[2], from[2];
+    if (pipe2(in, O_CLOEXEC) != 0) {
+      return -1;
+    }
+    if (pipe2(from, O_CLOEXEC) != 0) {
+      close(in[0]);
+      close(in[1]);
+      return -1;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+      dup2(in[0], STDIN_FILENO);
+      dup2(from[1], STDOUT_FILENO);
+      dup2(from[1], STDERR_FILENO);
+      // The command gets none of the editor's files, sockets and watches,
+      // whether or not they were opened close-on-exec
+      if (close_range(3, ~0U, 0) != 0) {
+        for (long fd = 3, max = sysconf(_SC_OPEN_MAX); fd < max; ++fd) {
+          close((int)fd);
+        }
+      }
+      signal(SIGPIPE, SIG_DFL);
+      execl("/bin/sh", "sh", "-c", cmd.c_str(), (char *)nullptr);
+      _exit(127);
+    }
+    close(in[0]);
+    close(from[1]);
+    if (pid < 0) {
+      close(in[1]);
+      close(from[0]);
+      return -1;
+    }
+    fcntl(in[1], F_SETFL, fcntl(in[1], F_GETFL) | O_NONBLOCK);
+    // A command that stops reading (head) must not kill the editor
+    auto handler = signal(SIGPIPE, SIG_IGN);
+    static const char newline = '\n';
+    const Line *next = begin;
+    size_t offset = 0; // bytes of *next written, its '\n' counted last
+    int writing = in[1];
+    std::string partial;
+    std::vector<char> buf(CHUNK);
+    while (true) {
+      if (writing >= 0 && next == end) {
+        close(writing); // the command sees the end of its input
+        writing = -1;
+      }
+      struct pollfd p[2] = {{from[0], POLLIN, 0}, {writing, POLLOUT, 0}};
+      if (poll(p, 2, -1) < 0) {
+        if (errno == EINTR) continue;
+        break;
+      }
+      if (p[1].revents & (POLLOUT | POLLERR | POLLHUP)) {
+        struct iovec iov[BATCH];
+        int k = 0;
+        for (const Line *l = next; l != end && k + 2 <= BATCH; ++l) {
+          size_t skip = l == next ? offset : 0;
+          if (skip < l->size()) {
+            iov[k++] = {(void *)(l->data() + skip), l->size() - skip};
+          }
+          iov[k++] = {(void *)&newline, 1};
+        }
+        ssize_t n = writev(writing, iov, k);
+        if (n < 0 && errno != EAGAIN && errno != EINTR) {
+          close(writing);
+          writing = -1;
+          next = end;
+        }
+        for (size_t left = n > 0 ? n : 0; left > 0; ) {
+          size_t rest = next->size() + 1 - offset;
+          if (left < rest) {
+            offset += left;
+            break;
+          }
+          left -= rest;
+          offset = 0;
+          ++next;
+        }
+      }
+      if (p[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+        ssize_t n = read(from[0], buf.data(), buf.size());
+        if (n == 0 || (n < 0 && errno != EINTR && errno != EAGAIN)) {
+          break;
+        }
+        if (n > 0) {
+          split(buf.data(), buf.data() + n, partial, out);
+        }
+      }
+    }
+    if (!partial.empty()) {
+      out.emplace_back(partial);
+    }
+    if (writing >= 0) {
+      close(writing);
+    }
+    close(from[0]);
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+    signal(SIGPIPE, handler);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+  }
+}
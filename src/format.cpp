@@ -0,0 +1,116 @@
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "format.h"
+
+namespace {
+  const char BOM[] = "\xEF\xBB\xBF";
+  constexpr size_t CHUNK = 1 << 20;
+}
+
+namespace format {
+  // The file is read in chunks and split with memchr, which libc scans
+  // 16 or 32 bytes at a time. What ends each line is looked at only at
+  // its '\n', so an LF file costs one compare per line more than before.
+  // The '\r' of a dos file is dropped before its line is made, and put
+  // back on the earlier lines should a line without one turn up.
+  fileFormat read(const std::string &file, std::vector<Line> &content) {
+    fileFormat f;
+    int fd = open(file.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return f;
+    }
+    std::vector<char> buf(CHUNK);
+    std::string partial;  // the line cut by the end of a chunk
+    size_t lines = 0;
+    bool dos = true;  // every line so far ended in "\r\n"
+    bool first = true;
+    char last = 0;
+    ssize_t n;
+    while ((n = ::read(fd, buf.data(), buf.size())) > 0) {
+      const char *p = buf.data(), *end = p + n;
+      if (first && n >= 3 && memcmp(p, BOM, 3) == 0) {
+        f.bom = true;
+        p += 3;
+      }
+      first = false;
+      last = end[-1];
+      while (p < end) {
+        auto nl = (const char *)memchr(p, '\n', end - p);
+        if (!nl) {
+          partial.append(p, end - p);
+          break;
+        }
+        std::string_view line(p, nl - p);
+        if (!partial.empty()) {
+          partial.append(line);
+          line = partial;
+        }
+        bool cr = !line.empty() && line.back() == '\r';
+        if (dos && !cr && lines > 0) {
+          // Mixed endings stay in the lines, so they are written back as they were
+          for (size_t i = 0; i < lines; ++i) {
+            content[i] = content[i] + "\r";
+          }
+        }
+        dos = dos && cr;
+        if (dos) {
+          line.remove_suffix(1);
+        }
+        content.emplace_back(line);
+        partial.clear();
+        lines ++;
+        p = nl + 1;
+      }
+    }
+    close(fd);
+    f.finalNewline = last == '\n';
+    if (!partial.empty()) {
+      content.push_back(std::move(partial));
+    }
+    f.crlf = dos && lines > 0;
+    return f;
+  }
+
+  bool write(const std::string &file, const std::vector<Line> &content, const fileFormat &f) {
+    FILE *out = fopen(file.c_str(), "wb");
+    if (!out) {
+      return false;
+    }
+    setvbuf(out, nullptr, _IOFBF, CHUNK);
+    const char *eol = f.crlf ? "\r\n" : "\n";
+    size_t eolSize = f.crlf ? 2 : 1;
+    bool ok = !f.bom || fwrite(BOM, 1, 3, out) == 3;
+    for (size_t i = 0; i < content.size() && ok; ++i) {
+      const Line &line = content[i];
+      ok = fwrite(line.data(), 1, line.size(), out) == line.size();
+      if (ok && (i + 1 < content.size() || f.finalNewline)) {
+        ok = fwrite(eol, 1, eolSize, out) == eolSize;
+      }
+    }
+    return fclose(out) == 0 && ok;
+  }
+
+  long long size(const std::vector<Line> &content, const fileFormat &f) {
+    long long bytes = f.bom ? 3 : 0;
+    for (const auto &line: content) {
+      bytes += (long long)line.size() + (f.crlf ? 2 : 1);
+    }
+    if (!f.finalNewline && !content.empty()) {
+      bytes -= f.crlf ? 2 : 1;
+    }
+    return bytes;
+  }
+
+  std::string describe(const fileFormat &f) {
+    std::string s;
+    if (f.crlf) s += " [dos]";
+    if (f.bom) s += " [BOM]";
+    if (!f.finalNewline) s += " [noeol]";
+    return s;
+  }
+}
@@ -0,0 +1,169 @@
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "grep.h"
+#include "format.h"
+#include "binary.h"
+
+namespace {
+  constexpr size_t CHUNK = 1 << 20;
+
+  // Whether the bytes of a file hold pattern. Chunks overlap by the
+  // pattern less a byte, so a match cut by the end of one is found.
+  bool holds(const std::string &file, const std::string &pattern) {
+    int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return false;
+    }
+    std::string buf(CHUNK + pattern.size(), '\0');
+    size_t kept = 0;
+    bool found = false;
+    ssize_t n;
+    while (!found && (n = read(fd, &buf[kept], CHUNK)) > 0) {
+      std::string_view bytes(buf.data(), kept + n);
+      found = bytes.find(pattern) != std::string_view::npos;
+      kept = std::min(bytes.size(), pattern.size() - 1);
+      memmove(&buf[0], bytes.data() + bytes.size() - kept, kept);
+    }
+    close(fd);
+    return found;
+  }
+}
+
+Grep::Grep() {
+  if (pipe(fds) == 0) {
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+  }
+}
+
+Grep::~Grep() {
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    stop = true;
+  }
+  ready.notify_all();
+  for (auto &t: pool) {
+    t.join();
+  }
+  close(fds[0]);
+  close(fds[1]);
+}
+
+void Grep::run() {
+  while (true) {
+    job next;
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      ready.wait(guard, [this] { return stop || !jobs.empty(); });
+      if (stop) {
+        return;
+      }
+      next = std::move(jobs.front());
+      jobs.pop_front();
+    }
+    std::vector<match> out;
+    search(*next.pattern, next.what, out);
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      if (next.generation != generation) {
+        continue; // a newer search replaced this one
+      }
+      left --;
+      size_t room = MAX_MATCHES - matches;
+      if (out.size() > room) {
+        out.resize(room);
+      }
+      matches += out.size();
+      if (matches >= MAX_MATCHES) {
+        left -= (int)jobs.size();
+        jobs.clear();
+      }
+      std::move(out.begin(), out.end(), std::back_inserter(found));
+    }
+    char c = 1;
+    (void)!write(fds[1], &c, 1);
+  }
+}
+
+void Grep::search(const std::string &pattern, const target &what, std::vector<match> &out) {
+  auto check = [&](int line, std::string_view text) {
+    size_t column = text.find(pattern);
+    if (column != std::string::npos) {
+      out.push_back({what.file, line, (int)column, std::string(text.substr(0, MAX_TEXT))});
+    }
+  };
+  if (what.lines) {
+    for (int i = 0; i < (int)what.lines->size(); ++i) {
+      check(i, (*what.lines)[i]);
+    }
+    return;
+  }
+  // A binary file has no lines to show: it is reported once, as grep does
+  if (Binary::detect(what.name)) {
+    if (holds(what.name, pattern)) {
+      out.push_back({what.file, 0, 0, "Binary file matches"});
+    }
+    return;
+  }
+  // Read as the buffer would be, without its BOM and dos line endings
+  std::vector<Line> lines;
+  format::read(what.name, lines);
+  for (int i = 0; i < (int)lines.size(); ++i) {
+    check(i, lines[i]);
+  }
+}
+
+// Starts a search, dropping what is left of the previous one
+void Grep::start(const std::string &pattern, std::vector<target> targets) {
+  if (pool.empty()) {
+    unsigned n = std::max(1u, std::min(8u, std::thread::hardware_concurrency()));
+    for (unsigned k = 0; k < n; ++k) {
+      pool.emplace_back([this] { run(); });
+    }
+  }
+  auto shared = std::make_shared<const std::string>(pattern);
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    generation ++;
+    jobs.clear();
+    found.clear();
+    matches = 0;
+    left = total = (int)targets.size();
+    for (auto &t: targets) {
+      jobs.push_back({generation, shared, std::move(t)});
+    }
+  }
+  ready.notify_all();
+}
+
+int Grep::descriptor() const {
+  return fds[0];
+}
+
+std::vector<Grep::match> Grep::collect() {
+  char buf[256];
+  while (read(fds[0], buf, sizeof(buf)) > 0) {}
+  std::vector<match> ready;
+  std::lock_guard<std::mutex> guard(lock);
+  ready.swap(found);
+  return ready;
+}
+
+bool Grep::running() {
+  std::lock_guard<std::mutex> guard(lock);
+  return left > 0;
+}
+
+int Grep::files() {
+  std::lock_guard<std::mutex> guard(lock);
+  return total - left;
+}
@@ -0,0 +1,430 @@
+#include <map>
+#include <cctype>
+#include <cstdlib>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <functional>
+#include <iterator>
+#include <condition_variable>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "highlight.h"
+
+namespace {
+
+enum : unsigned char {
+  NORMAL = 0,
+  BLOCK_COMMENT = 1,
+};
+
+std::vector<language> makeLanguages() {
+  std::vector<language> table(3);
+
+  language &cpp = table[0];
+  cpp.name = "cpp";
+  cpp.extensions = {"c", "cc", "cpp", "cxx", "h", "hh", "hpp", "hxx", "ipp", "inl"};
+  cpp.lineComment = "//";
+  cpp.blockOpen = "/*";
+  cpp.blockClose = "*/";
+  cpp.quotes = "\"'";
+  cpp.preprocessor = true;
+  for (const char *w: {"alignas", "alignof", "and", "asm", "break", "case", "catch", "class",
+                       "concept", "const", "consteval", "constexpr", "constinit", "const_cast",
+                       "continue", "co_await", "co_return", "co_yield", "decltype", "default",
+                       "delete", "do", "dynamic_cast", "else", "enum", "explicit", "export",
+                       "extern", "final", "for", "friend", "goto", "if", "inline", "mutable",
+                       "namespace", "new", "noexcept", "not", "operator", "or", "override",
+                       "private", "protected", "public", "register", "reinterpret_cast",
+                       "requires", "return", "sizeof", "static", "static_assert", "static_cast",
+                       "struct", "switch", "template", "this", "thread_local", "throw", "try",
+                       "typedef", "typeid", "typename", "union", "using", "virtual", "volatile",
+                       "while"}) {
+    cpp.words[w] = token::Keyword;
+  }
+  for (const char *w: {"auto", "bool", "char", "char8_t", "char16_t", "char32_t", "double",
+                       "float", "int", "long", "short", "signed", "unsigned", "void", "wchar_t",
+                       "size_t", "ssize_t", "int8_t", "int16_t", "int32_t", "int64_t", "uint8_t",
+                       "uint16_t", "uint32_t", "uint64_t", "std"}) {
+    cpp.words[w] = token::Type;
+  }
+  for (const char *w: {"true", "false", "nullptr", "NULL"}) {
+    cpp.words[w] = token::Constant;
+  }
+
+  language &json = table[1];
+  json.name = "json";
+  json.extensions = {"json", "jsonl", "geojson"};
+  json.quotes = "\"";
+  json.keys = true;
+  for (const char *w: {"true", "false", "null"}) {
+    json.words[w] = token::Constant;
+  }
+
+  language &log = table[2];
+  log.name = "log";
+  log.extensions = {"log", "out", "err"};
+  log.quotes = "\"";
+  log.timestamps = true;
+  log.ignoreCase = true;
+  for (const char *w: {"ERROR", "ERR", "FATAL", "CRITICAL", "CRIT", "PANIC", "EXCEPTION", "FAILED"}) {
+    log.words[w] = token::Error;
+  }
+  for (const char *w: {"WARN", "WARNING"}) {
+    log.words[w] = token::Warning;
+  }
+  for (const char *w: {"INFO", "NOTICE"}) {
+    log.words[w] = token::Info;
+  }
+  for (const char *w: {"DEBUG", "TRACE", "VERBOSE"}) {
+    log.words[w] = token::Debug;
+  }
+  return table;
+}
+
+const std::vector<language> &languages() {
+  static const std::vector<language> table = makeLanguages();
+  return table;
+}
+
+bool startsWith(std::string_view line, size_t i, const std::string &prefix) {
+  return !prefix.empty() && line.compare(i, prefix.size(), prefix) == 0;
+}
+bool identStart(char c) {
+  return std::isalpha((unsigned char)c) || c == '_';
+}
+bool identChar(char c) {
+  return std::isalnum((unsigned char)c) || c == '_';
+}
+
+// One thread lexing jobs for all buffers; finished jobs are announced on
+// a pipe, which the main loop polls with the keyboard.
+class Worker {
+  std::thread thread;
+  std::mutex lock;
+  std::condition_variable ready;
+  std::deque<std::function<void()>> jobs;
+  bool stop = false;
+  int fds[2] = {-1, -1};
+
+  void run() {
+    while (true) {
+      std::function<void()> job;
+      {
+        std::unique_lock<std::mutex> guard(lock);
+        ready.wait(guard, [this] { return stop || !jobs.empty(); });
+        if (stop) return;
+        job = std::move(jobs.front());
+        jobs.pop_front();
+      }
+      job();
+      char c = 1;
+      (void)!write(fds[1], &c, 1);
+    }
+  }
+
+public:
+  Worker() {
+    if (pipe(fds) == 0) {
+      fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+      fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+    }
+    thread = std::thread([this] { run(); });
+  }
+  ~Worker() {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      stop = true;
+    }
+    ready.notify_all();
+    thread.join();
+    close(fds[0]);
+    close(fds[1]);
+  }
+  void post(std::function<void()> job) {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      jobs.push_back(std::move(job));
+    }
+    ready.notify_one();
+  }
+  int descriptor() const {
+    return fds[0];
+  }
+  static Worker &instance() {
+    static Worker worker;
+    return worker;
+  }
+};
+
+}
+
+Highlighter::Highlighter(const language *lang, size_t lines) : lang(lang), states(lines, STALE) {}
+
+const language *Highlighter::detect(const std::string &filename) {
+  auto slash = filename.find_last_of('/');
+  std::string base = slash == std::string::npos ? filename : filename.substr(slash + 1);
+  auto dot = base.find_last_of('.');
+  std::string ext = dot == std::string::npos ? "" : base.substr(dot + 1);
+  std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+  for (const auto &lang: languages()) {
+    if (std::find(lang.extensions.begin(), lang.extensions.end(), ext) != lang.extensions.end()) {
+      return &lang;
+    }
+  }
+  // Rotated logs: syslog.1, app.log.2.gz
+  if (base.find(".log") != std::string::npos) {
+    return &languages()[2];
+  }
+  return nullptr;
+}
+
+unsigned char Highlighter::lex(const language &lang, std::string_view line,
+                               unsigned char state, std::vector<span> &spans) {
+  size_t n = line.size(), i = 0;
+  if (state == BLOCK_COMMENT) {
+    size_t close = line.find(lang.blockClose);
+    if (close == std::string::npos) {
+      spans.push_back({0, (int)n, token::Comment});
+      return BLOCK_COMMENT;
+    }
+    i = close + lang.blockClose.size();
+    spans.push_back({0, (int)i, token::Comment});
+  }
+  while (i < n) {
+    char c = line[i];
+    if (startsWith(line, i, lang.blockOpen)) {
+      size_t close = line.find(lang.blockClose, i + lang.blockOpen.size());
+      if (close == std::string::npos) {
+        spans.push_back({(int)i, (int)n, token::Comment});
+        return BLOCK_COMMENT;
+      }
+      size_t end = close + lang.blockClose.size();
+      spans.push_back({(int)i, (int)end, token::Comment});
+      i = end;
+    } else if (startsWith(line, i, lang.lineComment)) {
+      spans.push_back({(int)i, (int)n, token::Comment});
+      break;
+    } else if (lang.preprocessor && c == '#' && line.find_first_not_of(" \t") == i) {
+      spans.push_back({(int)i, (int)n, token::Preprocessor});
+      break;
+    } else if (lang.quotes.find(c) != std::string::npos) {
+      size_t j = i + 1;
+      while (j < n && line[j] != c) {
+        j += line[j] == '\\' ? 2 : 1;
+      }
+      j = std::min(j + 1, n);
+      token kind = token::String;
+      if (lang.keys) {
+        size_t k = line.find_first_not_of(" \t", j);
+        if (k != std::string::npos && line[k] == ':') {
+          kind = token::Key;
+        }
+      }
+      spans.push_back({(int)i, (int)j, kind});
+      i = j;
+    } else if (std::isdigit((unsigned char)c) || (c == '-' && i + 1 < n && std::isdigit((unsigned char)line[i + 1])
+                                                 && (i == 0 || !identChar(line[i - 1])))) {
+      size_t j = i + 1;
+      bool time = false;
+      while (j < n && (identChar(line[j]) || line[j] == '.' || line[j] == '\''
+                       || (lang.timestamps && (line[j] == ':' || line[j] == '-' || line[j] == '+')))) {
+        time |= line[j] == ':' || line[j] == '-';
+        j ++;
+      }
+      if (i > 0 && identChar(line[i - 1])) {
+        i = j; // digits inside a word
+        continue;
+      }
+      spans.push_back({(int)i, (int)j, lang.timestamps && time ? token::Time : token::Number});
+      i = j;
+    } else if (identStart(c)) {
+      size_t j = i + 1;
+      while (j < n && identChar(line[j])) {
+        j ++;
+      }
+      std::string word(line.substr(i, j - i));
+      if (lang.ignoreCase) {
+        std::transform(word.begin(), word.end(), word.begin(), ::toupper);
+      }
+      auto it = lang.words.find(word);
+      if (it != lang.words.end()) {
+        spans.push_back({(int)i, (int)j, it->second});
+      }
+      i = j;
+    } else {
+      i ++;
+    }
+  }
+  return NORMAL;
+}
+
+int Highlighter::colorOf(token kind) {
+  switch (kind) {
+    case token::Keyword: return 34;
+    case token::Type: return 36;
+    case token::String: return 32;
+    case token::Number: return 33;
+    case token::Comment: return 90;
+    case token::Preprocessor: return 35;
+    case token::Key: return 36;
+    case token::Constant: return 33;
+    case token::Error: return 91;
+    case token::Warning: return 93;
+    case token::Info: return 92;
+    case token::Debug: return 90;
+    case token::Time: return 34;
+  }
+  return 39;
+}
+
+int Highlighter::descriptor() {
+  return Worker::instance().descriptor();
+}
+
+void Highlighter::drain() {
+  char buf[256];
+  while (read(descriptor(), buf, sizeof(buf)) > 0) {}
+}
+
+bool Highlighter::dirty(int line) const {
+  return (states[line] & STALE) || !cached.count(line);
+}
+
+void Highlighter::edit(int pos, int removed, int inserted) {
+  generation ++;
+  // Lines changed in place, a key typed say: nothing moves
+  if (removed == inserted) {
+    for (int k = pos; k < pos + removed && k < (int)states.size(); ++k) {
+      states[k] |= STALE;
+    }
+    return;
+  }
+  states.erase(states.begin() + pos, states.begin() + pos + removed);
+  states.insert(states.begin() + pos, inserted, STALE);
+  if (pos < (int)states.size()) {
+    states[pos] |= STALE;
+  }
+  // Keep the old spans of a changed line to draw until it is lexed again
+  std::map<int, std::vector<span>> shifted;
+  for (auto &entry: cached) {
+    int line = entry.first;
+    if (line < pos || (line == pos && inserted > 0)) {
+      shifted.emplace(line, std::move(entry.second));
+    } else if (line >= pos + removed) {
+      shifted.emplace(line - removed + inserted, std::move(entry.second));
+    }
+  }
+  cached.swap(shifted);
+}
+
+const std::vector<span> *Highlighter::spans(int line) const {
+  auto it = cached.find(line);
+  return it == cached.end() ? nullptr : &it->second;
+}
+
+void Highlighter::request(const std::vector<Line> &content, int first, int last, int margin) {
+  if (std::find(windows.begin(), windows.end(), first) == windows.end()) {
+    windows.push_back(first);
+    if (windows.size() > MAX_WINDOWS) {
+      windows.erase(windows.begin());
+    }
+  }
+  if (pending && pendingGeneration == generation) {
+    return;
+  }
+  int size = (int)content.size();
+  last = std::min(last, size - 1);
+  int start = -1, lastDirty = -1;
+  for (int i = first; i <= last; ++i) {
+    if (dirty(i)) {
+      if (start < 0) start = i;
+      lastDirty = i;
+    }
+  }
+  if (start < 0) {
+    return;
+  }
+  int limit = std::max(0, start - SYNC_LINES);
+  while (start > limit && (states[start - 1] & STALE)) {
+    start --;
+  }
+  unsigned char state = start > 0 && !(states[start - 1] & STALE) ? states[start - 1] : (unsigned char)NORMAL;
+  int end = std::min(size - 1, last + margin);
+  std::vector<Line> lines(content.begin() + start, content.begin() + end + 1);
+  std::vector<unsigned char> old(states.begin() + start, states.begin() + end + 1);
+
+  pending = true;
+  pendingGeneration = generation;
+  auto self = shared_from_this();
+  unsigned long gen = generation;
+  Worker::instance().post([self, gen, start, state, lastDirty,
+                           lines = std::move(lines), old = std::move(old)]() mutable {
+    result r{gen, start, {}, {}};
+    for (int k = 0; k < (int)lines.size(); ++k) {
+      std::vector<span> spans;
+      state = lex(*self->lang, std::string_view(lines[k]).substr(0, LEX_BYTES), state, spans);
+      r.states.push_back(state);
+      r.spans.push_back(std::move(spans));
+      if (start + k >= lastDirty && state == old[k]) {
+        break; // the lines below start in the state they were lexed with
+      }
+    }
+    self->finish(std::move(r));
+  });
+}
+
+void Highlighter::finish(result &&r) {
+  std::lock_guard<std::mutex> guard(lock);
+  done.push_back(std::move(r));
+}
+
+bool Highlighter::collect() {
+  std::vector<result> ready;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    ready.swap(done);
+  }
+  if (ready.empty()) {
+    return false;
+  }
+  pending = false;
+  for (auto &r: ready) {
+    if (r.generation != generation) {
+      continue; // lines moved since; the next display asks again
+    }
+    int count = (int)r.states.size();
+    int next = r.first + count;
+    unsigned char before = count > 0 ? states[next - 1] : (unsigned char)NORMAL;
+    for (int k = 0; k < count; ++k) {
+      states[r.first + k] = r.states[k];
+      cached[r.first + k] = std::move(r.spans[k]);
+    }
+    // The line below was lexed from another state: lex it again when needed
+    if (next < (int)states.size() && count > 0 && r.states.back() != before) {
+      states[next] |= STALE;
+    }
+    // Spans far from every window shown lately go, so that two windows of
+    // one buffer do not take each other's away
+    if ((int)cached.size() > SPAN_LINES) {
+      for (auto it = cached.begin(); it != cached.end(); ) {
+        bool near = std::abs(it->first - r.first) <= SPAN_LINES / 2;
+        for (int w: windows) {
+          near = near || std::abs(it->first - w) <= SPAN_LINES / 2;
+        }
+        it = near ? std::next(it) : cached.erase(it);
+      }
+    }
+  }
+  return true;
+}
+size_t Highlighter::bytes() const {
+  size_t total = sizeof(*this) + states.capacity();
+  for (const auto &entry: cached) {
+    total += sizeof(entry) + 4 * sizeof(void *) + entry.second.capacity() * sizeof(span);
+  }
+  return total;
+}
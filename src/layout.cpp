@@ -0,0 +1,258 @@
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "layout.h"
+#include "utf8.h"
+
+Layout::Layout() : root(std::make_unique<node>()) {
+  root->id = 0;
+  windows[0] = window();
+  resize();
+}
+// Takes the size of the terminal again; everything is drawn anew
+void Layout::resize() {
+  struct winsize w{};
+  ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
+  rows = w.ws_row;
+  cols = w.ws_col;
+  arrange();
+  fresh = true;
+}
+
+Layout::node *Layout::find(node *n, int id) const {
+  if (!n || n->id == id) {
+    return n;
+  }
+  node *found = find(n->first.get(), id);
+  return found ? found : find(n->second.get(), id);
+}
+void Layout::leaves(const node *n, std::vector<int> &ids) const {
+  if (n->id >= 0) {
+    ids.push_back(n->id);
+    return;
+  }
+  leaves(n->first.get(), ids);
+  leaves(n->second.get(), ids);
+}
+void Layout::arrange() {
+  separators.clear();
+  arrange(root.get(), 0, 0, rows - 1, cols);
+}
+// Halves the area of a split; a window keeps its last row for the status,
+// unless it is the only one
+void Layout::arrange(node *n, int top, int left, int height, int width) {
+  if (n->id >= 0) {
+    window &w = windows[n->id];
+    w.top = top;
+    w.left = left;
+    w.height = n == root.get() ? height : height - 1;
+    w.width = width;
+    return;
+  }
+  if (n->vertical) {
+    int first = (width - 1) / 2;
+    arrange(n->first.get(), top, left, height, first);
+    separators.push_back({left + first, top, height});
+    arrange(n->second.get(), top, left + first + 1, height, width - first - 1);
+  } else {
+    int first = height / 2;
+    arrange(n->first.get(), top, left, first, width);
+    arrange(n->second.get(), top + first, left, height - first, width);
+  }
+}
+
+int Layout::count() const {
+  return (int)windows.size();
+}
+// The buffer of the current window
+int Layout::file() const {
+  return windows.at(focused).file;
+}
+int Layout::showing(int file) const {
+  int n = 0;
+  for (const auto &w: windows) {
+    n += w.second.file == file;
+  }
+  return n;
+}
+std::vector<int> Layout::files() const {
+  std::vector<int> shown;
+  for (const auto &w: windows) {
+    if (std::find(shown.begin(), shown.end(), w.second.file) == shown.end()) {
+      shown.push_back(w.second.file);
+    }
+  }
+  return shown;
+}
+// The current window now shows another buffer, through that buffer's view
+void Layout::show(int file) {
+  windows[focused].file = file;
+}
+// Splits the current window in two showing the same view; the new one,
+// above or on the left, becomes current. False when there is no room.
+bool Layout::split(bool vertical, std::vector<FileManager> &buffer) {
+  window &w = windows[focused];
+  int area = root->id < 0 ? w.height + 1 : w.height;
+  if (vertical ? w.width < 2 * MIN_WIDTH + 1 : area < 2 * (MIN_HEIGHT + 1)) {
+    return false;
+  }
+  node *leaf = find(root.get(), focused);
+  leaf->first = std::make_unique<node>();
+  leaf->second = std::make_unique<node>();
+  leaf->first->id = nextId;
+  leaf->second->id = focused;
+  leaf->first->parent = leaf->second->parent = leaf;
+  leaf->id = -1;
+  leaf->vertical = vertical;
+  w.at = buffer[w.file].current();
+  window &added = windows[nextId];
+  added.file = w.file;
+  added.at = w.at;
+  focused = nextId ++;
+  arrange();
+  fresh = true;
+  return true;
+}
+// Closes the current window, whose area goes to its sibling
+void Layout::close(std::vector<FileManager> &buffer) {
+  node *leaf = find(root.get(), focused);
+  node *parent = leaf->parent;
+  if (!parent) {
+    return;
+  }
+  std::unique_ptr<node> sibling = std::move(parent->first.get() == leaf ? parent->second : parent->first);
+  sibling->parent = parent->parent;
+  windows.erase(focused);
+  node *kept = sibling.get();
+  if (!parent->parent) {
+    root = std::move(sibling);
+  } else if (parent->parent->first.get() == parent) {
+    parent->parent->first = std::move(sibling);
+  } else {
+    parent->parent->second = std::move(sibling);
+  }
+  while (kept->id < 0) {
+    kept = kept->first.get();
+  }
+  focused = kept->id;
+  buffer[windows[focused].file].show(windows[focused].at);
+  arrange();
+  fresh = true;
+}
+void Layout::only() {
+  window kept = windows[focused];
+  windows.clear();
+  windows[focused] = kept;
+  root = std::make_unique<node>();
+  root->id = focused;
+  arrange();
+  fresh = true;
+}
+void Layout::focus(int id, std::vector<FileManager> &buffer) {
+  window &from = windows[focused];
+  from.at = buffer[from.file].current();
+  from.drawn.clear(); // its status row changes
+  focused = id;
+  window &to = windows[focused];
+  buffer[to.file].show(to.at);
+  to.drawn.clear();
+}
+// The next window (or the previous one for a negative step) in screen order
+void Layout::cycle(int step, std::vector<FileManager> &buffer) {
+  std::vector<int> ids;
+  leaves(root.get(), ids);
+  int k = (int)(std::find(ids.begin(), ids.end(), focused) - ids.begin());
+  int n = (int)ids.size();
+  focus(ids[((k + step) % n + n) % n], buffer);
+}
+// The window next to the current one on a side, if there is one
+bool Layout::go(direction d, std::vector<FileManager> &buffer) {
+  const window &w = windows[focused];
+  int row = w.top, col = w.left;
+  switch (d) {
+    case direction::UP: row = w.top - 2; break;
+    case direction::DOWN: row = w.top + w.height + 1; break;
+    case direction::LEFT: col = w.left - 2; break;
+    case direction::RIGHT: col = w.left + w.width + 1; break;
+  }
+  for (const auto &other: windows) {
+    const window &o = other.second;
+    if (row >= o.top && row <= o.top + o.height && col >= o.left && col < o.left + o.width) {
+      focus(other.first, buffer);
+      return true;
+    }
+  }
+  return false;
+}
+
+void Layout::drawStatus(const window &w, const FileManager &file, bool current) const {
+  std::string text = " " + file.name() + (file.isSaved() ? "" : " [+]");
+  if ((int)text.size() > w.width) {
+    text = utf8::sanitize(text.substr(0, w.width));
+  }
+  text.resize(std::max((int)text.size(), w.width), ' ');
+  printf("%s%s", ANSI::cursorPosition(w.top + w.height + 1, w.left + 1).c_str(),
+         (current ? ANSI::reverse(text) : ANSI::grey(ANSI::reverse(text))).c_str());
+}
+// Scrolls the windows of a buffer other than the current one so that top
+// is their first line, with the cursor on line
+void Layout::align(int file, int line, int top) {
+  for (auto &entry: windows) {
+    window &w = entry.second;
+    if (entry.first != focused && w.file == file) {
+      w.at.posX = line;
+      w.at.windowStartX = top;
+      w.at.windowStartRow = 0;
+    }
+  }
+}
+void Layout::compose(std::vector<FileManager> &buffer) {
+  if (fresh) {
+    FileManager::clearTerminal();
+    std::string out;
+    for (const auto &s: separators) {
+      for (int r = 0; r < s.height; ++r) {
+        out += ANSI::cursorPosition(s.top + r + 1, s.column + 1) + ANSI::grey("|");
+      }
+    }
+    printf("%s", out.c_str());
+    for (auto &w: windows) {
+      w.second.drawn.clear();
+      w.second.rows.clear();
+    }
+    fresh = false;
+  }
+  for (auto &entry: windows) {
+    window &w = entry.second;
+    FileManager &file = buffer[w.file];
+    bool current = entry.first == focused;
+    view mine = file.current();
+    if (!current) {
+      file.show(w.at);
+    }
+    file.fit(w.height, w.width);
+    std::string drawn = file.signature() + (current ? " *" : " ") + (file.isSaved() ? "" : "+");
+    if (drawn != w.drawn) {
+      file.render(w.top, w.left, w.height, w.width, w.rows);
+      if (windows.size() > 1) {
+        drawStatus(w, file, current);
+      }
+      w.drawn = drawn;
+    }
+    if (!current) {
+      w.at = file.current();
+      file.show(mine);
+    }
+  }
+  // Another window of the same buffer may have been fitted last
+  const window &w = windows[focused];
+  FileManager &file = buffer[w.file];
+  file.fit(w.height, w.width);
+  auto cell = file.cursorCell();
+  printf("%s%s%s%s", ANSI::cursorPosition(rows, 1).c_str(), ANSI::clearLine().c_str(),
+         file.promptText().c_str(),
+         ANSI::cursorPosition(w.top + cell.first + 1, w.left + cell.second + 1).c_str());
+  fflush(stdout);
+}
@@ -0,0 +1,97 @@
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <string_view>
+#include <unordered_map>
+
+#include "line.h"
+
+namespace {
+  std::atomic<bool> interned{false};
+  std::mutex poolLock;
+  // Keyed by a view of the block's own bytes
+  std::unordered_map<std::string_view, void *> pool;
+}
+
+Line::block *Line::allocate(std::string_view s, bool pooled) {
+  void *memory = ::operator new(offsetof(block, data) + s.size() + 1);
+  auto made = new (memory) block;
+  made->refs.store(1, std::memory_order_relaxed);
+  made->size = (unsigned)s.size();
+  made->pooled = pooled;
+  memcpy(made->data, s.data(), s.size());
+  made->data[s.size()] = '\0';
+  return made;
+}
+
+Line::block *Line::make(std::string_view s) {
+  if (s.empty()) {
+    return nullptr;
+  }
+  if (!interned.load(std::memory_order_relaxed)) {
+    return allocate(s, false);
+  }
+  // Looked up and added under one lock, so equal lines never get two blocks
+  std::lock_guard<std::mutex> guard(poolLock);
+  auto it = pool.find(s);
+  if (it != pool.end()) {
+    auto found = static_cast<block *>(it->second);
+    found->refs.fetch_add(1, std::memory_order_relaxed);
+    return found;
+  }
+  block *made = allocate(s, true);
+  pool.emplace(std::string_view(made->data, made->size), made);
+  return made;
+}
+
+// The last reference to a pooled line is dropped under the pool's lock,
+// so a lookup never finds a line that is being freed.
+void Line::release(block *b) {
+  if (!b->pooled) {
+    if (b->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      b->~block();
+      ::operator delete(b);
+    }
+    return;
+  }
+  unsigned refs = b->refs.load(std::memory_order_relaxed);
+  while (refs > 1) {
+    if (b->refs.compare_exchange_weak(refs, refs - 1, std::memory_order_acq_rel)) {
+      return;
+    }
+  }
+  std::lock_guard<std::mutex> guard(poolLock);
+  if (b->refs.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+    return;
+  }
+  pool.erase(std::string_view(b->data, b->size));
+  b->~block();
+  ::operator delete(b);
+}
+
+void Line::intern(bool on) {
+  interned.store(on);
+}
+bool Line::interning() {
+  return interned.load();
+}
+size_t Line::pooled() {
+  std::lock_guard<std::mutex> guard(poolLock);
+  return pool.size();
+}
+size_t Line::poolBytes() {
+  std::lock_guard<std::mutex> guard(poolLock);
+  // a node (next, key, value, cached hash) per line and a bucket array
+  return pool.size() * (4 * sizeof(void *) + sizeof(std::string_view)) + pool.bucket_count() * sizeof(void *);
+}
+
+size_t Line::bytes() const {
+  if (!b) {
+    return 0;
+  }
+  size_t refs = std::max(1u, b->refs.load(std::memory_order_relaxed));
+  return (offsetof(block, data) + b->size + 1 + refs / 2) / refs;
+}
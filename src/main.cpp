@@ -5,57 +5,109 @@
 #include <string>
 #include <cstdio>
 #include <sstream>
+#include <poll.h>
 
 #include "utility.h"
 #include "core.h"
+#include "line.h"
+#include "server.h"
+#include "binary.h"
 
-void routine(Core &core) {
+void routine(Core &core, Server *server = nullptr) {
   while (true) {
+    // Wait for a key press, a change of an opened file on disk,
+    // highlighting finished in the background, grep matches, or a
+    // client attaching to the server
+    struct pollfd fds[5] = {{STDIN_FILENO, POLLIN, 0}, {core.watchDescriptor(), POLLIN, 0},
+                            {core.highlightDescriptor(), POLLIN, 0}, {core.grepDescriptor(), POLLIN, 0},
+                            {server ? server->descriptor() : -1, POLLIN, 0}};
+    int ready = poll(fds, 5, core.pollTimeout());
+    if (ready < 0) {
+      continue;
+    }
+    if (ready == 0 || (fds[1].revents & POLLIN)) {
+      core.handleFileChange();
+    }
+    if (fds[2].revents & POLLIN) {
+      core.handleHighlight();
+    }
+    if (fds[3].revents & POLLIN) {
+      core.handleGrep();
+    }
+    if (fds[4].revents & POLLIN) {
+      for (const auto &a: server->collect()) {
+        core.attach(a.cwd, a.files);
+      }
+    }
+    if (!(fds[0].revents & (POLLIN | POLLHUP))) {
+      continue;
+    }
     char ch = getchar();
-    core.clearPrompt();
-
-    if (ch == REDO) {
-      core.handleREDO();
-    } else if (ch == TAB) {
-      core.handleTAB();
-    } else if (ch == ESC) {
+    std::string key(1, ch);
+    if (ch == ESC) {
       nonblock(STDIN_FILENO);
       // Distinguish ESC and ESC + [ + A
       char ch2 = getchar();
       char ch3 = getchar();
       if (ch2 == '[' && ch3 >= 'A' && ch3 <= 'D') {
-        switch (ch3) {
-          case 'A':
-            core.handle(direction::UP);
-            break;
-          case 'B':
-            core.handle(direction::DOWN);
-            break;
-          case 'C':
-            core.handle(direction::RIGHT);
-            break;
-          case 'D':
-            core.handle(direction::LEFT);
-            break;
-          default:
-            break;
-        }
-      } else {
-        core.handleESC();
+        key += std::string{ch2, ch3};
       }
       nonblock(STDIN_FILENO, true);
-    } else if (ch == ENTER) {
-      core.handleENTER();
-    } else if (ch == BACKSPACE) {
-      core.handleBACKSPACE();
-    } else {
-      core.handle(ch);
+      clearerr(stdin);
     }
+    core.press(key);
     if (core.end) {
       break;
     }
   }
 }
+// -S: attaches to the server, first starting one with the files if none
+// is running. The server outlives the terminal, and -S attaches again.
+int remote(const std::vector<std::string> &files, bool follow, bool compare) {
+  std::string path = Server::socketPath();
+  int fd = Server::connect(path);
+  if (fd < 0) {
+    if (files.empty()) {
+      std::cerr << "No server is running. Please open at least one file." << std::endl;
+      return 1;
+    }
+    struct winsize size{};
+    ioctl(STDOUT_FILENO, TIOCGWINSZ, &size);
+    unlink(path.c_str()); // left by a server that did not quit
+    pid_t pid = fork();
+    if (pid == 0) {
+      setsid();
+      int code = 1;
+      {
+        Server server;
+        if (server.start(path, size)) {
+          Core core(files);
+          if (follow) {
+            core.followAll();
+          }
+          core.serve();
+          if (compare) {
+            core.diffSplit();
+          }
+          struct termios oldt, newt;
+          config_set(oldt, newt);
+          routine(core, &server);
+          code = core.returnCode;
+        }
+      }
+      _exit(code);
+    }
+    for (int k = 0; pid > 0 && fd < 0 && k < 500; ++k) {
+      usleep(10000);
+      fd = Server::connect(path);
+    }
+    if (fd < 0) {
+      std::cerr << "Cannot start the server." << std::endl;
+      return 1;
+    }
+  }
+  return Server::attach(fd, files);
+}
 int main(int argc, char const *argv[]) {
   std::vector<std::string> fileContent;
   if (argc <= 1) {
@@ -63,10 +115,38 @@ int main(int argc, char const *argv[]) {
     return 1;
   }
   std::vector<std::string> files;
+  bool follow = false, serve = false, compare = false;
   for (int i = 1; i < argc; ++i) {
-    files.emplace_back(argv[i]);
+    if (std::string(argv[i]) == "-f") {
+      follow = true;
+    } else if (std::string(argv[i]) == "-S") {
+      serve = true;
+    } else if (std::string(argv[i]) == "-d") {
+      compare = true;
+    } else if (std::string(argv[i]) == "-b") {
+      Binary::force(true);
+    } else if (std::string(argv[i]) == "-i") {
+      Line::intern(true);
+    } else {
+      files.emplace_back(argv[i]);
+    }
+  }
+  // Unbuffered, so that poll() on the descriptor sees every pending key
+  setvbuf(stdin, nullptr, _IONBF, 0);
+  if (serve) {
+    return remote(files, follow, compare);
+  }
+  if (files.empty()) {
+    std::cerr << "Please open at least one file." << std::endl;
+    return 1;
   }
   Core core(files);
+  if (follow) {
+    core.followAll();
+  }
+  if (compare) {
+    core.diffSplit();
+  }
 
   struct termios oldt, newt;
   config_set(oldt, newt);
@@ -0,0 +1,52 @@
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "memory.h"
+
+size_t MemoryCount::heap(const std::string &s) {
+  static const size_t local = std::string().capacity(); // kept in the string itself
+  return s.capacity() > local ? s.capacity() + 1 : 0;
+}
+size_t MemoryCount::of(const std::vector<Line> &lines) {
+  size_t bytes = sizeof(lines) + lines.capacity() * sizeof(Line);
+  for (const auto &line: lines) {
+    bytes += line.bytes();
+  }
+  return bytes;
+}
+size_t MemoryCount::shared(const std::vector<Line> *lines) {
+  if (!lines || !seen.insert(lines).second) {
+    return 0;
+  }
+  return of(*lines);
+}
+
+std::string MemoryCount::human(size_t bytes) {
+  const char *units[] = {"B", "KB", "MB", "GB"};
+  double value = (double)bytes;
+  int unit = 0;
+  while (value >= 1024 && unit < 3) {
+    value /= 1024;
+    unit ++;
+  }
+  char buf[32];
+  snprintf(buf, sizeof(buf), unit ? "%.1f%s" : "%.0f%s", value, units[unit]);
+  return buf;
+}
+std::string MemoryCount::json(const std::string &s) {
+  std::string out = "\"";
+  for (unsigned char c: s) {
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += (char)c;
+    } else if (c < 0x20) {
+      char buf[8];
+      snprintf(buf, sizeof(buf), "\\u%04x", c);
+      out += buf;
+    } else {
+      out += (char)c;
+    }
+  }
+  return out + "\"";
+}
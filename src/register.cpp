@@ -0,0 +1,46 @@
+#include <memory>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "register.h"
+
+Register::Register(std::shared_ptr<const std::vector<Line>> source, int begin, int end,
+                   bool linewise, size_t head, size_t tail) :
+        source(std::move(source)), begin(begin), end(end), head(head), tail(tail), linewise(linewise) {}
+
+bool Register::empty() const {
+  return begin >= end;
+}
+int Register::size() const {
+  return end - begin;
+}
+// A whole line is shared with the source, a part of one is copied
+Line Register::line(int i) const {
+  const Line &s = (*source)[begin + i];
+  size_t from = i == 0 ? std::min(head, s.size()) : 0;
+  size_t to = i + 1 == size() ? std::min(tail, s.size()) : s.size();
+  if (from == 0 && to == s.size()) {
+    return s;
+  }
+  return s.view().substr(from, std::max(from, to) - from);
+}
+const std::vector<Line> *Register::shares() const {
+  return source.get();
+}
+void Register::materialize() {
+  auto own = std::make_shared<std::vector<Line>>();
+  own->reserve(size());
+  for (int i = 0; i < size(); ++i) {
+    own->push_back(line(i));
+  }
+  source = std::move(own);
+  end = size();
+  begin = 0;
+  head = 0;
+  tail = std::string::npos;
+}
+// A slice keeps all of its source alive
+size_t Register::bytes(MemoryCount &count) const {
+  return sizeof(*this) + count.shared(source.get());
+}
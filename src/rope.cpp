@@ -0,0 +1,130 @@
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "rope.h"
+#include "memory.h"
+
+namespace {
+  size_t highBytes(std::string_view s) {
+    size_t n = 0;
+    for (char c: s) {
+      n += (unsigned char)c >= 0x80;
+    }
+    return n;
+  }
+  bool continuation(unsigned char c) {
+    return (c & 0xc0) == 0x80;
+  }
+}
+
+Rope::Rope(std::string_view text) {
+  for (size_t i = 0; i < text.size() || chunks.empty(); i += CHUNK) {
+    chunks.emplace_back(text.substr(std::min(i, text.size()), CHUNK));
+  }
+  multibyte = highBytes(text);
+  restart(0);
+}
+int Rope::find(size_t at) const {
+  int k = (int)(std::upper_bound(starts.begin(), starts.end(), at) - starts.begin()) - 1;
+  return std::max(0, std::min(k, (int)chunks.size() - 1));
+}
+void Rope::restart(int from) {
+  starts.resize(chunks.size());
+  size_t at = from > 0 ? starts[from - 1] + chunks[from - 1].size() : 0;
+  for (int k = from; k < (int)chunks.size(); ++k) {
+    starts[k] = at;
+    at += chunks[k].size();
+  }
+  length = at;
+}
+size_t Rope::size() const {
+  return length;
+}
+bool Rope::ascii() const {
+  return multibyte == 0;
+}
+unsigned char Rope::at(size_t i) const {
+  int k = find(i);
+  return (unsigned char)chunks[k][i - starts[k]];
+}
+// A stray continuation byte is a character of its own after three
+size_t Rope::charStart(size_t i) const {
+  i = std::min(i, length);
+  for (int back = 0; back < 3 && i > 0 && i < length && continuation(at(i)); ++back) {
+    i --;
+  }
+  return i;
+}
+size_t Rope::charNext(size_t i) const {
+  if (i >= length) {
+    return length;
+  }
+  i ++;
+  for (int ahead = 0; ahead < 3 && i < length && continuation(at(i)); ++ahead) {
+    i ++;
+  }
+  return i;
+}
+// The removed bytes may run over several chunks; the inserted ones go
+// into the chunk of at, which is split if it grew too large.
+void Rope::splice(size_t at, size_t removed, std::string_view inserted) {
+  int k = find(at), j = k;
+  size_t offset = at - starts[k], o = offset;
+  while (removed > 0 && j < (int)chunks.size()) {
+    size_t n = std::min(removed, chunks[j].size() - o);
+    multibyte -= highBytes(std::string_view(chunks[j]).substr(o, n));
+    chunks[j].erase(o, n);
+    removed -= n;
+    if (removed > 0) {
+      j ++;
+      o = 0;
+    }
+  }
+  for (int i = std::min(j, (int)chunks.size() - 1); i > k; --i) {
+    if (chunks[i].empty()) {
+      chunks.erase(chunks.begin() + i);
+    }
+  }
+  chunks[k].insert(offset, inserted);
+  multibyte += highBytes(inserted);
+  if (chunks[k].empty() && chunks.size() > 1) {
+    chunks.erase(chunks.begin() + k);
+  } else if (chunks[k].size() > 2 * CHUNK) {
+    std::string whole = std::move(chunks[k]);
+    std::vector<std::string> pieces;
+    for (size_t i = 0; i < whole.size(); i += CHUNK) {
+      pieces.push_back(whole.substr(i, CHUNK));
+    }
+    chunks.erase(chunks.begin() + k);
+    chunks.insert(chunks.begin() + k, pieces.begin(), pieces.end());
+  }
+  restart(k);
+}
+std::string Rope::substr(size_t from, size_t n) const {
+  std::string out;
+  n = std::min(n, length - std::min(from, length));
+  out.reserve(n);
+  for (int k = find(from); n > 0 && k < (int)chunks.size(); ++k) {
+    size_t o = from > starts[k] ? from - starts[k] : 0;
+    size_t take = std::min(n, chunks[k].size() - o);
+    out.append(chunks[k], o, take);
+    n -= take;
+  }
+  return out;
+}
+std::string Rope::str() const {
+  std::string out;
+  out.reserve(length);
+  for (const auto &chunk: chunks) {
+    out += chunk;
+  }
+  return out;
+}
+size_t Rope::bytes() const {
+  size_t total = chunks.capacity() * sizeof(std::string) + starts.capacity() * sizeof(size_t);
+  for (const auto &chunk: chunks) {
+    total += MemoryCount::heap(chunk);
+  }
+  return total;
+}
@@ -0,0 +1,356 @@
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <csignal>
+#include <cstring>
+#include <iterator>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "server.h"
+#include "utility.h"
+
+namespace {
+  constexpr size_t CHUNK = 1 << 16;
+  constexpr size_t MAX_HEADER = 1 << 20;
+  constexpr int LIMIT = 5; // seconds a client may take to send its header or read
+
+  bool writeAll(int fd, const char *p, size_t n) {
+    while (n > 0) {
+      ssize_t k = write(fd, p, n);
+      if (k < 0 && errno == EINTR) {
+        continue;
+      }
+      if (k <= 0) {
+        return false;
+      }
+      p += k;
+      n -= k;
+    }
+    return true;
+  }
+}
+
+Server::~Server() {
+  if (relay.joinable()) {
+    char c = 1;
+    (void)!write(wake[1], &c, 1);
+    relay.join();
+  }
+  for (int fd: {master, listener, client, greeting, fds[0], fds[1], wake[0], wake[1]}) {
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+  if (!path.empty()) {
+    unlink(path.c_str());
+  }
+}
+
+std::string Server::socketPath() {
+  const char *dir = getenv("XDG_RUNTIME_DIR");
+  if (dir && *dir) {
+    return std::string(dir) + "/alayavim.sock";
+  }
+  return "/tmp/alayavim-" + std::to_string(getuid()) + ".sock";
+}
+
+int Server::connect(const std::string &path) {
+  struct sockaddr_un addr{};
+  if (path.size() >= sizeof(addr.sun_path)) {
+    return -1;
+  }
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path.c_str());
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  if (::connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Listens on the socket, then makes a pseudo-terminal of the given size
+// the terminal of this process, so the editor runs on it unchanged.
+bool Server::start(const std::string &file, const struct winsize &size) {
+  struct sockaddr_un addr{};
+  if (file.size() >= sizeof(addr.sun_path)) {
+    return false;
+  }
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, file.c_str());
+  listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  mode_t mask = umask(077); // only this user may attach
+  bool bound = listener >= 0 && bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+  umask(mask);
+  if (!bound || listen(listener, 4) != 0) {
+    return false;
+  }
+  path = file;
+  master = posix_openpt(O_RDWR | O_NOCTTY);
+  if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) {
+    return false;
+  }
+  int slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+  if (slave < 0 || pipe(fds) != 0 || pipe(wake) != 0) {
+    return false;
+  }
+  ioctl(master, TIOCSWINSZ, &size);
+  fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+  fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+  dup2(slave, STDIN_FILENO);
+  dup2(slave, STDOUT_FILENO);
+  dup2(slave, STDERR_FILENO);
+  if (slave > STDERR_FILENO) {
+    close(slave);
+  }
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGHUP, SIG_IGN);
+  relay = std::thread([this] { run(); });
+  return true;
+}
+
+int Server::descriptor() const {
+  return fds[0];
+}
+
+std::vector<Server::attachment> Server::collect() {
+  char buf[256];
+  while (read(fds[0], buf, sizeof(buf)) > 0) {}
+  std::lock_guard<std::mutex> guard(lock);
+  std::vector<attachment> ready(std::make_move_iterator(pending.begin()), std::make_move_iterator(pending.end()));
+  pending.clear();
+  return ready;
+}
+
+// The relay: the only thread that touches the client and the master side.
+// A client sending its header is read as its bytes come, so one that
+// connects and says nothing does not hold up the attached one.
+void Server::run() {
+  while (true) {
+    int was = client;
+    struct pollfd p[5] = {{wake[0], POLLIN, 0}, {listener, POLLIN, 0},
+                          {master, POLLIN, 0}, {client, POLLIN, 0}, {greeting, POLLIN, 0}};
+    int wait = -1;
+    if (greeting >= 0) {
+      auto left = std::chrono::duration_cast<std::chrono::milliseconds>(greetBy - std::chrono::steady_clock::now());
+      wait = std::max(0, (int)left.count());
+    }
+    if (poll(p, 5, wait) < 0) {
+      continue;
+    }
+    if (greeting >= 0 && (p[4].revents & (POLLIN | POLLHUP | POLLERR))) {
+      hear();
+    } else if (greeting >= 0 && std::chrono::steady_clock::now() >= greetBy) {
+      close(greeting);
+      greeting = -1;
+    }
+    if (p[0].revents & POLLIN) {
+      // Quitting: what is left of the last frame still goes out
+      struct pollfd m = {master, POLLIN, 0};
+      while (poll(&m, 1, 0) > 0 && forward()) {}
+      return;
+    }
+    if (p[2].revents & POLLIN) {
+      forward();
+    }
+    if (p[1].revents & POLLIN) {
+      accept();
+    }
+    if (client >= 0 && client == was && (p[3].revents & (POLLIN | POLLHUP | POLLERR))) {
+      char buf[CHUNK];
+      ssize_t n = read(client, buf, sizeof(buf));
+      if (n <= 0) {
+        drop(); // the session stays for the next client
+      } else {
+        type(buf, n);
+      }
+    }
+  }
+}
+
+void Server::drop() {
+  if (client >= 0) {
+    close(client);
+    client = -1;
+  }
+}
+
+// What the editor drew goes to the client, or nowhere without one
+bool Server::forward() {
+  char buf[CHUNK];
+  ssize_t n = read(master, buf, sizeof(buf));
+  if (n <= 0) {
+    return false;
+  }
+  if (client >= 0 && !writeAll(client, buf, n)) {
+    drop();
+  }
+  return true;
+}
+
+// Keys go to the editor. What it draws meanwhile is forwarded, so that
+// neither side waits for the other to empty a full buffer.
+void Server::type(const char *p, size_t n) {
+  while (n > 0) {
+    ssize_t k = write(master, p, n);
+    if (k > 0) {
+      p += k;
+      n -= k;
+      continue;
+    }
+    if (k < 0 && errno != EAGAIN && errno != EINTR) {
+      return;
+    }
+    struct pollfd m = {master, POLLIN | POLLOUT, 0};
+    poll(&m, 1, -1);
+    if (m.revents & POLLIN) {
+      forward();
+    }
+  }
+}
+
+// The header of a client: "alayavim <rows> <cols>", its directory and
+// the files, one per line, then an empty line. Keys follow.
+bool Server::greet(const std::string &got, attachment &a, struct winsize &size, std::string &rest) {
+  size_t end = got.find("\n\n");
+  rest = got.substr(end + 2);
+  std::istringstream in(got.substr(0, end + 1));
+  std::string line;
+  if (!std::getline(in, line) || sscanf(line.c_str(), "alayavim %hu %hu", &size.ws_row, &size.ws_col) != 2
+      || !std::getline(in, a.cwd)) {
+    return false;
+  }
+  while (std::getline(in, line)) {
+    a.files.push_back(line);
+  }
+  return true;
+}
+
+// A newer client waiting for its header replaces one still waiting
+void Server::accept() {
+  int fd = ::accept(listener, nullptr, nullptr);
+  if (fd < 0) {
+    return;
+  }
+  if (greeting >= 0) {
+    close(greeting);
+  }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  greeting = fd;
+  header.clear();
+  greetBy = std::chrono::steady_clock::now() + std::chrono::seconds(LIMIT);
+}
+
+void Server::hear() {
+  char buf[4096];
+  ssize_t n = read(greeting, buf, sizeof(buf));
+  if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+    return;
+  }
+  if (n > 0) {
+    header.append(buf, n);
+  }
+  attachment a;
+  struct winsize size{};
+  std::string rest;
+  bool whole = header.find("\n\n") != std::string::npos;
+  if (!whole && n > 0 && header.size() <= MAX_HEADER) {
+    return;
+  }
+  int fd = greeting;
+  greeting = -1;
+  if (!whole || !greet(header, a, size, rest)) {
+    close(fd);
+    return;
+  }
+  // A client that stops reading is dropped rather than stall the editor
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+  struct timeval limit = {LIMIT, 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &limit, sizeof(limit));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &limit, sizeof(limit));
+  drop(); // a new client takes over
+  client = fd;
+  ioctl(master, TIOCSWINSZ, &size);
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    pending.push_back(std::move(a));
+  }
+  char c = 1;
+  (void)!write(fds[1], &c, 1);
+  type(rest.data(), rest.size());
+}
+
+// The client: sends the size of the terminal, the directory and the files
+// to open, then copies keys to the server and what it draws back to the
+// terminal, until the server quits or CTRL-\ detaches.
+int Server::attach(int fd, const std::vector<std::string> &files) {
+  signal(SIGPIPE, SIG_IGN);
+  struct winsize size{};
+  ioctl(STDOUT_FILENO, TIOCGWINSZ, &size);
+  char dir[PATH_MAX];
+  std::string header = "alayavim " + std::to_string(size.ws_row) + " " + std::to_string(size.ws_col) + "\n"
+                       + (getcwd(dir, sizeof(dir)) ? dir : "/") + "\n";
+  for (const auto &file: files) {
+    if (!file.empty() && file.find('\n') == std::string::npos) {
+      header += file + "\n";
+    }
+  }
+  header += "\n";
+  if (!writeAll(fd, header.data(), header.size())) {
+    close(fd);
+    return 1;
+  }
+  // Every key goes to the server, CTRL-C and CTRL-Z included
+  struct termios oldt, newt;
+  tcgetattr(STDIN_FILENO, &oldt);
+  newt = oldt;
+  newt.c_lflag &= ~(ICANON | ECHO | ISIG);
+  tcsetattr(STDIN_FILENO, TCSANOW, &newt);
+  bool detached = false;
+  char buf[CHUNK];
+  while (true) {
+    struct pollfd p[2] = {{STDIN_FILENO, POLLIN, 0}, {fd, POLLIN, 0}};
+    if (poll(p, 2, -1) < 0) {
+      continue;
+    }
+    if (p[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+      ssize_t n = read(fd, buf, sizeof(buf));
+      if (n <= 0) {
+        break; // the server quit, or another client took over
+      }
+      writeAll(STDOUT_FILENO, buf, n);
+    }
+    if (p[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+      ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
+      if (n <= 0) {
+        break; // the terminal is gone; the session is not
+      }
+      auto stop = (const char *)memchr(buf, DETACH, n);
+      if (!writeAll(fd, buf, stop ? stop - buf : n)) {
+        break;
+      }
+      if (stop) {
+        detached = true;
+        break;
+      }
+    }
+  }
+  tcsetattr(STDIN_FILENO, TCSANOW, &oldt);
+  close(fd);
+  if (detached) {
+    printf("%s%s[detached]\n", ANSI::clearScreen().c_str(), ANSI::cursorPosition(1, 1).c_str());
+  }
+  return 0;
+}
@@ -0,0 +1,439 @@
+#include <algorithm>
+#include <climits>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "structure.h"
+
+namespace {
+  constexpr size_t PARALLEL = 64; // fewer blocks are scanned on one thread
+
+  // Type of each byte: 0 to 2 for the brackets, -1 for the rest
+  struct types {
+    signed char of[256];
+    types() {
+      std::fill(of, of + 256, -1);
+      of['('] = of[')'] = 0;
+      of['['] = of[']'] = 1;
+      of['{'] = of['}'] = 2;
+    }
+  };
+  const types TYPE;
+
+  int typeOf(char c) {
+    return TYPE.of[(unsigned char)c];
+  }
+  const char OPEN[] = "([{", CLOSE[] = ")]}";
+}
+
+Structure::summary Structure::join(const summary &a, const summary &b) {
+  summary s;
+  s.lines = a.lines + b.lines;
+  s.blanks = a.blanks + b.blanks;
+  s.stale = a.stale + b.stale;
+  for (int t = 0; t < TYPES; ++t) {
+    s.d[t].sum = a.d[t].sum + b.d[t].sum;
+    s.d[t].low = std::min(a.d[t].low, a.d[t].sum + b.d[t].low);
+    s.d[t].back = std::min(b.d[t].back, a.d[t].back - b.d[t].sum);
+  }
+  return s;
+}
+
+// The brackets a line leaves unmatched; false if there are none
+bool Structure::scan(std::string_view line, brackets &b) {
+  bool any = false;
+  for (char c: line) {
+    int t = typeOf(c);
+    if (t < 0) continue;
+    any = true;
+    if (c == OPEN[t]) {
+      b.open[t] ++;
+    } else if (b.open[t] > 0) {
+      b.open[t] --;
+    } else {
+      b.close[t] ++;
+    }
+  }
+  if (any) {
+    any = false;
+    for (int t = 0; t < TYPES; ++t) {
+      any = any || b.open[t] || b.close[t];
+    }
+  }
+  return any;
+}
+
+void Structure::tally(block &k) {
+  summary s;
+  s.lines = (int)k.flags.size();
+  for (unsigned char f: k.flags) {
+    s.blanks += (f & BLANK) != 0;
+    s.stale += (f & STALE) != 0;
+  }
+  for (const auto &mark: k.marks) {
+    summary line;
+    for (int t = 0; t < TYPES; ++t) {
+      const brackets &b = mark.second;
+      line.d[t] = {b.open[t] - b.close[t], -b.close[t], -b.open[t]};
+    }
+    summary lines = join(s, line);
+    for (int t = 0; t < TYPES; ++t) {
+      s.d[t] = lines.d[t];
+    }
+  }
+  k.sum = s;
+}
+
+void Structure::rebuild() {
+  leaves = 1;
+  while (leaves < (int)blocks.size()) {
+    leaves <<= 1;
+  }
+  tree.assign(2 * leaves, summary());
+  for (size_t b = 0; b < blocks.size(); ++b) {
+    tree[leaves + b] = blocks[b].sum;
+  }
+  for (int n = leaves - 1; n >= 1; --n) {
+    tree[n] = join(tree[2 * n], tree[2 * n + 1]);
+  }
+}
+
+void Structure::update(int b) {
+  int n = leaves + b;
+  tree[n] = blocks[b].sum;
+  for (n >>= 1; n >= 1; n >>= 1) {
+    tree[n] = join(tree[2 * n], tree[2 * n + 1]);
+  }
+}
+
+// Scans the stale lines of a block, which starts at line start
+void Structure::rescan(int b, int start, const std::vector<Line> &content) {
+  block &k = blocks[b];
+  std::vector<std::pair<int, brackets>> marks;
+  size_t j = 0;
+  for (int off = 0; off < (int)k.flags.size(); ++off) {
+    while (j < k.marks.size() && k.marks[j].first < off) {
+      j ++;
+    }
+    if (k.flags[off] & STALE) {
+      const Line &line = content[start + off];
+      k.flags[off] = line.size() == 0 ? BLANK : 0;
+      brackets found;
+      if (scan(line, found)) {
+        marks.emplace_back(off, found);
+      }
+    } else if (j < k.marks.size() && k.marks[j].first == off) {
+      marks.push_back(k.marks[j]);
+    }
+  }
+  k.marks.swap(marks);
+  tally(k);
+}
+
+// Block of a line and its offset there
+int Structure::locate(int line, int &offset) const {
+  if (line >= tree[1].lines) {
+    offset = (int)blocks.back().flags.size();
+    return (int)blocks.size() - 1;
+  }
+  int n = 1;
+  while (n < leaves) {
+    if (tree[2 * n].lines > line) {
+      n = 2 * n;
+    } else {
+      line -= tree[2 * n].lines;
+      n = 2 * n + 1;
+    }
+  }
+  offset = line;
+  return n - leaves;
+}
+
+int Structure::startOf(int b) const {
+  int start = 0;
+  for (int n = leaves + b; n > 1; n >>= 1) {
+    if (n & 1) {
+      start += tree[n - 1].lines;
+    }
+  }
+  return start;
+}
+
+// The first block from on that hit() says holds what is looked for, given
+// acc, the blocks passed over so far, which it then sums; -1 if none
+template<typename Hit>
+int Structure::forward(int node, int l, int r, int from, summary &acc, const Hit &hit) const {
+  if (r <= from) {
+    return -1;
+  }
+  if (l >= from && !hit(acc, tree[node])) {
+    acc = join(acc, tree[node]);
+    return -1;
+  }
+  if (r - l == 1) {
+    return l;
+  }
+  int mid = (l + r) / 2;
+  int found = forward(2 * node, l, mid, from, acc, hit);
+  return found >= 0 ? found : forward(2 * node + 1, mid, r, from, acc, hit);
+}
+
+// The same from block to down to the first one
+template<typename Hit>
+int Structure::backward(int node, int l, int r, int to, summary &acc, const Hit &hit) const {
+  if (l > to) {
+    return -1;
+  }
+  if (r - 1 <= to && !hit(acc, tree[node])) {
+    acc = join(tree[node], acc);
+    return -1;
+  }
+  if (r - l == 1) {
+    return l;
+  }
+  int mid = (l + r) / 2;
+  int found = backward(2 * node + 1, mid, r, to, acc, hit);
+  return found >= 0 ? found : backward(2 * node, l, mid, to, acc, hit);
+}
+
+void Structure::clear() {
+  built = false;
+  blocks.clear();
+  tree.clear();
+  leaves = 0;
+}
+
+// Builds the index on first use, its blocks on several threads for a
+// large buffer, and later rescans only the stale lines
+void Structure::sync(const std::vector<Line> &content) {
+  if (!built) {
+    int n = (int)content.size();
+    blocks.assign(std::max(1, (n + BLOCK - 1) / BLOCK), block());
+    for (int b = 0; b < (int)blocks.size(); ++b) {
+      blocks[b].flags.assign(std::min(BLOCK, n - b * BLOCK), STALE);
+    }
+    unsigned threads = std::max(1u, std::min(8u, std::thread::hardware_concurrency()));
+    if (blocks.size() < PARALLEL) {
+      threads = 1;
+    }
+    std::vector<std::thread> pool;
+    for (unsigned k = 0; k < threads; ++k) {
+      pool.emplace_back([this, k, threads, &content] {
+        for (size_t b = k; b < blocks.size(); b += threads) {
+          rescan((int)b, (int)b * BLOCK, content);
+        }
+      });
+    }
+    for (auto &t: pool) {
+      t.join();
+    }
+    rebuild();
+    built = true;
+    return;
+  }
+  while (tree[1].stale > 0) {
+    summary acc;
+    int b = forward(1, 0, leaves, 0, acc, [](const summary &, const summary &s) { return s.stale > 0; });
+    rescan(b, startOf(b), content);
+    update(b);
+  }
+}
+
+// Lines pos..pos+removed became inserted stale lines. Only the blocks
+// they were in change, unless one grows too large and is split.
+void Structure::edit(int pos, int removed, int inserted) {
+  if (!built) {
+    return;
+  }
+  if (pos + removed > tree[1].lines) {
+    clear(); // out of step: built again on next use
+    return;
+  }
+  int off;
+  int b = locate(pos, off);
+  int first = b, at = off;
+  for (int left = removed; left > 0; ) {
+    block &k = blocks[b];
+    int n = std::min(left, (int)k.flags.size() - off);
+    k.flags.erase(k.flags.begin() + off, k.flags.begin() + off + n);
+    auto &marks = k.marks;
+    marks.erase(std::remove_if(marks.begin(), marks.end(), [&](const std::pair<int, brackets> &m) {
+      return m.first >= off && m.first < off + n;
+    }), marks.end());
+    for (auto &m: marks) {
+      if (m.first >= off + n) m.first -= n;
+    }
+    left -= n;
+    if (left > 0) {
+      b ++;
+      off = 0;
+    }
+  }
+  int last = b;
+  block &k = blocks[first];
+  k.flags.insert(k.flags.begin() + at, inserted, STALE);
+  for (auto &m: k.marks) {
+    if (m.first >= at) m.first += inserted;
+  }
+  // Empty blocks go, large ones are split
+  size_t before = blocks.size();
+  for (int i = last; i >= first; --i) {
+    block &cur = blocks[i];
+    if (cur.flags.empty() && blocks.size() > 1) {
+      blocks.erase(blocks.begin() + i);
+      continue;
+    }
+    if ((int)cur.flags.size() <= 2 * BLOCK) {
+      tally(cur);
+      continue;
+    }
+    std::vector<block> pieces;
+    size_t j = 0;
+    for (int from = 0; from < (int)cur.flags.size(); from += BLOCK) {
+      int to = std::min(from + BLOCK, (int)cur.flags.size());
+      block piece;
+      piece.flags.assign(cur.flags.begin() + from, cur.flags.begin() + to);
+      for (; j < cur.marks.size() && cur.marks[j].first < to; ++j) {
+        piece.marks.emplace_back(cur.marks[j].first - from, cur.marks[j].second);
+      }
+      tally(piece);
+      pieces.push_back(std::move(piece));
+    }
+    blocks.erase(blocks.begin() + i);
+    blocks.insert(blocks.begin() + i, std::make_move_iterator(pieces.begin()), std::make_move_iterator(pieces.end()));
+  }
+  if (blocks.size() != before) {
+    rebuild();
+  } else {
+    for (int i = first; i <= last; ++i) {
+      update(i);
+    }
+  }
+}
+
+bool Structure::match(const std::vector<Line> &content, int x, int y, int &mx, int &my) {
+  std::string_view line = content[x];
+  int j = y;
+  while (j < (int)line.size() && typeOf(line[j]) < 0) {
+    j ++;
+  }
+  if (j >= (int)line.size()) {
+    return false;
+  }
+  int t = typeOf(line[j]);
+  char open = OPEN[t], close = CLOSE[t];
+  bool ahead = line[j] == open;
+  int need = 1; // brackets still to be matched
+  // In the line itself first
+  for (int k = ahead ? j + 1 : j - 1; k >= 0 && k < (int)line.size(); k += ahead ? 1 : -1) {
+    if (line[k] == (ahead ? open : close)) {
+      need ++;
+    } else if (line[k] == (ahead ? close : open) && --need == 0) {
+      mx = x;
+      my = k;
+      return true;
+    }
+  }
+  int from = x + (ahead ? 1 : -1);
+  if (from < 0 || from >= (int)content.size()) {
+    return false;
+  }
+  sync(content);
+  // Then in the lines with brackets of its block, then the tree finds the
+  // block where the depth first drops below the brackets left
+  int off, s = 0; // the depth gained over the lines passed
+  int b = locate(from, off);
+  auto within = [&](int bb, int bound) {
+    const auto &marks = blocks[bb].marks;
+    for (int i = ahead ? 0 : (int)marks.size() - 1; i >= 0 && i < (int)marks.size(); i += ahead ? 1 : -1) {
+      if (ahead ? marks[i].first < bound : marks[i].first > bound) continue;
+      const brackets &br = marks[i].second;
+      int against = ahead ? br.close[t] : br.open[t], along = ahead ? br.open[t] : br.close[t];
+      if (s - against <= -need) {
+        return marks[i].first;
+      }
+      s += along - against;
+    }
+    return -1;
+  };
+  int at = within(b, off);
+  if (at < 0) {
+    summary acc;
+    acc.d[t].sum = ahead ? s : -s;
+    if (ahead) {
+      b = forward(1, 0, leaves, b + 1, acc, [&](const summary &a, const summary &n) {
+        return a.d[t].sum + n.d[t].low <= -need;
+      });
+    } else {
+      b = backward(1, 0, leaves, b - 1, acc, [&](const summary &a, const summary &n) {
+        return n.d[t].back - a.d[t].sum <= -need;
+      });
+    }
+    if (b < 0) {
+      return false;
+    }
+    s = ahead ? acc.d[t].sum : -acc.d[t].sum;
+    at = within(b, ahead ? 0 : INT_MAX);
+    if (at < 0) {
+      return false;
+    }
+  }
+  mx = startOf(b) + at;
+  line = content[mx];
+  int depth = need + s;
+  for (int k = ahead ? 0 : (int)line.size() - 1; k >= 0 && k < (int)line.size(); k += ahead ? 1 : -1) {
+    if (line[k] == (ahead ? open : close)) {
+      depth ++;
+    } else if (line[k] == (ahead ? close : open) && --depth == 0) {
+      my = k;
+      return true;
+    }
+  }
+  return false;
+}
+
+// The first line from from on (step 1) or back (-1) that is blank, or not
+int Structure::flagged(int from, int step, bool blank) const {
+  if (from < 0 || from >= tree[1].lines) {
+    return -1;
+  }
+  auto wanted = [blank](unsigned char f) {
+    return ((f & BLANK) != 0) == blank;
+  };
+  auto hit = [blank](const summary &, const summary &n) {
+    return (blank ? n.blanks : n.lines - n.blanks) > 0;
+  };
+  int off;
+  int b = locate(from, off);
+  for (int round = 0; round < 2; ++round) {
+    const auto &flags = blocks[b].flags;
+    for (int k = off; k >= 0 && k < (int)flags.size(); k += step) {
+      if (wanted(flags[k])) {
+        return startOf(b) + k;
+      }
+    }
+    summary acc;
+    b = step > 0 ? forward(1, 0, leaves, b + 1, acc, hit) : backward(1, 0, leaves, b - 1, acc, hit);
+    if (b < 0) {
+      return -1;
+    }
+    off = step > 0 ? 0 : (int)blocks[b].flags.size() - 1;
+  }
+  return -1;
+}
+
+// Like vim: past the blank lines at line, then past the paragraph
+int Structure::paragraph(const std::vector<Line> &content, int line, int step) {
+  sync(content);
+  int text = flagged(line, step, false);
+  return text < 0 ? -1 : flagged(text + step, step, true);
+}
+
+size_t Structure::bytes() const {
+  size_t total = blocks.capacity() * sizeof(block) + tree.capacity() * sizeof(summary);
+  for (const auto &k: blocks) {
+    total += k.flags.capacity() + k.marks.capacity() * sizeof(k.marks[0]);
+  }
+  return total;
+}
@@ -0,0 +1,388 @@
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "utf8.h"
+
+namespace {
+
+struct range {
+  char32_t from, to;
+};
+
+// Combining marks, joiners, variation selectors and skin tone modifiers:
+// they take no cell and stay in the cluster of the character before.
+const range zeroWidth[] = {
+  {0x0300, 0x036F}, {0x0483, 0x0489}, {0x0591, 0x05BD}, {0x05BF, 0x05BF}, {0x05C1, 0x05C2},
+  {0x05C4, 0x05C5}, {0x05C7, 0x05C7}, {0x0610, 0x061A}, {0x064B, 0x065F}, {0x0670, 0x0670},
+  {0x06D6, 0x06DC}, {0x06DF, 0x06E4}, {0x06E7, 0x06E8}, {0x06EA, 0x06ED}, {0x0711, 0x0711},
+  {0x0730, 0x074A}, {0x07A6, 0x07B0}, {0x0900, 0x0902}, {0x093A, 0x093A}, {0x093C, 0x093C},
+  {0x0941, 0x0948}, {0x094D, 0x094D}, {0x0951, 0x0957}, {0x0962, 0x0963}, {0x0E31, 0x0E31},
+  {0x0E34, 0x0E3A}, {0x0E47, 0x0E4E}, {0x1160, 0x11FF}, {0x1AB0, 0x1AFF}, {0x1DC0, 0x1DFF},
+  {0x200B, 0x200F}, {0x202A, 0x202E}, {0x2060, 0x2064}, {0x20D0, 0x20FF}, {0x302A, 0x302D},
+  {0x3099, 0x309A}, {0xFE00, 0xFE0F}, {0xFE20, 0xFE2F}, {0xFEFF, 0xFEFF}, {0x1F3FB, 0x1F3FF},
+  {0xE0020, 0xE007F}, {0xE0100, 0xE01EF},
+};
+
+// East Asian wide and fullwidth characters and emoji
+const range doubleWidth[] = {
+  {0x1100, 0x115F}, {0x231A, 0x231B}, {0x2329, 0x232A}, {0x23E9, 0x23EC}, {0x23F0, 0x23F0},
+  {0x23F3, 0x23F3}, {0x25FD, 0x25FE}, {0x2614, 0x2615}, {0x2648, 0x2653}, {0x267F, 0x267F},
+  {0x2693, 0x2693}, {0x26A1, 0x26A1}, {0x26AA, 0x26AB}, {0x26BD, 0x26BE}, {0x26C4, 0x26C5},
+  {0x26CE, 0x26CE}, {0x26D4, 0x26D4}, {0x26EA, 0x26EA}, {0x26F2, 0x26F3}, {0x26F5, 0x26F5},
+  {0x26FA, 0x26FA}, {0x26FD, 0x26FD}, {0x2705, 0x2705}, {0x270A, 0x270B}, {0x2728, 0x2728},
+  {0x274C, 0x274C}, {0x274E, 0x274E}, {0x2753, 0x2755}, {0x2757, 0x2757}, {0x2795, 0x2797},
+  {0x27B0, 0x27B0}, {0x27BF, 0x27BF}, {0x2B1B, 0x2B1C}, {0x2B50, 0x2B50}, {0x2B55, 0x2B55},
+  {0x2E80, 0x303E}, {0x3041, 0x33FF}, {0x3400, 0x4DBF}, {0x4E00, 0x9FFF}, {0xA000, 0xA4CF},
+  {0xA960, 0xA97F}, {0xAC00, 0xD7A3}, {0xF900, 0xFAFF}, {0xFE10, 0xFE19}, {0xFE30, 0xFE6F},
+  {0xFF00, 0xFF60}, {0xFFE0, 0xFFE6}, {0x16FE0, 0x16FE4}, {0x17000, 0x18AFF}, {0x1B000, 0x1B2FF},
+  {0x1F004, 0x1F004}, {0x1F0CF, 0x1F0CF}, {0x1F18E, 0x1F18E}, {0x1F191, 0x1F19A},
+  {0x1F200, 0x1F202}, {0x1F210, 0x1F23B}, {0x1F240, 0x1F248}, {0x1F250, 0x1F251},
+  {0x1F260, 0x1F265}, {0x1F300, 0x1F64F}, {0x1F680, 0x1F6FF}, {0x1F7E0, 0x1F7EB},
+  {0x1F90C, 0x1F9FF}, {0x1FA70, 0x1FAFF}, {0x20000, 0x2FFFD}, {0x30000, 0x3FFFD},
+};
+
+template<size_t N>
+bool within(const range (&table)[N], char32_t cp) {
+  auto it = std::upper_bound(table, table + N, cp,
+                             [](char32_t c, const range &r) { return c < r.from; });
+  return it != table && cp <= (it - 1)->to;
+}
+
+bool regional(char32_t cp) {
+  return cp >= 0x1F1E6 && cp <= 0x1F1FF;
+}
+
+int sequenceLength(unsigned char lead) {
+  if (lead < 0x80) return 1;
+  if ((lead & 0xE0) == 0xC0) return 2;
+  if ((lead & 0xF0) == 0xE0) return 3;
+  if ((lead & 0xF8) == 0xF0) return 4;
+  return 0;
+}
+
+enum : unsigned char {
+  UNKNOWN = 0,
+  ASCII = 1,
+  WIDE = 2,
+};
+
+}
+
+size_t utf8::asciiPrefix(const char *s, size_t n) {
+  size_t i = 0;
+#if defined(__SSE2__)
+  for (; i + 16 <= n; i += 16) {
+    int mask = _mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(s + i)));
+    if (mask) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+  for (; i + 16 <= n; i += 16) {
+    if (vmaxvq_u8(vld1q_u8(reinterpret_cast<const uint8_t *>(s + i))) >= 0x80) {
+      break;
+    }
+  }
+#endif
+  for (; i + 8 <= n; i += 8) {
+    uint64_t word;
+    memcpy(&word, s + i, 8);
+    if (word & 0x8080808080808080ull) {
+      break;
+    }
+  }
+  while (i < n && (unsigned char)s[i] < 0x80) {
+    i ++;
+  }
+  return i;
+}
+bool utf8::ascii(std::string_view s) {
+  return asciiPrefix(s.data(), s.size()) == s.size();
+}
+bool utf8::valid(std::string_view s) {
+  size_t i = 0, n = s.size();
+  while ((i += asciiPrefix(s.data() + i, n - i)) < n) {
+    char32_t cp;
+    int len = decode(s.data() + i, n - i, cp);
+    if (!len) {
+      return false;
+    }
+    i += len;
+  }
+  return true;
+}
+int utf8::decode(const char *s, size_t n, char32_t &cp) {
+  auto lead = (unsigned char)s[0];
+  int len = sequenceLength(lead);
+  if (len == 1) {
+    cp = lead;
+    return 1;
+  }
+  if (len == 0 || (size_t)len > n) {
+    return 0;
+  }
+  static const char32_t smallest[] = {0, 0, 0x80, 0x800, 0x10000};
+  cp = lead & (0x7F >> len);
+  for (int k = 1; k < len; ++k) {
+    auto c = (unsigned char)s[k];
+    if ((c & 0xC0) != 0x80) {
+      return 0;
+    }
+    cp = cp << 6 | (c & 0x3F);
+  }
+  // Overlong forms, surrogates and code points past U+10FFFF are invalid
+  if (cp < smallest[len] || (cp >= 0xD800 && cp <= 0xDFFF) || cp > 0x10FFFF) {
+    return 0;
+  }
+  return len;
+}
+int utf8::width(char32_t cp) {
+  if (cp < 0x300) {
+    return 1;
+  }
+  if (within(zeroWidth, cp)) {
+    return 0;
+  }
+  return within(doubleWidth, cp) ? 2 : 1;
+}
+size_t utf8::lastStart(std::string_view s) {
+  if (s.empty()) {
+    return 0;
+  }
+  size_t i = s.size() - 1;
+  for (int k = 0; k < 3 && i > 0 && ((unsigned char)s[i] & 0xC0) == 0x80; ++k) {
+    i --;
+  }
+  return ((unsigned char)s[i] & 0xC0) == 0xC0 ? i : s.size() - 1;
+}
+int utf8::missing(std::string_view s) {
+  if (s.empty()) {
+    return 0;
+  }
+  size_t start = lastStart(s);
+  int len = sequenceLength((unsigned char)s[start]);
+  return std::max(0, len - (int)(s.size() - start));
+}
+std::string utf8::sanitize(std::string_view s) {
+  std::string out;
+  size_t i = 0, n = s.size();
+  while (i < n) {
+    size_t run = asciiPrefix(s.data() + i, n - i);
+    out.append(s, i, run);
+    if ((i += run) >= n) break;
+    char32_t cp;
+    int len = decode(s.data() + i, n - i, cp);
+    if (len) {
+      out.append(s, i, len);
+      i += len;
+    } else {
+      out += "\xEF\xBF\xBD";
+      i ++;
+    }
+  }
+  return out;
+}
+
+Columns::Columns(std::string_view line)
+    : text(line), marks(1, {0, 0}), walked(line.empty()), valid(utf8::valid(line)) {}
+// The end of the cluster starting at byte, and the cells it takes
+int Columns::cluster(int byte, int &cells) const {
+  const char *s = text.data();
+  int n = (int)text.size();
+  char32_t cp;
+  int len = utf8::decode(s + byte, n - byte, cp);
+  cells = len ? utf8::width(cp) : 1; // an invalid byte is shown as one U+FFFD
+  bool joined = len && cp == 0x200D, pairing = len && regional(cp); // after a ZWJ; after a lone regional indicator
+  int i = byte + std::max(len, 1);
+  while (i < n && (unsigned char)s[i] >= 0x80) {
+    if (!(len = utf8::decode(s + i, n - i, cp))) break;
+    int w = utf8::width(cp);
+    if (w == 0 || joined) {
+      // Extends the cluster
+    } else if (pairing && regional(cp)) {
+      cells += w; // a flag: two indicators, one cluster
+      pairing = false;
+    } else {
+      break;
+    }
+    joined = cp == 0x200D;
+    i += len;
+  }
+  return i;
+}
+// Moves a cluster start forward a cluster at a time while the next start
+// is at most maxByte and its column at most maxColumn
+void Columns::walk(int &byte, int &column, int maxByte, int maxColumn) const {
+  const char *s = text.data();
+  int n = (int)text.size();
+  while (byte < n) {
+    // Every byte of an ASCII run but the last is a cluster of its own
+    int run = (int)utf8::asciiPrefix(s + byte, n - byte) - 1;
+    if (run > 0) {
+      int k = std::max(0, std::min({run, maxByte - byte, maxColumn - column}));
+      byte += k;
+      column += k;
+      if (k < run) return;
+    }
+    int cells, end = cluster(byte, cells);
+    if (end > maxByte || column + cells > maxColumn) return;
+    byte = end;
+    column += cells;
+  }
+}
+// The last cluster start at most maxByte and at most maxColumn, walked
+// from the mark before it; the marks are laid down that far first
+std::pair<int, int> Columns::find(int maxByte, int maxColumn) const {
+  while (!walked && marks.back().first <= maxByte && marks.back().second <= maxColumn) {
+    auto [byte, column] = marks.back();
+    walk(byte, column, byte + STEP, INT_MAX);
+    if (byte == marks.back().first) {
+      int cells;
+      byte = cluster(byte, cells); // a cluster longer than STEP
+      column += cells;
+    }
+    marks.emplace_back(byte, column);
+    walked = byte == (int)text.size();
+  }
+  auto it = std::partition_point(marks.begin(), marks.end(), [&](const std::pair<int, int> &m) {
+    return m.first <= maxByte && m.second <= maxColumn;
+  });
+  auto [byte, column] = it == marks.begin() ? *it : *(it - 1);
+  walk(byte, column, maxByte, maxColumn);
+  return {byte, column};
+}
+int Columns::width() const {
+  return find(INT_MAX, INT_MAX).second;
+}
+int Columns::columnOf(int byte) const {
+  return find(byte, INT_MAX).second;
+}
+int Columns::byteAt(int column) const {
+  return find(INT_MAX, column).first;
+}
+int Columns::next(int byte) const {
+  int start = find(byte, INT_MAX).first, cells;
+  return start < (int)text.size() ? cluster(start, cells) : start;
+}
+int Columns::prev(int byte) const {
+  return byte > 0 ? find(byte - 1, INT_MAX).first : 0;
+}
+int Columns::last() const {
+  return text.empty() ? 0 : find((int)text.size() - 1, INT_MAX).first;
+}
+// Lays the rows of a line wrapped at width down until there are more
+// than row of them and one starts past byte, or the line ends
+void Columns::wrap(int width, int row, int byte) const {
+  if (width != wrapWidth) {
+    wrapWidth = width;
+    rowStarts.assign(1, {0, 0});
+    wrapped = text.empty();
+  }
+  while (!wrapped && ((int)rowStarts.size() <= row || rowStarts.back().first <= byte)) {
+    auto [from, column] = rowStarts.back();
+    int at = from, col = column;
+    walk(at, col, INT_MAX, column + width);
+    // A wide character that does not fit goes to the next row whole; one
+    // wider than a row stays where it is
+    if (col == column && at < (int)text.size()) {
+      int cells;
+      at = cluster(at, cells);
+      col += cells;
+    }
+    if (at == (int)text.size()) {
+      wrapped = true;
+    } else {
+      rowStarts.emplace_back(at, col);
+    }
+  }
+}
+int Columns::rows(int width, int limit) const {
+  wrap(width, limit - 1, -1);
+  return std::min((int)rowStarts.size(), limit);
+}
+int Columns::rowStart(int row, int width) const {
+  wrap(width, row, -1);
+  return row < (int)rowStarts.size() ? rowStarts[row].first : (int)text.size();
+}
+std::pair<int, int> Columns::place(int byte, int width) const {
+  wrap(width, 0, byte);
+  int row = (int)(std::upper_bound(rowStarts.begin(), rowStarts.end(), std::make_pair(byte, INT_MAX))
+                  - rowStarts.begin()) - 1;
+  auto [at, column] = rowStarts[row];
+  walk(at, column, byte, INT_MAX);
+  int col = column - rowStarts[row].second;
+  if (col >= width) {
+    return {row + 1, 0};
+  }
+  return {row, col};
+}
+// Heap bytes of the marks and the rows
+size_t Columns::bytes() const {
+  return (marks.capacity() + rowStarts.capacity()) * sizeof(std::pair<int, int>);
+}
+
+void ColumnCache::reset(size_t lines) {
+  kinds.assign(lines, UNKNOWN);
+  layouts.clear();
+}
+void ColumnCache::edit(int pos, int removed, int inserted) {
+  if ((int)kinds.size() < pos + removed) {
+    kinds.resize(pos + removed, UNKNOWN);
+  }
+  int common = std::min(removed, inserted);
+  std::fill(kinds.begin() + pos, kinds.begin() + pos + common, UNKNOWN);
+  if (removed > common) {
+    kinds.erase(kinds.begin() + pos + common, kinds.begin() + pos + removed);
+  } else {
+    kinds.insert(kinds.begin() + pos + common, inserted - common, UNKNOWN);
+  }
+  layouts.erase(layouts.lower_bound(pos), layouts.lower_bound(pos + removed));
+  if (removed != inserted) {
+    // Renumber the layouts below the edit
+    std::map<int, layout> moved;
+    for (auto it = layouts.lower_bound(pos + removed); it != layouts.end(); ) {
+      auto node = layouts.extract(it ++);
+      node.key() += inserted - removed;
+      moved.insert(std::move(node));
+    }
+    layouts.merge(moved);
+  }
+}
+const Columns *ColumnCache::get(int line, const Line &text) {
+  if (line >= (int)kinds.size()) {
+    kinds.resize(line + 1, UNKNOWN);
+  }
+  if (kinds[line] == UNKNOWN) {
+    kinds[line] = utf8::ascii(text) ? ASCII : WIDE;
+  }
+  if (kinds[line] == ASCII) {
+    return nullptr;
+  }
+  auto it = layouts.find(line);
+  if (it == layouts.end()) {
+    if (layouts.size() >= MAX_LAYOUTS) {
+      layouts.clear();
+    }
+    it = layouts.emplace(line, layout{text, Columns(text)}).first;
+  }
+  return &it->second.columns;
+}
+size_t ColumnCache::bytes() const {
+  size_t total = kinds.capacity();
+  for (const auto &entry: layouts) {
+    total += sizeof(entry) + 4 * sizeof(void *) // a node of the map
+             + entry.second.columns.bytes();
+  }
+  return total;
+}
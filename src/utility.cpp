@@ -6,6 +6,7 @@
 #include <cstdio>
 #include <sstream>
 #include <iomanip>
+#include <sys/stat.h>
 
 #include "utility.h"
 
@@ -43,6 +44,21 @@ std::string align_num(int x, int width) {
   oss << std::setw(width) << std::right << x;
   return oss.str();
 }
+fileStamp stamp_of(const std::string &file) {
+  fileStamp stamp;
+  struct stat st{};
+  if (stat(file.c_str(), &st) != 0) {
+    return stamp;
+  }
+#ifdef __APPLE__
+  stamp.mtime = (long long)st.st_mtimespec.tv_sec * 1000000000LL + st.st_mtimespec.tv_nsec;
+#else
+  stamp.mtime = (long long)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+#endif
+  stamp.size = st.st_size;
+  stamp.inode = st.st_ino;
+  return stamp;
+}
 namespace ANSI {
   std::string grey(const std::string &s) {
     return "\033[90m" + s + "\033[0m";
@@ -56,6 +72,15 @@ namespace ANSI {
   std::string purple(const std::string &s) {
     return "\033[95m" + s + "\033[0m";
   }
+  std::string reverse(const std::string &s) {
+    return "\033[7m" + s + "\033[27m";
+  }
+  std::string foreground(int code, const std::string &s) {
+    return "\033[" + std::to_string(code) + "m" + s + "\033[39m";
+  }
+  std::string background(int code, const std::string &s) {
+    return "\033[" + std::to_string(code) + "m" + s + "\033[49m";
+  }
   std::string clearScreen() {
     return "\033[2J";
   }
@@ -69,4 +94,16 @@ namespace ANSI {
   std::string backspace() {
     return "\033[D \033[D";
   }
+  std::string clearLine() {
+    return "\033[2K";
+  }
+  std::string eraseChars(int n) {
+    return "\033[" + std::to_string(n) + "X";
+  }
+  std::string scrollRegion(int top, int bottom) {
+    return "\033[" + std::to_string(top) + ";" + std::to_string(bottom) + "r";
+  }
+  std::string resetScrollRegion() {
+    return "\033[r";
+  }
 }
@@ -0,0 +1,128 @@
+#include <climits>
+#include <cstdlib>
+#include <map>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include "watcher.h"
+
+std::string Watcher::key(const std::string &dir, const std::string &name) {
+  return dir + "/" + name;
+}
+
+Watcher::Watcher() {
+#ifdef __linux__
+  fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#endif
+}
+
+Watcher::~Watcher() {
+  if (fd >= 0) {
+    close(fd);
+  }
+}
+
+// The directory is resolved, so ./a and /abs/dir/b share its watch and
+// both are found from the events on it
+void Watcher::add(const std::string &file) {
+  auto slash = file.find_last_of('/');
+  std::string dir = slash == std::string::npos ? "." : (slash == 0 ? "/" : file.substr(0, slash));
+  std::string name = slash == std::string::npos ? file : file.substr(slash + 1);
+  char real[PATH_MAX];
+  if (realpath(dir.c_str(), real)) {
+    dir = real;
+  }
+  auto &names = files[key(dir, name)];
+  if (std::find(names.begin(), names.end(), file) == names.end()) {
+    names.push_back(file);
+  }
+#ifdef __linux__
+  if (fd < 0) return;
+  for (const auto &entry: dirs) {
+    if (entry.second == dir) return;
+  }
+  int wd = inotify_add_watch(fd, dir.c_str(),
+                             IN_CLOSE_WRITE | IN_MODIFY | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE);
+  if (wd >= 0) {
+    dirs[wd] = dir;
+  }
+#endif
+}
+
+int Watcher::descriptor() const {
+  return fd;
+}
+
+// Until the next file written in place is quiet
+int Watcher::timeout() const {
+  if (fd < 0) {
+    return 1000;
+  }
+  int wait = -1;
+  for (const auto &entry: settling) {
+    auto left = std::chrono::duration_cast<std::chrono::milliseconds>(entry.second - clock::now());
+    int ms = std::max(0, (int)left.count());
+    wait = wait < 0 ? ms : std::min(wait, ms);
+  }
+  return wait;
+}
+
+// A write (IN_MODIFY) or a creation is reported incomplete at once, for a
+// file followed like tail -f, and again complete once it is quiet; closing
+// after writing, moving in and removing are complete.
+std::vector<Watcher::change> Watcher::drain() {
+  std::vector<change> changed;
+  auto report = [&](const std::string &k, bool complete) {
+    for (const auto &file: files[k]) {
+      auto seen = std::find_if(changed.begin(), changed.end(),
+                               [&](const change &c) { return c.file == file; });
+      if (seen == changed.end()) {
+        changed.push_back({file, complete});
+      } else {
+        seen->complete = seen->complete || complete;
+      }
+    }
+  };
+#ifdef __linux__
+  if (fd >= 0) {
+    alignas(inotify_event) char buf[4096];
+    while (true) {
+      ssize_t len = read(fd, buf, sizeof(buf));
+      if (len <= 0) break;
+      for (char *p = buf; p < buf + len; ) {
+        auto *event = reinterpret_cast<inotify_event *>(p);
+        p += sizeof(inotify_event) + event->len;
+        if (!event->len || !dirs.count(event->wd)) continue;
+        std::string k = key(dirs[event->wd], event->name);
+        if (!files.count(k)) continue;
+        bool complete = !(event->mask & (IN_MODIFY | IN_CREATE));
+        if (complete) {
+          settling.erase(k);
+        } else {
+          settling[k] = clock::now() + std::chrono::milliseconds(QUIET);
+        }
+        report(k, complete);
+      }
+    }
+    for (auto it = settling.begin(); it != settling.end(); ) {
+      if (it->second <= clock::now()) {
+        report(it->first, true);
+        it = settling.erase(it);
+      } else {
+        ++ it;
+      }
+    }
+    return changed;
+  }
+#endif
+  for (const auto &entry: files) {
+    report(entry.first, true);
+  }
+  return changed;
+}